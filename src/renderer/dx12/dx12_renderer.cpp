@@ -415,32 +415,32 @@ void cg::renderer::dx12_renderer::load_pipeline()
 
 	};
 
-	// Extract vertices and indices from model
+	// Extract vertices and indices from model. Material colors are vertex inputs of the shaders,
+	// so every face gets its own vertices with colors of its material
 	std::vector<d3d_vertex> vertices;
 	std::vector<UINT> indices;
-	UINT index_offset = 0;
+	const std::vector<material>& materials = model->get_materials();
 	for (size_t shape_idx = 0; shape_idx != model->get_index_buffers().size(); ++shape_idx)
 	{
-		for (size_t i = 0; i != model->get_vertex_buffers()[shape_idx]->get_number_of_elements(); ++i)
+		auto& index_buffer = model->get_index_buffers()[shape_idx];
+		auto& face_materials = model->get_per_shape_face_materials()[shape_idx];
+		const vertex_streams streams = model->get_vertex_streams(shape_idx);
+		for (size_t i = 0; i != index_buffer->get_number_of_elements(); ++i)
 		{
-			vertex& v = model->get_vertex_buffers()[shape_idx]->item(i);
+			const vertex v = streams.gather(index_buffer->item(i));
+			const material& m = materials[face_materials->item(i / 3)];
 			DirectX::XMFLOAT3 bary(i % 3 == 0, i % 3 == 1, i % 3 == 2);
 			d3d_vertex vert = {
 				DirectX::XMFLOAT4(v.position.x, v.position.y, v.position.z, 1.0f),
 				DirectX::XMFLOAT4(v.normal.x, v.normal.y, v.normal.z, 0.0f),
-				DirectX::XMFLOAT4(v.ambient.x, v.ambient.y, v.ambient.z, 1.0f),
-				DirectX::XMFLOAT4(v.diffuse.x, v.diffuse.y, v.diffuse.z, 1.0f),
-				DirectX::XMFLOAT4(v.emissive.x, v.emissive.y, v.emissive.z, 1.0f),
+				DirectX::XMFLOAT4(m.ambient.x, m.ambient.y, m.ambient.z, 1.0f),
+				DirectX::XMFLOAT4(m.diffuse.x, m.diffuse.y, m.diffuse.z, 1.0f),
+				DirectX::XMFLOAT4(m.emissive.x, m.emissive.y, m.emissive.z, 1.0f),
 				bary
 			};
 			vertices.emplace_back(vert);
+			indices.push_back(static_cast<UINT>(indices.size()));
 		}
-		for (size_t i = 0; i != model->get_index_buffers()[shape_idx]->get_number_of_elements(); ++i)
-		{
-			UINT& ind = model->get_index_buffers()[shape_idx]->item(i);
-			indices.push_back(ind + index_offset);
-		}
-		index_offset += static_cast<UINT>(model->get_vertex_buffers()[shape_idx]->get_number_of_elements());
 	}
 
 	const UINT vbByteSize = static_cast<UINT>(vertices.size()) * sizeof(d3d_vertex);
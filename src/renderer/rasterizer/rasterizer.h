@@ -1,206 +1,1765 @@
 #pragma once
 
 #include "resource.h"
+#include "utils/parallel.h"
+#include "world/meshlet.h"
 
+#include <DirectXCollision.h>
+#include <DirectXMath.h>
+#include <atomic>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <linalg.h>
 #include <memory>
+#include <numeric>
+#include <type_traits>
 
 
 using namespace linalg::aliases;
 
 namespace cg::renderer
 {
-	template<typename VB, typename RT>
+	// Per-draw uniform values. They are supplied once with set_constants
+	// and shared by every vertex shader invocation of the following draws
+	struct shader_constants
+	{
+		DirectX::XMMATRIX world;
+		DirectX::XMMATRIX view;
+		DirectX::XMMATRIX projection;
+		DirectX::XMMATRIX world_view_projection;
+	};
+
+	// Per-instance values of instanced draws. World matrix replaces the world constant,
+	// non-negative material id replaces material_id of the pixel shader if it has one
+	struct instance_data
+	{
+		DirectX::XMMATRIX world;
+		int material_id = -1;
+	};
+
+	// Vertex shader output: clip space position and attributes to interpolate.
+	// After viewport transform the position holds screen x, y, depth and 1/w
+	template<typename VB>
+	struct vertex_output
+	{
+		DirectX::XMFLOAT4 position;
+		VB attributes;
+	};
+
+	// Faces with counter-clockwise winding on the screen are front faces
+	enum class cull_mode
+	{
+		none,
+		front,
+		back
+	};
+
+	// Depth test comparison of incoming value against the stored one, in terms of
+	// distance to the camera for both regular and reversed-Z depth formats.
+	// Equal is used after a depth pre-pass to shade only visible fragments
+	enum class depth_function
+	{
+		less,
+		less_equal,
+		equal
+	};
+
+	// std::function shaders are a fallback for quick experiments. Functor types
+	// passed as template arguments are inlined into the pipeline loops
+	template<typename VB>
+	using vertex_shader_function = std::function<vertex_output<VB>(const VB& vertex_data, const shader_constants& constants)>;
+
+	template<typename VB>
+	using pixel_shader_function = std::function<cg::color(const VB& vertex_data, const float b, const float z)>;
+
+	// Screen space derivatives of texture coordinates, used for mip level selection.
+	// They are computed only for pixel shaders taking them as the last argument
+	struct uv_derivatives
+	{
+		DirectX::XMFLOAT2 ddx;
+		DirectX::XMFLOAT2 ddy;
+	};
+
+	// G-buffer texel written by the geometry pass of deferred shading.
+	// Depth is kept in the depth buffer of the pass
+	struct gbuffer_texel
+	{
+		DirectX::XMFLOAT3 normal;
+		DirectX::XMFLOAT3 albedo;
+		unsigned int material_id;
+	};
+
+	// Draw recorded by command_list together with everything it reads
+	template<typename VB, typename PS>
+	struct draw_command
+	{
+		std::shared_ptr<resource<VB>> vertex_buffer;
+		vertex_streams streams;
+		std::shared_ptr<resource<compact_vertex>> compact_vertex_buffer;
+		vertex_quantization quantization{};
+		std::shared_ptr<resource<unsigned int>> index_buffer;
+		std::shared_ptr<cg::world::meshlet_list> meshlets;
+		std::shared_ptr<resource<unsigned int>> face_materials;
+		std::shared_ptr<resource<instance_data>> instances;
+		size_t num_indices = 0;
+		shader_constants constants;
+		PS pixel_shader;
+		depth_function depth_comparison = depth_function::less;
+		bool depth_only = false;
+		// Draws with equal state keys share resources like material or texture
+		unsigned int state_key = 0;
+		float sort_depth = 0.0f;
+	};
+
+	// Records draws instead of running them. Bound buffers, constants and pixel shader are copied
+	// into every command, so lists may be recorded on several threads and merged with append()
+	template<typename VB, typename PS = pixel_shader_function<VB>>
+	class command_list
+	{
+	public:
+		void set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer);
+		void set_vertex_streams(const vertex_streams& in_streams);
+		void set_compact_vertex_buffer(std::shared_ptr<resource<compact_vertex>> in_vertex_buffer,
+									   const vertex_quantization& in_quantization);
+		void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
+		void set_meshlets(std::shared_ptr<cg::world::meshlet_list> in_meshlets);
+		void set_face_materials(std::shared_ptr<resource<unsigned int>> in_face_materials);
+		void set_constants(const shader_constants& in_constants);
+		void set_pixel_shader(const PS& in_pixel_shader);
+		void set_depth_function(depth_function in_depth_function);
+		// State key and distance to the camera of the following draws, used to order them on execution
+		void set_sort_key(unsigned int in_state_key, float in_sort_depth = 0.0f);
+
+		void draw(size_t num_indices);
+		void draw_depth_only(size_t num_indices);
+		void draw_instanced(size_t num_indices, std::shared_ptr<resource<instance_data>> instances);
+		void draw_depth_only_instanced(size_t num_indices, std::shared_ptr<resource<instance_data>> instances);
+
+		void append(const command_list& other);
+		void reset();
+		const std::vector<draw_command<VB, PS>>& get_commands() const;
+
+	protected:
+		draw_command<VB, PS> state;
+		std::vector<draw_command<VB, PS>> commands;
+
+		void record(size_t num_indices, bool depth_only, std::shared_ptr<resource<instance_data>> instances);
+	};
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer)
+	{
+		state.vertex_buffer = in_vertex_buffer;
+		state.streams = {};
+		state.compact_vertex_buffer = nullptr;
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::set_vertex_streams(const vertex_streams& in_streams)
+	{
+		state.vertex_buffer = nullptr;
+		state.streams = in_streams;
+		state.compact_vertex_buffer = nullptr;
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::set_compact_vertex_buffer(
+			std::shared_ptr<resource<compact_vertex>> in_vertex_buffer, const vertex_quantization& in_quantization)
+	{
+		state.vertex_buffer = nullptr;
+		state.streams = {};
+		state.compact_vertex_buffer = in_vertex_buffer;
+		state.quantization = in_quantization;
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer)
+	{
+		state.index_buffer = in_index_buffer;
+		state.meshlets = nullptr;
+		state.face_materials = nullptr;
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::set_meshlets(std::shared_ptr<cg::world::meshlet_list> in_meshlets)
+	{
+		state.meshlets = in_meshlets;
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::set_face_materials(std::shared_ptr<resource<unsigned int>> in_face_materials)
+	{
+		state.face_materials = in_face_materials;
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::set_constants(const shader_constants& in_constants)
+	{
+		state.constants = in_constants;
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::set_pixel_shader(const PS& in_pixel_shader)
+	{
+		state.pixel_shader = in_pixel_shader;
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::set_depth_function(depth_function in_depth_function)
+	{
+		state.depth_comparison = in_depth_function;
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::set_sort_key(unsigned int in_state_key, float in_sort_depth)
+	{
+		state.state_key = in_state_key;
+		state.sort_depth = in_sort_depth;
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::draw(size_t num_indices)
+	{
+		record(num_indices, false, nullptr);
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::draw_depth_only(size_t num_indices)
+	{
+		record(num_indices, true, nullptr);
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::draw_instanced(
+			size_t num_indices, std::shared_ptr<resource<instance_data>> instances)
+	{
+		record(num_indices, false, instances);
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::draw_depth_only_instanced(
+			size_t num_indices, std::shared_ptr<resource<instance_data>> instances)
+	{
+		record(num_indices, true, instances);
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::append(const command_list& other)
+	{
+		commands.insert(commands.end(), other.commands.begin(), other.commands.end());
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::reset()
+	{
+		commands.clear();
+	}
+
+	template<typename VB, typename PS>
+	inline const std::vector<draw_command<VB, PS>>& command_list<VB, PS>::get_commands() const
+	{
+		return commands;
+	}
+
+	template<typename VB, typename PS>
+	inline void command_list<VB, PS>::record(
+			size_t num_indices, bool depth_only, std::shared_ptr<resource<instance_data>> instances)
+	{
+		if ((!state.vertex_buffer && !state.streams.positions && !state.compact_vertex_buffer) || !state.index_buffer) {
+			THROW_ERROR("Vertex and index buffers have to be set before a draw is recorded");
+		}
+		commands.push_back(state);
+		commands.back().num_indices = num_indices;
+		commands.back().depth_only = depth_only;
+		commands.back().instances = instances;
+	}
+
+	// Triangles rasterized by each path since the last reset, and 8x8 blocks visited by the
+	// hierarchical path: fully covered ones skip coverage tests, rejected ones are skipped entirely.
+	// Meshlets are counted per instance
+	struct rasterization_statistics
+	{
+		size_t small_triangles;
+		size_t scanned_triangles;
+		size_t hierarchical_triangles;
+		size_t covered_blocks;
+		size_t partial_blocks;
+		size_t rejected_blocks;
+		size_t visible_meshlets;
+		size_t frustum_culled_meshlets;
+		size_t cone_culled_meshlets;
+	};
+
+	// DB is one of depth formats from resource.h, direction of depth test follows from it
+	template<typename VB, typename RT,
+			 typename VS = vertex_shader_function<VB>,
+			 typename PS = pixel_shader_function<VB>,
+			 typename DB = depth32f>
 	class rasterizer
 	{
+		static_assert(std::is_invocable_r_v<vertex_output<VB>, VS&, const VB&, const shader_constants&>,
+					  "Vertex shader has to be callable as vertex_output<VB>(const VB&, const shader_constants&)");
+		static constexpr bool pixel_shader_reads_derivatives =
+				std::is_invocable_v<PS&, const VB&, const float, const float, const uv_derivatives&>;
+		static_assert(pixel_shader_reads_derivatives || std::is_invocable_v<PS&, const VB&, const float, const float>,
+					  "Pixel shader has to be callable as (const VB&, float, float) or (const VB&, float, float, const uv_derivatives&)");
+
+		// Pixel shader returns either a render target texel or a color to convert
+		using pixel_shader_output = typename std::conditional_t<
+				pixel_shader_reads_derivatives,
+				std::invoke_result<PS&, const VB&, const float, const float, const uv_derivatives&>,
+				std::invoke_result<PS&, const VB&, const float, const float>>::type;
+
+		template<typename T, typename = void>
+		struct has_material_id : std::false_type
+		{};
+		template<typename T>
+		struct has_material_id<T, std::void_t<decltype(std::declval<T&>().material_id)>> : std::true_type
+		{};
+
 	public:
 		rasterizer(){};
 		~rasterizer(){};
 		void set_render_target(
 				std::shared_ptr<resource<RT>> in_render_target,
-				std::shared_ptr<resource<float>> in_depth_buffer = nullptr);
+				std::shared_ptr<resource<DB>> in_depth_buffer = nullptr);
+		// Depth is cleared to the far plane of the depth format unless given
 		void clear_render_target(
-				const float in_depth = FLT_MIN);
+				const float in_depth = DB::far_depth);
 
 		void set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer);
+		// Separate attribute streams replace the vertex buffer. Depth-only draws read the position stream only,
+		// other draws gather vertices from all streams before the vertex shader
+		void set_vertex_streams(const vertex_streams& in_streams);
+		// Vertices quantized in a box replace the vertex buffer, they are decoded in the vertex stage.
+		// Binding one kind of vertex input unbinds the others. Streams and compact vertices are
+		// turned into VB of cg::vertex only
+		void set_compact_vertex_buffer(std::shared_ptr<resource<compact_vertex>> in_vertex_buffer,
+									   const vertex_quantization& in_quantization);
 		void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
+		// Meshlets of the bound index buffer, binding an index buffer unbinds them. Meshlets outside
+		// of the frustum or facing away from the camera are culled before the vertex stage,
+		// vertices of visible ones are transformed in parallel
+		void set_meshlets(std::shared_ptr<cg::world::meshlet_list> in_meshlets);
+		// Material id of every face of the bound index buffer, binding an index buffer unbinds them.
+		// It replaces material_id of the pixel shader if it has one, unless an instance gives its own
+		void set_face_materials(std::shared_ptr<resource<unsigned int>> in_face_materials);
 
 		void set_viewport(size_t in_width, size_t in_height);
+		// Renders only rows [first_row, first_row + rows) of the viewport, surfaces hold just these rows.
+		// Viewport sets the band to the whole image
+		void set_band(size_t in_first_row, size_t in_rows);
+
+		void set_constants(const shader_constants& in_constants);
+
+		void set_cull_mode(cull_mode in_cull_mode);
+
+		// Mask of vertex_attribute flags the pixel shader reads, others are not interpolated
+		void set_pixel_shader_inputs(unsigned int in_attributes);
+
+		void set_depth_function(depth_function in_depth_function);
+
+		// Multi-sample anti-aliasing with 1, 4 or 8 samples per pixel. Coverage and depth
+		// are per sample, pixel shader runs once per pixel per triangle.
+		// Samples are averaged into the render target by resolve()
+		void set_sample_count(unsigned int in_sample_count);
+		// Averages samples into the render target and writes clear color to pixels nothing was drawn into.
+		// Must be called before the render target is read
+		void resolve();
 
 		void draw(size_t num_indices);
 
-		std::function<VB(VB vertex_data)> vertex_shader;
-		std::function<cg::color(const VB& vertex_data, const float b, const float z)> pixel_shader;
+		// Depth pre-pass: only positions are transformed with world_view_projection constant,
+		// only depth buffer is written and shaders are not executed
+		void draw_depth_only(size_t num_indices);
+
+		// Draws the bound buffers once per instance with view and projection constants of the draw.
+		// Each unique vertex is transformed once per instance
+		void draw_instanced(size_t num_indices, std::shared_ptr<resource<instance_data>> instances);
+		void draw_depth_only_instanced(size_t num_indices, std::shared_ptr<resource<instance_data>> instances);
+
+		// Runs recorded draws with the cull mode of the rasterizer. Depth-only draws go first,
+		// others are sorted by state key and, if front_to_back is set, by sort depth.
+		// Triangles are binned into horizontal strips which are rasterized in parallel,
+		// inside a strip they keep the submission order. Pixel shaders are called concurrently
+		void execute(const command_list<VB, PS>& list, bool front_to_back = false);
+
+		// Screen rectangle (min x, min y, max x, max y) and nearest depth of a box transformed
+		// by world_view_projection constant. Returns false if the box crosses the near plane
+		bool project_box(const DirectX::BoundingBox& box, float4& screen_rect, float& nearest_depth) const;
+
+		// Hierarchical depth built from depth drawn so far. Level 0 has half resolution,
+		// every level keeps the farthest depth of 2x2 texels of the previous one
+		void build_depth_pyramid();
+		// Conservative test of a box against the depth pyramid, boxes outside of the viewport are occluded too
+		bool is_occluded(const DirectX::BoundingBox& box) const;
+
+		rasterization_statistics get_statistics() const;
+		void reset_statistics();
+
+		VS vertex_shader;
+		PS pixel_shader;
 
 	protected:
 		std::shared_ptr<cg::resource<VB>> vertex_buffer;
+		vertex_streams streams;
+		std::shared_ptr<cg::resource<compact_vertex>> compact_vertex_buffer;
+		vertex_quantization quantization{};
 		std::shared_ptr<cg::resource<unsigned int>> index_buffer;
+		std::shared_ptr<cg::world::meshlet_list> meshlets;
+		std::shared_ptr<cg::resource<unsigned int>> face_materials;
 		std::shared_ptr<cg::resource<RT>> render_target;
-		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<DB>> depth_buffer;
+
+		shader_constants constants;
+		cull_mode culling = cull_mode::none;
+		depth_function depth_comparison = depth_function::less;
+		unsigned int pixel_shader_inputs = vertex_attribute::all;
+
+		// Outcodes of the clip space frustum planes
+		enum clip_plane : unsigned char
+		{
+			clip_left = 1 << 0,
+			clip_right = 1 << 1,
+			clip_bottom = 1 << 2,
+			clip_top = 1 << 3,
+			clip_near = 1 << 4,
+			clip_far = 1 << 5
+		};
 
+		// Post-transform vertex buffer: each unique vertex of the bound vertex buffer
+		// is shaded once per draw, faces fetch the results by index.
+		// Screen space vertices are only valid for vertices in front of the near plane,
+		// faces crossing near or far planes are clipped from the clip space data
+		std::vector<vertex_output<VB>> post_transform_buffer;
+		std::vector<vertex_output<VB>> clip_space_buffer;
+		std::vector<unsigned char> clip_codes;
+
+		// Meshlets left by culling and the visible meshlet transforming each vertex,
+		// so vertices shared by meshlets are transformed once
+		static constexpr size_t no_meshlet = ~size_t(0);
+		// Smaller draws transform their vertices on the calling thread, handing them to the pool costs more
+		static constexpr size_t parallel_vertex_threshold = 2048;
+		std::vector<size_t> visible_meshlet_ids;
+		std::vector<size_t> vertex_owners;
+		std::atomic<size_t> visible_meshlets{0};
+		std::atomic<size_t> frustum_culled_meshlets{0};
+		std::atomic<size_t> cone_culled_meshlets{0};
+
+		// Height is the number of rows of the current band
 		size_t width = 1920;
 		size_t height = 1080;
+		size_t viewport_height = 1080;
+		size_t band_first_row = 0;
+
+		// Multisampled surfaces store samples of a pixel next to each other.
+		// With a single sample the render target and depth buffer are used directly
+		unsigned int sample_count = 1;
+		std::vector<float2> sample_offsets{float2{0.0f, 0.0f}};
+		std::shared_ptr<cg::resource<RT>> multisample_target;
+		std::shared_ptr<cg::resource<DB>> multisample_depth;
+
+		// Fast clear: color is not written by clear_render_target. Every 8x8 tile keeps a mask
+		// of pixels still holding the clear color, they get it on the first draw or in resolve()
+		static constexpr size_t clear_tile_size = 8;
+		size_t clear_tiles_x = 0;
+		std::vector<uint64_t> pending_clear;
+
+		RT get_clear_value(size_t x, size_t y) const;
+		void write_pending_clear(size_t x, size_t y);
+		static void fill_depth(cg::resource<DB>& surface, float value);
+
+		struct depth_pyramid_level
+		{
+			size_t width;
+			size_t height;
+			std::vector<float> depth;
+		};
+		std::vector<depth_pyramid_level> depth_pyramid;
+
+		static float farther(float a, float b);
+
+		void allocate_multisample_surfaces();
+		cg::resource<RT>& get_color_surface();
+		cg::resource<DB>& get_depth_surface();
+
+		// Vertex stage and primitive assembly of a draw, only visible meshlets are processed if they are bound
+		template<bool depth_only, typename F>
+		void process_geometry(size_t num_indices, const F& emit);
+		void cull_meshlets(size_t num_indices);
+		template<bool depth_only>
+		void run_vertex_stage();
+		// Reads whichever vertex input is bound, W of the position is zero
+		size_t get_vertex_count() const;
+		DirectX::XMVECTOR fetch_position(size_t index) const;
+		// Clips faces of a range of the bound index buffer and passes screen space triangles
+		// to emit together with the index of their face
+		template<typename F>
+		void assemble_primitives(size_t first_index, size_t num_indices, const F& emit);
+		template<bool depth_only>
+		void draw_instances(size_t num_indices, cg::resource<instance_data>& instances);
+		void bind_instance(const instance_data& instance, const DirectX::XMMATRIX& view_projection,
+						   unsigned int draw_material_id, PS& shader);
+		static unsigned int get_material_id(const PS& shader);
+
+		// Binning: strips are a multiple of clear tiles high, so fast clear masks are not shared
+		static constexpr size_t bin_strip_height = 4 * clear_tile_size;
+		struct binned_draw
+		{
+			PS pixel_shader;
+			depth_function depth_comparison;
+			bool depth_only;
+			cg::resource<unsigned int>* face_materials;
+		};
+		struct binned_triangle
+		{
+			std::array<vertex_output<VB>, 3> face;
+			size_t face_index;
+			size_t draw;
+		};
+		vertex_output<VB> to_screen_space(const vertex_output<VB>& vertex_data) const;
+		static unsigned char compute_clip_code(const DirectX::XMFLOAT4& position);
+		static void clip_polygon(
+				const std::vector<vertex_output<VB>>& polygon,
+				std::vector<vertex_output<VB>>& result,
+				clip_plane plane);
+
+		// Triangles with bounding box of at most small_triangle_pixels skip edge equation setup,
+		// those spanning at least two blocks in both directions are traversed block by block
+		static constexpr int small_triangle_pixels = 16;
+		static constexpr size_t hierarchical_block_size = 8;
+		std::atomic<size_t> small_triangles{0};
+		std::atomic<size_t> scanned_triangles{0};
+		std::atomic<size_t> hierarchical_triangles{0};
+		std::atomic<size_t> covered_blocks{0};
+		std::atomic<size_t> partial_blocks{0};
+		std::atomic<size_t> rejected_blocks{0};
+
+		// Face materials are null if they don't apply to the draw
+		template<bool depth_only>
+		void rasterize_face(const std::array<vertex_output<VB>, 3>& face, size_t face_index, PS& shader,
+							cg::resource<unsigned int>* materials, depth_function comparison, int y_min, int y_max);
+		// Rows outside of [y_min, y_max] are skipped
+		template<bool depth_only>
+		void rasterize_triangle(const std::array<vertex_output<VB>, 3>& face, PS& shader,
+								depth_function comparison, int y_min, int y_max);
 
 		float edge_function(float2 a, float2 b, float2 c);
-		bool depth_test(float z, size_t x, size_t y);
+		static bool depth_test(float z, float stored_depth, depth_function comparison);
 	};
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_render_target(
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_render_target(
 			std::shared_ptr<resource<RT>> in_render_target,
-			std::shared_ptr<resource<float>> in_depth_buffer)
+			std::shared_ptr<resource<DB>> in_depth_buffer)
 	{
 		//THROW_ERROR("Not implemented yet");
 		render_target = in_render_target;
 		depth_buffer = in_depth_buffer;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::clear_render_target(
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::clear_render_target(
 			const float in_depth)
 	{
 		//THROW_ERROR("Not implemented yet");
 
-		// Clear render target by painting it to linear gradient
+		// Color is only marked as cleared, pixels get the value lazily
 		if (render_target) {
-			for (size_t y = 0; y != height; ++y) {
-				for (size_t x = 0; x != width; ++x) {
-					render_target->item(x, y) = unsigned_color::from_float3({float(x) / width, float(y) / height, 1});
-				}
-			}
+			std::fill(pending_clear.begin(), pending_clear.end(), ~uint64_t(0));
 		}
+		// Depth is read by every depth test, so it is filled right away
 		if (depth_buffer) {
-			for (size_t y = 0; y != height; ++y) {
-				for (size_t x = 0; x != width; ++x) {
-					depth_buffer->item(x, y) = in_depth;
-				}
+			fill_depth(*depth_buffer, in_depth);
+		}
+		if (multisample_depth) {
+			fill_depth(*multisample_depth, in_depth);
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline RT rasterizer<VB, RT, VS, PS, DB>::get_clear_value(size_t x, size_t y) const
+	{
+		// Color render target is cleared to linear gradient,
+		// other formats like G-buffer are cleared to default value
+		if constexpr (is_color_format<RT>) {
+			return RT::from_float3({float(x) / width, float(y + band_first_row) / viewport_height, 1});
+		}
+		else {
+			return RT{};
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::write_pending_clear(size_t x, size_t y)
+	{
+		uint64_t& mask = pending_clear[(y / clear_tile_size) * clear_tiles_x + x / clear_tile_size];
+		const uint64_t bit = uint64_t(1) << ((y % clear_tile_size) * clear_tile_size + x % clear_tile_size);
+		if (!(mask & bit)) {
+			return;
+		}
+		mask &= ~bit;
+
+		// Single sample is overwritten by the caller, samples not covered by the draw need the clear value
+		if (sample_count != 1) {
+			const RT value = get_clear_value(x, y);
+			for (size_t s = 0; s != sample_count; ++s) {
+				multisample_target->item(x * sample_count + s, y) = value;
 			}
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_vertex_buffer(
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::fill_depth(cg::resource<DB>& surface, float value)
+	{
+		const size_t count = surface.get_number_of_elements();
+		if (count == 0) {
+			return;
+		}
+		DB* data = &surface.item(0);
+		const DB encoded = DB::from_depth(value);
+
+		size_t i = 0;
+		if constexpr (sizeof(DB) == sizeof(float)) {
+			// Four values per store
+			float bits;
+			std::memcpy(&bits, &encoded, sizeof(float));
+			const DirectX::XMVECTOR values = DirectX::XMVectorReplicate(bits);
+			for (; i + 4 <= count; i += 4) {
+				DirectX::XMStoreFloat4(reinterpret_cast<DirectX::XMFLOAT4*>(data + i), values);
+			}
+		}
+		std::fill(data + i, data + count, encoded);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_vertex_buffer(
 			std::shared_ptr<resource<VB>> in_vertex_buffer)
 	{
 		//THROW_ERROR("Not implemented yet");
 		vertex_buffer = in_vertex_buffer;
+		streams = {};
+		compact_vertex_buffer = nullptr;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_vertex_streams(const vertex_streams& in_streams)
+	{
+		static_assert(std::is_same_v<VB, cg::vertex>, "Vertex streams are gathered into cg::vertex only");
+		vertex_buffer = nullptr;
+		streams = in_streams;
+		compact_vertex_buffer = nullptr;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_compact_vertex_buffer(
+			std::shared_ptr<resource<compact_vertex>> in_vertex_buffer, const vertex_quantization& in_quantization)
+	{
+		static_assert(std::is_same_v<VB, cg::vertex>, "Compact vertices are decoded into cg::vertex only");
+		vertex_buffer = nullptr;
+		streams = {};
+		compact_vertex_buffer = in_vertex_buffer;
+		quantization = in_quantization;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_index_buffer(
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_index_buffer(
 			std::shared_ptr<resource<unsigned int>> in_index_buffer)
 	{
 		//THROW_ERROR("Not implemented yet");
 		index_buffer = in_index_buffer;
+		meshlets = nullptr;
+		face_materials = nullptr;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_viewport(size_t in_width, size_t in_height)
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_meshlets(std::shared_ptr<cg::world::meshlet_list> in_meshlets)
+	{
+		meshlets = in_meshlets;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_face_materials(std::shared_ptr<resource<unsigned int>> in_face_materials)
+	{
+		face_materials = in_face_materials;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_viewport(size_t in_width, size_t in_height)
 	{
 		//THROW_ERROR("Not implemented yet");
 		width = in_width;
-		height = in_height;
+		viewport_height = in_height;
+		set_band(0, in_height);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_band(size_t in_first_row, size_t in_rows)
+	{
+		if (in_rows == 0 || in_first_row + in_rows > viewport_height) {
+			THROW_ERROR("Band is outside of the viewport");
+		}
+		band_first_row = in_first_row;
+		height = in_rows;
+		allocate_multisample_surfaces();
+
+		clear_tiles_x = (width + clear_tile_size - 1) / clear_tile_size;
+		pending_clear.assign(clear_tiles_x * ((height + clear_tile_size - 1) / clear_tile_size), 0);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_constants(const shader_constants& in_constants)
+	{
+		constants = in_constants;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_cull_mode(cull_mode in_cull_mode)
+	{
+		culling = in_cull_mode;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_pixel_shader_inputs(unsigned int in_attributes)
+	{
+		pixel_shader_inputs = in_attributes;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_depth_function(depth_function in_depth_function)
+	{
+		depth_comparison = in_depth_function;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::set_sample_count(unsigned int in_sample_count)
+	{
+		// Standard D3D sample patterns, offsets from pixel center in 1/16 of pixel
+		switch (in_sample_count) {
+			case 1:
+				sample_offsets = {{0, 0}};
+				break;
+			case 4:
+				sample_offsets = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+				break;
+			case 8:
+				sample_offsets = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+				break;
+			default:
+				THROW_ERROR("Unsupported MSAA sample count: " + std::to_string(in_sample_count));
+		}
+		for (float2& offset : sample_offsets) {
+			offset = float2{offset.x / 16.0f, offset.y / 16.0f};
+		}
+
+		sample_count = in_sample_count;
+		allocate_multisample_surfaces();
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::allocate_multisample_surfaces()
+	{
+		if (sample_count == 1) {
+			multisample_target = nullptr;
+			multisample_depth = nullptr;
+			return;
+		}
+		multisample_target = std::make_shared<resource<RT>>(width * sample_count, height);
+		multisample_depth = std::make_shared<resource<DB>>(width * sample_count, height);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline cg::resource<RT>& rasterizer<VB, RT, VS, PS, DB>::get_color_surface()
+	{
+		return sample_count == 1 ? *render_target : *multisample_target;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline cg::resource<DB>& rasterizer<VB, RT, VS, PS, DB>::get_depth_surface()
+	{
+		return sample_count == 1 ? *depth_buffer : *multisample_depth;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::resolve()
+	{
+		auto is_pending = [this](size_t x, size_t y) {
+			const uint64_t mask = pending_clear[(y / clear_tile_size) * clear_tiles_x + x / clear_tile_size];
+			return (mask >> ((y % clear_tile_size) * clear_tile_size + x % clear_tile_size)) & 1;
+		};
+
+		if (sample_count == 1) {
+			if (!render_target) {
+				return;
+			}
+			// Tiles fully covered by draws are skipped
+			const size_t clear_tiles_y = pending_clear.size() / std::max<size_t>(clear_tiles_x, 1);
+			utils::parallel_for(0, clear_tiles_y, [&](size_t tile_y) {
+				for (size_t tile_x = 0; tile_x != clear_tiles_x; ++tile_x) {
+					uint64_t& mask = pending_clear[tile_y * clear_tiles_x + tile_x];
+					if (mask == 0) {
+						continue;
+					}
+					const size_t y_to = std::min((tile_y + 1) * clear_tile_size, height);
+					const size_t x_to = std::min((tile_x + 1) * clear_tile_size, width);
+					for (size_t y = tile_y * clear_tile_size; y != y_to; ++y) {
+						for (size_t x = tile_x * clear_tile_size; x != x_to; ++x) {
+							if (is_pending(x, y)) {
+								render_target->item(x, y) = get_clear_value(x, y);
+							}
+						}
+					}
+					mask = 0;
+				}
+			});
+			return;
+		}
+
+		// Color samples are averaged, depth keeps the farthest sample
+		// so the resolved depth stays conservative for later depth tests
+		const float inv_sample_count = 1.0f / static_cast<float>(sample_count);
+		utils::parallel_for(0, height, [&](size_t y) {
+			for (size_t x = 0; x != width; ++x) {
+				if (render_target && is_pending(x, y)) {
+					render_target->item(x, y) = get_clear_value(x, y);
+				}
+				else if (render_target) {
+					float3 sum{0.0f, 0.0f, 0.0f};
+					for (size_t s = 0; s != sample_count; ++s) {
+						const float3 sample = multisample_target->item(x * sample_count + s, y).to_float3();
+						sum = float3{sum.x + sample.x, sum.y + sample.y, sum.z + sample.z};
+					}
+					render_target->item(x, y) = RT::from_float3(
+							float3{sum.x * inv_sample_count, sum.y * inv_sample_count, sum.z * inv_sample_count});
+				}
+				if (depth_buffer) {
+					DB depth = multisample_depth->item(x * sample_count, y);
+					for (size_t s = 1; s != sample_count; ++s) {
+						const DB& sample = multisample_depth->item(x * sample_count + s, y);
+						if (DB::reversed_z ? sample.to_depth() < depth.to_depth() : sample.to_depth() > depth.to_depth()) {
+							depth = sample;
+						}
+					}
+					depth_buffer->item(x, y) = depth;
+				}
+			}
+		});
+		std::fill(pending_clear.begin(), pending_clear.end(), 0);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline bool rasterizer<VB, RT, VS, PS, DB>::project_box(
+			const DirectX::BoundingBox& box, float4& screen_rect, float& nearest_depth) const
+	{
+		DirectX::XMFLOAT3 corners[DirectX::BoundingBox::CORNER_COUNT];
+		box.GetCorners(corners);
+
+		screen_rect = float4{FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX};
+		nearest_depth = DB::reversed_z ? -FLT_MAX : FLT_MAX;
+		for (const DirectX::XMFLOAT3& corner : corners) {
+			DirectX::XMFLOAT4 clip;
+			DirectX::XMStoreFloat4(&clip, DirectX::XMVector4Transform(
+												  DirectX::XMVectorSetW(DirectX::XMLoadFloat3(&corner), 1.0f),
+												  constants.world_view_projection));
+			// Corners closer than the near plane have no meaningful projection
+			if (clip.w <= 0.0f || (DB::reversed_z ? clip.z > clip.w : clip.z < 0.0f)) {
+				return false;
+			}
+
+			// Same mapping as to_screen_space
+			const float inv_w = 1.0f / clip.w;
+			const float x = (clip.x * inv_w + 1.0f) * 0.5f * static_cast<float>(width);
+			const float y = (1.0f - clip.y * inv_w) * 0.5f * static_cast<float>(viewport_height) -
+							static_cast<float>(band_first_row);
+			const float z = clip.z * inv_w;
+			screen_rect = float4{std::min(screen_rect.x, x), std::min(screen_rect.y, y),
+								 std::max(screen_rect.z, x), std::max(screen_rect.w, y)};
+			nearest_depth = DB::reversed_z ? std::max(nearest_depth, z) : std::min(nearest_depth, z);
+		}
+		return true;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline float rasterizer<VB, RT, VS, PS, DB>::farther(float a, float b)
+	{
+		return DB::reversed_z ? std::min(a, b) : std::max(a, b);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::build_depth_pyramid()
+	{
+		const float nearest_value = DB::reversed_z ? FLT_MAX : -FLT_MAX;
+		cg::resource<DB>& depth_surface = get_depth_surface();
+
+		// Level 0 reduces 2x2 pixels with all their samples
+		depth_pyramid.clear();
+		depth_pyramid.push_back({(width + 1) / 2, (height + 1) / 2, {}});
+		depth_pyramid.back().depth.resize(depth_pyramid.back().width * depth_pyramid.back().height);
+		utils::parallel_for(0, depth_pyramid.back().height, [&](size_t y) {
+			depth_pyramid_level& level = depth_pyramid.back();
+			for (size_t x = 0; x != level.width; ++x) {
+				float depth = nearest_value;
+				for (size_t py = 2 * y; py != std::min(2 * y + 2, height); ++py) {
+					for (size_t px = 2 * x; px != std::min(2 * x + 2, width); ++px) {
+						for (size_t s = 0; s != sample_count; ++s) {
+							depth = farther(depth, depth_surface.item(px * sample_count + s, py).to_depth());
+						}
+					}
+				}
+				level.depth[y * level.width + x] = depth;
+			}
+		});
+
+		while (depth_pyramid.back().width > 1 || depth_pyramid.back().height > 1) {
+			const depth_pyramid_level& previous = depth_pyramid.back();
+			depth_pyramid_level level{
+					std::max<size_t>((previous.width + 1) / 2, 1),
+					std::max<size_t>((previous.height + 1) / 2, 1),
+					{}};
+			level.depth.resize(level.width * level.height);
+			for (size_t y = 0; y != level.height; ++y) {
+				for (size_t x = 0; x != level.width; ++x) {
+					float depth = nearest_value;
+					for (size_t py = 2 * y; py != std::min(2 * y + 2, previous.height); ++py) {
+						for (size_t px = 2 * x; px != std::min(2 * x + 2, previous.width); ++px) {
+							depth = farther(depth, previous.depth[py * previous.width + px]);
+						}
+					}
+					level.depth[y * level.width + x] = depth;
+				}
+			}
+			depth_pyramid.push_back(std::move(level));
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline bool rasterizer<VB, RT, VS, PS, DB>::is_occluded(const DirectX::BoundingBox& box) const
+	{
+		float4 rect;
+		float nearest_depth;
+		if (depth_pyramid.empty() || !project_box(box, rect, nearest_depth)) {
+			return false;
+		}
+		if (rect.z < 0.0f || rect.w < 0.0f ||
+			rect.x >= static_cast<float>(width) || rect.y >= static_cast<float>(height)) {
+			return true;
+		}
+		rect = float4{std::max(rect.x, 0.0f), std::max(rect.y, 0.0f),
+					  std::min(rect.z, static_cast<float>(width - 1)), std::min(rect.w, static_cast<float>(height - 1))};
+
+		// The coarsest level where the rectangle spans at most 2x2 texels
+		const float extent = std::max(rect.z - rect.x, rect.w - rect.y) * 0.5f;
+		size_t level_index = extent > 1.0f ? static_cast<size_t>(std::ceil(std::log2(extent))) : 0;
+		level_index = std::min(level_index, depth_pyramid.size() - 1);
+		const depth_pyramid_level& level = depth_pyramid[level_index];
+
+		const float texel_size = static_cast<float>(size_t(2) << level_index);
+		const size_t x_from = std::min(static_cast<size_t>(rect.x / texel_size), level.width - 1);
+		const size_t x_to = std::min(static_cast<size_t>(rect.z / texel_size), level.width - 1);
+		const size_t y_from = std::min(static_cast<size_t>(rect.y / texel_size), level.height - 1);
+		const size_t y_to = std::min(static_cast<size_t>(rect.w / texel_size), level.height - 1);
+
+		float farthest = DB::reversed_z ? FLT_MAX : -FLT_MAX;
+		for (size_t y = y_from; y <= y_to; ++y) {
+			for (size_t x = x_from; x <= x_to; ++x) {
+				farthest = farther(farthest, level.depth[y * level.width + x]);
+			}
+		}
+		// Occluded if even the nearest point of the box is behind everything drawn in the rectangle
+		return DB::reversed_z ? nearest_depth < farthest : nearest_depth > farthest;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline rasterization_statistics rasterizer<VB, RT, VS, PS, DB>::get_statistics() const
+	{
+		return {small_triangles.load(), scanned_triangles.load(), hierarchical_triangles.load(),
+				covered_blocks.load(), partial_blocks.load(), rejected_blocks.load(),
+				visible_meshlets.load(), frustum_culled_meshlets.load(), cone_culled_meshlets.load()};
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::reset_statistics()
+	{
+		small_triangles = 0;
+		scanned_triangles = 0;
+		hierarchical_triangles = 0;
+		covered_blocks = 0;
+		partial_blocks = 0;
+		rejected_blocks = 0;
+		visible_meshlets = 0;
+		frustum_culled_meshlets = 0;
+		cone_culled_meshlets = 0;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	template<bool depth_only, typename F>
+	inline void rasterizer<VB, RT, VS, PS, DB>::process_geometry(size_t num_indices, const F& emit)
+	{
+		if (!meshlets) {
+			run_vertex_stage<depth_only>();
+			assemble_primitives(0, num_indices, emit);
+			return;
+		}
+		cull_meshlets(num_indices);
+		run_vertex_stage<depth_only>();
+		for (size_t id : visible_meshlet_ids) {
+			const cg::world::meshlet& m = meshlets->meshlets[id];
+			assemble_primitives(m.first_index, m.num_indices, emit);
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::cull_meshlets(size_t num_indices)
+	{
+		// Frustum planes in object space, a point is inside if dot(plane, (p, 1)) >= 0 for all of them
+		const DirectX::XMMATRIX matrix = DirectX::XMMatrixTranspose(constants.world_view_projection);
+		const DirectX::XMVECTOR planes[] = {
+				DirectX::XMPlaneNormalize(DirectX::XMVectorAdd(matrix.r[3], matrix.r[0])),
+				DirectX::XMPlaneNormalize(DirectX::XMVectorSubtract(matrix.r[3], matrix.r[0])),
+				DirectX::XMPlaneNormalize(DirectX::XMVectorAdd(matrix.r[3], matrix.r[1])),
+				DirectX::XMPlaneNormalize(DirectX::XMVectorSubtract(matrix.r[3], matrix.r[1])),
+				DirectX::XMPlaneNormalize(matrix.r[2]),
+				DirectX::XMPlaneNormalize(DirectX::XMVectorSubtract(matrix.r[3], matrix.r[2]))};
+
+		// Normal cones are tested against the camera position, which orthographic projections lack
+		const bool perspective = DirectX::XMVectorGetW(constants.projection.r[2]) != 0.0f;
+		const bool cone_culling = culling != cull_mode::none && perspective;
+		const DirectX::XMVECTOR eye = DirectX::XMVector3TransformCoord(
+				DirectX::XMVectorZero(),
+				DirectX::XMMatrixInverse(nullptr, DirectX::XMMatrixMultiply(constants.world, constants.view)));
+
+		visible_meshlet_ids.clear();
+		size_t frustum_culled = 0;
+		size_t cone_culled = 0;
+		for (size_t id = 0; id != meshlets->meshlets.size(); ++id) {
+			const cg::world::meshlet& m = meshlets->meshlets[id];
+			if (m.first_index + m.num_indices > num_indices) {
+				continue;
+			}
+			const DirectX::XMVECTOR center = DirectX::XMLoadFloat3(&m.center);
+			bool outside = false;
+			for (const DirectX::XMVECTOR& plane : planes) {
+				outside = outside || DirectX::XMVectorGetX(DirectX::XMPlaneDotCoord(plane, center)) < -m.radius;
+			}
+			if (outside) {
+				++frustum_culled;
+				continue;
+			}
+
+			// Faces of the meshlet are back facing if every direction from the camera to the bounding
+			// sphere is more than 90 degrees away from every normal of the cone, front facing if less
+			const DirectX::XMVECTOR to_center = DirectX::XMVectorSubtract(center, eye);
+			const float distance = DirectX::XMVectorGetX(DirectX::XMVector3Length(to_center));
+			if (cone_culling && distance > m.radius && m.cone_angle < DirectX::XM_PIDIV2) {
+				const float sphere_angle = std::asin(m.radius / distance);
+				const float cosine = DirectX::XMVectorGetX(
+											 DirectX::XMVector3Dot(DirectX::XMLoadFloat3(&m.cone_axis), to_center)) /
+									 distance;
+				const float angle = std::acos(std::clamp(cosine, -1.0f, 1.0f));
+				if ((culling == cull_mode::back && angle - m.cone_angle - sphere_angle > DirectX::XM_PIDIV2) ||
+					(culling == cull_mode::front && angle + m.cone_angle + sphere_angle < DirectX::XM_PIDIV2)) {
+					++cone_culled;
+					continue;
+				}
+			}
+			visible_meshlet_ids.push_back(id);
+		}
+
+		visible_meshlets += visible_meshlet_ids.size();
+		frustum_culled_meshlets += frustum_culled;
+		cone_culled_meshlets += cone_culled;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::draw(size_t num_indices)
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	template<bool depth_only>
+	inline void rasterizer<VB, RT, VS, PS, DB>::run_vertex_stage()
+	{
+		const size_t num_vertices = get_vertex_count();
+		post_transform_buffer.resize(num_vertices);
+		clip_space_buffer.resize(num_vertices);
+		clip_codes.resize(num_vertices);
+
+		auto transform = [this](size_t i) {
+			if constexpr (depth_only) {
+				// Position-only stream, attributes are left untouched
+				const DirectX::XMVECTOR position = DirectX::XMVectorSetW(fetch_position(i), 1.0f);
+				DirectX::XMStoreFloat4(&clip_space_buffer[i].position,
+									   DirectX::XMVector4Transform(position, constants.world_view_projection));
+			}
+			else if constexpr (std::is_same_v<VB, cg::vertex>) {
+				// VS STAGE: Execute vertex shader, streams are gathered and compact vertices are decoded first
+				if (streams.positions) {
+					clip_space_buffer[i] = vertex_shader(streams.gather(i), constants);
+				}
+				else if (compact_vertex_buffer) {
+					clip_space_buffer[i] = vertex_shader(compact_vertex_buffer->item(i).decode(quantization), constants);
+				}
+				else {
+					clip_space_buffer[i] = vertex_shader(vertex_buffer->item(i), constants);
+				}
+			}
+			else {
+				// VS STAGE: Execute vertex shader
+				clip_space_buffer[i] = vertex_shader(vertex_buffer->item(i), constants);
+			}
+			clip_codes[i] = compute_clip_code(clip_space_buffer[i].position);
+
+			if ((clip_codes[i] & clip_near) == 0) {
+				post_transform_buffer[i] = to_screen_space(clip_space_buffer[i]);
+			}
+		};
+
+		if (!meshlets) {
+			for (size_t i = 0; i != num_vertices; ++i) {
+				transform(i);
+			}
+			return;
+		}
+
+		// Vertices of culled meshlets are skipped, their outputs are not read by any face
+		vertex_owners.assign(num_vertices, no_meshlet);
+		size_t num_visible_vertices = 0;
+		for (size_t id : visible_meshlet_ids) {
+			const cg::world::meshlet& m = meshlets->meshlets[id];
+			for (size_t v = m.first_vertex; v != m.first_vertex + m.num_vertices; ++v) {
+				size_t& owner = vertex_owners[meshlets->vertices[v]];
+				num_visible_vertices += owner == no_meshlet ? 1 : 0;
+				owner = owner == no_meshlet ? id : owner;
+			}
+		}
+		auto transform_meshlet = [&](size_t i) {
+			const size_t id = visible_meshlet_ids[i];
+			const cg::world::meshlet& m = meshlets->meshlets[id];
+			for (size_t v = m.first_vertex; v != m.first_vertex + m.num_vertices; ++v) {
+				const unsigned int vertex = meshlets->vertices[v];
+				if (vertex_owners[vertex] == id) {
+					transform(vertex);
+				}
+			}
+		};
+		if (num_visible_vertices < parallel_vertex_threshold) {
+			for (size_t i = 0; i != visible_meshlet_ids.size(); ++i) {
+				transform_meshlet(i);
+			}
+			return;
+		}
+		utils::parallel_for(0, visible_meshlet_ids.size(), transform_meshlet);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline size_t rasterizer<VB, RT, VS, PS, DB>::get_vertex_count() const
+	{
+		if (streams.positions) {
+			return streams.positions->get_number_of_elements();
+		}
+		if (compact_vertex_buffer) {
+			return compact_vertex_buffer->get_number_of_elements();
+		}
+		return vertex_buffer->get_number_of_elements();
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline DirectX::XMVECTOR rasterizer<VB, RT, VS, PS, DB>::fetch_position(size_t index) const
+	{
+		if (streams.positions) {
+			return DirectX::XMLoadFloat3(&streams.positions->item(index));
+		}
+		if (compact_vertex_buffer) {
+			return compact_vertex_buffer->item(index).decode_position(quantization);
+		}
+		return DirectX::XMLoadFloat3(&vertex_buffer->item(index).position);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline vertex_output<VB> rasterizer<VB, RT, VS, PS, DB>::to_screen_space(const vertex_output<VB>& vertex_data) const
+	{
+		// Perspective division and viewport transform, same mapping as XMVector3Project.
+		// Y is relative to the first row of the band. 1/w is kept for perspective correct interpolation
+		const float inv_w = 1.0f / vertex_data.position.w;
+		vertex_output<VB> result{
+				DirectX::XMFLOAT4(
+						(vertex_data.position.x * inv_w + 1.0f) * 0.5f * static_cast<float>(width),
+						(1.0f - vertex_data.position.y * inv_w) * 0.5f * static_cast<float>(viewport_height) -
+								static_cast<float>(band_first_row),
+						vertex_data.position.z * inv_w,
+						inv_w),
+				vertex_data.attributes};
+		return result;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline unsigned char rasterizer<VB, RT, VS, PS, DB>::compute_clip_code(const DirectX::XMFLOAT4& position)
+	{
+		unsigned char code = 0;
+		if (position.x < -position.w) code |= clip_left;
+		if (position.x > position.w) code |= clip_right;
+		if (position.y < -position.w) code |= clip_bottom;
+		if (position.y > position.w) code |= clip_top;
+		if (position.z < 0.0f) code |= clip_near;
+		if (position.z > position.w) code |= clip_far;
+		return code;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::clip_polygon(
+			const std::vector<vertex_output<VB>>& polygon,
+			std::vector<vertex_output<VB>>& result,
+			clip_plane plane)
+	{
+		// Sutherland-Hodgman clipping against a single plane, z >= 0 for near and z <= w for far
+		auto distance = [plane](const DirectX::XMFLOAT4& position) {
+			return plane == clip_near ? position.z : position.w - position.z;
+		};
+
+		result.clear();
+		for (size_t i = 0; i != polygon.size(); ++i) {
+			const vertex_output<VB>& current = polygon[i];
+			const vertex_output<VB>& next = polygon[(i + 1) % polygon.size()];
+			const float current_distance = distance(current.position);
+			const float next_distance = distance(next.position);
+
+			if (current_distance >= 0.0f) {
+				result.push_back(current);
+			}
+			if ((current_distance >= 0.0f) != (next_distance >= 0.0f)) {
+				// Clip space is linear, so attributes are interpolated with the same factor
+				const float t = current_distance / (current_distance - next_distance);
+				vertex_output<VB> intersection;
+				DirectX::XMStoreFloat4(&intersection.position, DirectX::XMVectorLerp(
+						DirectX::XMLoadFloat4(&current.position), DirectX::XMLoadFloat4(&next.position), t));
+				intersection.attributes = current.attributes * (1.0f - t) + next.attributes * t;
+				result.push_back(intersection);
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::draw(size_t num_indices)
 	{
 		//THROW_ERROR("Not implemented yet");
-		for (size_t face_idx = 0; face_idx != num_indices / 3; ++face_idx) {
+		process_geometry<false>(num_indices, [this](const std::array<vertex_output<VB>, 3>& face, size_t face_index) {
+			rasterize_face<false>(face, face_index, pixel_shader, face_materials.get(), depth_comparison,
+								  0, static_cast<int>(height) - 1);
+		});
+	}
 
-			// IA STAGE: Extract face from vertex buffer
-			std::array<vertex, 3> face{};
-			for (size_t i = 0; i != 3; ++i) {
-				face[i] = vertex_buffer->item(index_buffer->item(3 * face_idx + i));
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::draw_depth_only(size_t num_indices)
+	{
+		process_geometry<true>(num_indices, [this](const std::array<vertex_output<VB>, 3>& face, size_t) {
+			rasterize_triangle<true>(face, pixel_shader, depth_comparison, 0, static_cast<int>(height) - 1);
+		});
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::draw_instanced(
+			size_t num_indices, std::shared_ptr<resource<instance_data>> instances)
+	{
+		draw_instances<false>(num_indices, *instances);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::draw_depth_only_instanced(
+			size_t num_indices, std::shared_ptr<resource<instance_data>> instances)
+	{
+		draw_instances<true>(num_indices, *instances);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	template<bool depth_only>
+	inline void rasterizer<VB, RT, VS, PS, DB>::draw_instances(
+			size_t num_indices, cg::resource<instance_data>& instances)
+	{
+		// Constants and pixel shader of the draw are restored after the last instance
+		const shader_constants draw_constants = constants;
+		const PS draw_pixel_shader = pixel_shader;
+		const DirectX::XMMATRIX view_projection = DirectX::XMMatrixMultiply(constants.view, constants.projection);
+
+		for (size_t i = 0; i != instances.get_number_of_elements(); ++i) {
+			bind_instance(instances.item(i), view_projection, get_material_id(draw_pixel_shader), pixel_shader);
+			cg::resource<unsigned int>* materials = instances.item(i).material_id < 0 ? face_materials.get() : nullptr;
+			process_geometry<depth_only>(num_indices, [&](const std::array<vertex_output<VB>, 3>& face, size_t face_index) {
+				rasterize_face<depth_only>(face, face_index, pixel_shader, materials, depth_comparison,
+										   0, static_cast<int>(height) - 1);
+			});
+		}
+
+		constants = draw_constants;
+		pixel_shader = draw_pixel_shader;
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::bind_instance(
+			const instance_data& instance, const DirectX::XMMATRIX& view_projection,
+			unsigned int draw_material_id, PS& shader)
+	{
+		constants.world = instance.world;
+		constants.world_view_projection = DirectX::XMMatrixMultiply(instance.world, view_projection);
+		if constexpr (has_material_id<PS>::value) {
+			shader.material_id = instance.material_id < 0 ? draw_material_id
+														  : static_cast<unsigned int>(instance.material_id);
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	template<bool depth_only>
+	inline void rasterizer<VB, RT, VS, PS, DB>::rasterize_face(
+			const std::array<vertex_output<VB>, 3>& face, size_t face_index, PS& shader,
+			cg::resource<unsigned int>* materials, depth_function comparison, int y_min, int y_max)
+	{
+		// Shader of the draw may be used by other strips at the same time, so the face gets a copy
+		if constexpr (has_material_id<PS>::value && !depth_only) {
+			if (materials) {
+				PS face_shader = shader;
+				face_shader.material_id = materials->item(face_index);
+				rasterize_triangle<depth_only>(face, face_shader, comparison, y_min, y_max);
+				return;
 			}
+		}
+		rasterize_triangle<depth_only>(face, shader, comparison, y_min, y_max);
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline unsigned int rasterizer<VB, RT, VS, PS, DB>::get_material_id(const PS& shader)
+	{
+		if constexpr (has_material_id<PS>::value) {
+			return shader.material_id;
+		}
+		else {
+			return 0;
+		}
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline void rasterizer<VB, RT, VS, PS, DB>::execute(const command_list<VB, PS>& list, bool front_to_back)
+	{
+		const auto& commands = list.get_commands();
+		std::vector<size_t> order(commands.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+			const draw_command<VB, PS>& first = commands[a];
+			const draw_command<VB, PS>& second = commands[b];
+			if (first.depth_only != second.depth_only) {
+				return first.depth_only;
+			}
+			if (first.state_key != second.state_key) {
+				return first.state_key < second.state_key;
+			}
+			return front_to_back && first.sort_depth < second.sort_depth;
+		});
+
+		// Bound buffers and constants are restored after execution
+		const std::shared_ptr<cg::resource<VB>> bound_vertex_buffer = vertex_buffer;
+		const vertex_streams bound_streams = streams;
+		const std::shared_ptr<cg::resource<compact_vertex>> bound_compact_vertex_buffer = compact_vertex_buffer;
+		const vertex_quantization bound_quantization = quantization;
+		const std::shared_ptr<cg::resource<unsigned int>> bound_index_buffer = index_buffer;
+		const std::shared_ptr<cg::world::meshlet_list> bound_meshlets = meshlets;
+		const std::shared_ptr<cg::resource<unsigned int>> bound_face_materials = face_materials;
+		const shader_constants bound_constants = constants;
+
+		// Geometry is processed serially, every triangle is referenced by the strips it overlaps
+		const size_t num_strips = (height + bin_strip_height - 1) / bin_strip_height;
+		std::vector<binned_draw> draws;
+		std::vector<binned_triangle> triangles;
+		std::vector<std::vector<size_t>> strips(num_strips);
+		// Strips cover the same rows as the bounding box in rasterize_triangle
+		auto bin = [&](const std::array<vertex_output<VB>, 3>& face, size_t face_index) {
+			const float ymin = std::min({face[0].position.y, face[1].position.y, face[2].position.y});
+			const float ymax = std::max({face[0].position.y, face[1].position.y, face[2].position.y});
+			if (ymax < 0.0f || ymin >= static_cast<float>(height)) {
+				return;
+			}
+			const size_t strip_from = static_cast<size_t>(std::max(ymin, 0.0f)) / bin_strip_height;
+			const size_t strip_to = std::min(static_cast<size_t>(std::ceil(ymax)) / bin_strip_height, num_strips - 1);
+			for (size_t strip = strip_from; strip <= strip_to; ++strip) {
+				strips[strip].push_back(triangles.size());
+			}
+			triangles.push_back({face, face_index, draws.size() - 1});
+		};
+
+		for (size_t index : order) {
+			const draw_command<VB, PS>& command = commands[index];
+			vertex_buffer = command.vertex_buffer;
+			streams = command.streams;
+			compact_vertex_buffer = command.compact_vertex_buffer;
+			quantization = command.quantization;
+			index_buffer = command.index_buffer;
+			meshlets = command.meshlets;
+			face_materials = command.face_materials;
+			constants = command.constants;
+
+			const size_t num_instances = command.instances ? command.instances->get_number_of_elements() : 1;
+			const DirectX::XMMATRIX view_projection = DirectX::XMMatrixMultiply(constants.view, constants.projection);
+			for (size_t i = 0; i != num_instances; ++i) {
+				draws.push_back({command.pixel_shader, command.depth_comparison, command.depth_only,
+								 command.face_materials.get()});
+				if (command.instances && command.instances->item(i).material_id >= 0) {
+					draws.back().face_materials = nullptr;
+				}
+				if (command.instances) {
+					bind_instance(command.instances->item(i), view_projection,
+								  get_material_id(command.pixel_shader), draws.back().pixel_shader);
+				}
+				if (command.depth_only) {
+					process_geometry<true>(command.num_indices, bin);
+				}
+				else {
+					process_geometry<false>(command.num_indices, bin);
+				}
+			}
+		}
+
+		vertex_buffer = bound_vertex_buffer;
+		streams = bound_streams;
+		compact_vertex_buffer = bound_compact_vertex_buffer;
+		quantization = bound_quantization;
+		index_buffer = bound_index_buffer;
+		meshlets = bound_meshlets;
+		face_materials = bound_face_materials;
+		constants = bound_constants;
 
-			
-			// VS STAGE : Execute vertex shader
-			std::array<float3, 3> vertices;
+		// Strips don't share pixels, so they are rasterized independently
+		utils::parallel_for(0, num_strips, [&](size_t strip) {
+			const int y_min = static_cast<int>(strip * bin_strip_height);
+			const int y_max = static_cast<int>(std::min((strip + 1) * bin_strip_height, height)) - 1;
+			for (size_t triangle_index : strips[strip]) {
+				const binned_triangle& triangle = triangles[triangle_index];
+				binned_draw& draw = draws[triangle.draw];
+				if (draw.depth_only) {
+					rasterize_triangle<true>(triangle.face, draw.pixel_shader, draw.depth_comparison, y_min, y_max);
+				}
+				else {
+					rasterize_face<false>(triangle.face, triangle.face_index, draw.pixel_shader, draw.face_materials,
+										  draw.depth_comparison, y_min, y_max);
+				}
+			}
+		});
+	}
+
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	template<typename F>
+	inline void rasterizer<VB, RT, VS, PS, DB>::assemble_primitives(
+			size_t first_index, size_t num_indices, const F& emit)
+	{
+		std::vector<vertex_output<VB>> polygon, clipped_polygon;
+		for (size_t face_idx = first_index / 3; face_idx != (first_index + num_indices) / 3; ++face_idx) {
+
+			// IA STAGE: Extract face indices
+			std::array<unsigned int, 3> indices;
 			for (size_t i = 0; i != 3; ++i) {
-				face[i] = vertex_shader(face[i]);
-				vertices[i] = float3(&face[i].position.x);
+				indices[i] = index_buffer->item(3 * face_idx + i);
 			}
 
-			// Calculating rendering domain
-			float ymin = std::min_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.y < b.y; })->y;
-			float ymax = std::max_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.y < b.y; })->y;
+			// PA STAGE: Frustum culling, the face is invisible if all vertices are outside of the same plane
+			const unsigned char codes[] = {clip_codes[indices[0]], clip_codes[indices[1]], clip_codes[indices[2]]};
+			if ((codes[0] & codes[1] & codes[2]) != 0) {
+				continue;
+			}
 
-			//ymin = (ymin + 1) / 2 * (height - 1);
-			//ymax = (ymax + 1) / 2 * (height - 1);
+			// Guard-band clipping: only near and far planes are clipped,
+			// left, right, top and bottom are handled by the bounding box clamping
+			if (((codes[0] | codes[1] | codes[2]) & (clip_near | clip_far)) == 0) {
+				emit({post_transform_buffer[indices[0]],
+					  post_transform_buffer[indices[1]],
+					  post_transform_buffer[indices[2]]},
+					 face_idx);
+				continue;
+			}
 
-			int yfrom = (std::clamp(static_cast<int>(std::ceil(ymin)), 0, static_cast<int>(height - 1)));
-			int yto = (std::clamp(static_cast<int>(std::ceil(ymax)), 0, static_cast<int>(height - 1)));
+			polygon = {clip_space_buffer[indices[0]], clip_space_buffer[indices[1]], clip_space_buffer[indices[2]]};
+			clip_polygon(polygon, clipped_polygon, clip_near);
+			clip_polygon(clipped_polygon, polygon, clip_far);
 
-			float xmin = std::min_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.x < b.x; })->x;
-			float xmax = std::max_element(vertices.begin(), vertices.end(), [](float3 a, float3 b) { return a.x < b.x; })->x;
+			// Triangulate clipped polygon as a fan, it keeps the winding of the face
+			for (size_t i = 2; i < polygon.size(); ++i) {
+				emit({to_screen_space(polygon[0]),
+					  to_screen_space(polygon[i - 1]),
+					  to_screen_space(polygon[i])},
+					 face_idx);
+			}
+		}
+	}
 
-			//xmin = (xmin + 1) / 2 * (width - 1);
-			//xmax = (xmax + 1) / 2 * (width - 1);
-			
-			int xfrom = (std::clamp(static_cast<int>(std::ceil(xmin)), 0, static_cast<int>(width - 1)));
-			int xto = (std::clamp(static_cast<int>(std::ceil(xmax)), 0, static_cast<int>(width - 1)));
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	template<bool depth_only>
+	inline void rasterizer<VB, RT, VS, PS, DB>::rasterize_triangle(const std::array<vertex_output<VB>, 3>& face, PS& shader,
+																	depth_function comparison, int y_min, int y_max)
+	{
+		const std::array<float2, 3> vertices = {
+				float2{face[0].position.x, face[0].position.y},
+				float2{face[1].position.x, face[1].position.y},
+				float2{face[2].position.x, face[2].position.y}};
 
-			// Find triangle screen area
-			float area_twice = (cross(vertices[1] - vertices[0], vertices[2] - vertices[0])).z;
+		// Find triangle screen area. The Y axis of render target points down,
+		// hence counter-clockwise front faces have negative area
+		const float area_twice = edge_function(vertices[0], vertices[1], vertices[2]);
+		if (area_twice == 0.0f) {
+			return;
+		}
+		if ((culling == cull_mode::back && area_twice > 0.0f) ||
+			(culling == cull_mode::front && area_twice < 0.0f)) {
+			return;
+		}
+
+		// Calculating rendering domain
+		const float xmin = std::min({vertices[0].x, vertices[1].x, vertices[2].x});
+		const float xmax = std::max({vertices[0].x, vertices[1].x, vertices[2].x});
+		const float ymin = std::min({vertices[0].y, vertices[1].y, vertices[2].y});
+		const float ymax = std::max({vertices[0].y, vertices[1].y, vertices[2].y});
+
+		const int xfrom = std::clamp(static_cast<int>(std::floor(xmin)), 0, static_cast<int>(width - 1));
+		const int xto = std::clamp(static_cast<int>(std::ceil(xmax)), 0, static_cast<int>(width - 1));
+		const int viewport_yfrom = std::clamp(static_cast<int>(std::floor(ymin)), 0, static_cast<int>(height - 1));
+		const int viewport_yto = std::clamp(static_cast<int>(std::ceil(ymax)), 0, static_cast<int>(height - 1));
+		const int yfrom = std::max(viewport_yfrom, y_min);
+		const int yto = std::min(viewport_yto, y_max);
+		if (yfrom > yto) {
+			return;
+		}
+
+		// Path is chosen by the whole triangle, so every strip of binned rendering takes the same one.
+		// Triangles are counted by the strip holding their first row
+		const int domain_width = xto - xfrom + 1;
+		const int domain_height = viewport_yto - viewport_yfrom + 1;
+		const bool first_strip = yfrom == viewport_yfrom;
 
-			for (int y = yfrom; y < yto; ++y) {
-				for (int x = xfrom; x < xto; ++x) {
+		// Depth-only draws may have no color target at all
+		cg::resource<RT>* color_surface = depth_only ? nullptr : &get_color_surface();
+		cg::resource<DB>& depth_surface = get_depth_surface();
 
-					// Calculate pixel baricentric coordinates
-					float xf = static_cast<float>(x);
-					float yf = static_cast<float>(y);
-					float3 current_point{static_cast<float>(xf), static_cast<float>(yf), 0.0f};
+		// Depth test of a sample, depth buffer is updated if it passes.
+		// Depth is linear in screen space, it is the only value needed for the test.
+		// Depth is quantized to the format before the test, so equal test matches stored values
+		auto test_sample = [&](int x, int y, unsigned int s, float u, float v, float w) {
+			const float z = u * face[0].position.z + v * face[1].position.z + w * face[2].position.z;
+			const DB encoded_z = DB::from_depth(z);
+			DB& depth = depth_surface.item(x * sample_count + s, y);
+			if (!depth_test(encoded_z.to_depth(), depth.to_depth(), comparison)) {
+				return false;
+			}
+			depth = encoded_z;
+			return true;
+		};
+
+		// Shades a pixel with some covered samples, u, v and w are barycentric coordinates of its center
+		auto shade_pixel = [&](int x, int y, float u, float v, float w, unsigned int coverage) {
+			if constexpr (!depth_only) {
+				const float2 pixel_center{static_cast<float>(x) + 0.5f, static_cast<float>(y) + 0.5f};
+				const float z = u * face[0].position.z + v * face[1].position.z + w * face[2].position.z;
+
+				// Perspective correct interpolation of attributes the pixel shader reads,
+				// position is always replaced by the screen space one
+				const float pu = u * face[0].position.w;
+				const float pv = v * face[1].position.w;
+				const float pw = w * face[2].position.w;
+				const float normalizer = 1.0f / (pu + pv + pw);
+				VB pixel_data = VB::interpolate(
+						face[0].attributes, face[1].attributes, face[2].attributes,
+						pu * normalizer, pv * normalizer, pw * normalizer,
+						pixel_shader_inputs & ~vertex_attribute::position);
+				pixel_data.position = DirectX::XMFLOAT3(pixel_center.x, pixel_center.y, z);
 
-					float u = abs(cross(vertices[1] - current_point, vertices[2] - current_point).z) / area_twice;
-					float v = abs(cross(vertices[0] - current_point, vertices[2] - current_point).z) / area_twice;
-					float w = abs(cross(vertices[0] - current_point, vertices[1] - current_point).z) / area_twice;
+				// PS STAGE: Execute pixel shader
+				pixel_shader_output pixel_value;
+				if constexpr (pixel_shader_reads_derivatives) {
+					// Finite differences with the neighbour pixels, interpolated perspective correct
+					auto uv_at = [&](const float2& point) {
+						const float pu = edge_function(vertices[1], vertices[2], point) / area_twice * face[0].position.w;
+						const float pv = edge_function(vertices[2], vertices[0], point) / area_twice * face[1].position.w;
+						const float pw = edge_function(vertices[0], vertices[1], point) / area_twice * face[2].position.w;
+						const float normalizer = 1.0f / (pu + pv + pw);
+						return float2{
+								(face[0].attributes.uv.x * pu + face[1].attributes.uv.x * pv + face[2].attributes.uv.x * pw) * normalizer,
+								(face[0].attributes.uv.y * pu + face[1].attributes.uv.y * pv + face[2].attributes.uv.y * pw) * normalizer};
+					};
+					const float2 uv = uv_at(pixel_center);
+					const float2 uv_right = uv_at(float2{pixel_center.x + 1.0f, pixel_center.y});
+					const float2 uv_down = uv_at(float2{pixel_center.x, pixel_center.y + 1.0f});
+					const uv_derivatives derivatives{
+							DirectX::XMFLOAT2(uv_right.x - uv.x, uv_right.y - uv.y),
+							DirectX::XMFLOAT2(uv_down.x - uv.x, uv_down.y - uv.y)};
+					pixel_value = shader(pixel_data, u * u + v * v + w * w, z, derivatives);
+				}
+				else {
+					pixel_value = shader(pixel_data, u * u + v * v + w * w, z);
+				}
+				RT texel;
+				if constexpr (std::is_same_v<pixel_shader_output, RT>) {
+					texel = pixel_value;
+				}
+				else {
+					texel = RT::from_color(pixel_value);
+				}
 
-					auto is_inside_triangle = [](float3 bc) { return abs(bc[0] + bc[1] + bc[2] - 1) < 0.00001; };
+				// Write the result to covered samples only
+				write_pending_clear(x, y);
+				for (unsigned int s = 0; s != sample_count; ++s) {
+					if (coverage & (1u << s)) {
+						color_surface->item(x * sample_count + s, y) = texel;
+					}
+				}
+			}
+		};
 
-					vertex pixel_data{};
-					// Render front faces
-					if (is_inside_triangle({u, v, w})) {
-						pixel_data = face[0] * u + face[1] * v + face[2] * w;
+		// Small triangles: barycentric coordinates of every sample are computed directly,
+		// edge equation setup would cost more than it saves on a few pixels
+		if (domain_width * domain_height <= small_triangle_pixels) {
+			if (first_strip) {
+				small_triangles.fetch_add(1, std::memory_order_relaxed);
+			}
+			for (int y = yfrom; y <= yto; ++y) {
+				for (int x = xfrom; x <= xto; ++x) {
+					const float2 pixel_center{static_cast<float>(x) + 0.5f, static_cast<float>(y) + 0.5f};
+					unsigned int coverage = 0;
+					for (unsigned int s = 0; s != sample_count; ++s) {
+						// Division by signed area makes barycentric coordinates positive inside for both windings
+						const float2 sample_point{pixel_center.x + sample_offsets[s].x, pixel_center.y + sample_offsets[s].y};
+						const float u = edge_function(vertices[1], vertices[2], sample_point) / area_twice;
+						const float v = edge_function(vertices[2], vertices[0], sample_point) / area_twice;
+						const float w = edge_function(vertices[0], vertices[1], sample_point) / area_twice;
+						if (u >= 0.0f && v >= 0.0f && w >= 0.0f && test_sample(x, y, s, u, v, w)) {
+							coverage |= 1u << s;
+						}
 					}
-					// Render back faces also
-					else if (is_inside_triangle({-u, -v, -w})) {
-						pixel_data = face[0] * -u + face[1] * -v + face[2] * -w;
+					if (coverage != 0) {
+						shade_pixel(x, y,
+									edge_function(vertices[1], vertices[2], pixel_center) / area_twice,
+									edge_function(vertices[2], vertices[0], pixel_center) / area_twice,
+									edge_function(vertices[0], vertices[1], pixel_center) / area_twice,
+									coverage);
 					}
-					else {
-						continue;
+				}
+			}
+			return;
+		}
+
+		// Edge equation setup: every barycentric coordinate is a * x + b * y + c in screen space.
+		// Samples are at constant offsets from it
+		std::array<float3, 3> edges;
+		for (size_t i = 0; i != 3; ++i) {
+			const float2& a = vertices[(i + 1) % 3];
+			const float2& b = vertices[(i + 2) % 3];
+			edges[i] = float3{(a.y - b.y) / area_twice, (b.x - a.x) / area_twice,
+							  ((b.y - a.y) * a.x - (b.x - a.x) * a.y) / area_twice};
+		}
+		auto barycentric = [&](size_t i, float x, float y) {
+			return edges[i].x * x + edges[i].y * y + edges[i].z;
+		};
+		std::array<float3, 8> sample_deltas;
+		for (unsigned int s = 0; s != sample_count; ++s) {
+			sample_deltas[s] = float3{barycentric(0, sample_offsets[s].x, sample_offsets[s].y) - edges[0].z,
+									  barycentric(1, sample_offsets[s].x, sample_offsets[s].y) - edges[1].z,
+									  barycentric(2, sample_offsets[s].x, sample_offsets[s].y) - edges[2].z};
+		}
+
+		// Samples of fully covered rectangles skip the inside test
+		auto scan = [&](int x0, int y0, int x1, int y1, bool fully_covered) {
+			for (int y = y0; y <= y1; ++y) {
+				const float center_y = static_cast<float>(y) + 0.5f;
+				for (int x = x0; x <= x1; ++x) {
+					const float center_x = static_cast<float>(x) + 0.5f;
+					const float u = barycentric(0, center_x, center_y);
+					const float v = barycentric(1, center_x, center_y);
+					const float w = barycentric(2, center_x, center_y);
+
+					unsigned int coverage = 0;
+					for (unsigned int s = 0; s != sample_count; ++s) {
+						const float sample_u = u + sample_deltas[s].x;
+						const float sample_v = v + sample_deltas[s].y;
+						const float sample_w = w + sample_deltas[s].z;
+						if (!fully_covered && (sample_u < 0.0f || sample_v < 0.0f || sample_w < 0.0f)) {
+							continue;
+						}
+						if (test_sample(x, y, s, sample_u, sample_v, sample_w)) {
+							coverage |= 1u << s;
+						}
+					}
+					if (coverage != 0) {
+						shade_pixel(x, y, u, v, w, coverage);
 					}
+				}
+			}
+		};
+
+		// Medium triangles: bounding box scan
+		if (domain_width < 2 * static_cast<int>(hierarchical_block_size) ||
+			domain_height < 2 * static_cast<int>(hierarchical_block_size)) {
+			if (first_strip) {
+				scanned_triangles.fetch_add(1, std::memory_order_relaxed);
+			}
+			scan(xfrom, yfrom, xto, yto, false);
+			return;
+		}
+
+		// Large triangles: 8x8 blocks are classified by their corners. Edge equations are linear,
+		// so a block with all corners inside covers all its samples and one with all corners
+		// outside of an edge has none
+		if (first_strip) {
+			hierarchical_triangles.fetch_add(1, std::memory_order_relaxed);
+		}
+		const int block_size = static_cast<int>(hierarchical_block_size);
+		size_t covered = 0;
+		size_t partial = 0;
+		size_t rejected = 0;
+		for (int block_y = yfrom / block_size * block_size; block_y <= yto; block_y += block_size) {
+			for (int block_x = xfrom / block_size * block_size; block_x <= xto; block_x += block_size) {
+				const int x0 = std::max(block_x, xfrom);
+				const int y0 = std::max(block_y, yfrom);
+				const int x1 = std::min(block_x + block_size - 1, xto);
+				const int y1 = std::min(block_y + block_size - 1, yto);
 
-					// Depth test
-					if (depth_test(pixel_data.position.z, x, y)) {
-						// Update depth buffer
-						float& depth = depth_buffer->item(x, y);
-						depth = pixel_data.position.z;
+				bool outside = false;
+				bool inside = true;
+				for (size_t i = 0; i != 3; ++i) {
+					const float corners[] = {
+							barycentric(i, static_cast<float>(x0), static_cast<float>(y0)),
+							barycentric(i, static_cast<float>(x1 + 1), static_cast<float>(y0)),
+							barycentric(i, static_cast<float>(x0), static_cast<float>(y1 + 1)),
+							barycentric(i, static_cast<float>(x1 + 1), static_cast<float>(y1 + 1))};
+					outside = outside || std::max({corners[0], corners[1], corners[2], corners[3]}) < 0.0f;
+					inside = inside && std::min({corners[0], corners[1], corners[2], corners[3]}) >= 0.0f;
+				}
 
-						// PS STAGE: Execute pixel shader
-						color pixel_value = pixel_shader(pixel_data, u * u + v * v + w * w, depth);
-						render_target->item(x, y) = unsigned_color::from_color(pixel_value);
-					}					
+				if (outside) {
+					++rejected;
+					continue;
 				}
+				++(inside ? covered : partial);
+				scan(x0, y0, x1, y1, inside);
 			}
 		}
+		covered_blocks.fetch_add(covered, std::memory_order_relaxed);
+		partial_blocks.fetch_add(partial, std::memory_order_relaxed);
+		rejected_blocks.fetch_add(rejected, std::memory_order_relaxed);
 	}
 
-	template<typename VB, typename RT>
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
 	inline float
-	rasterizer<VB, RT>::edge_function(float2 a, float2 b, float2 c)
+	rasterizer<VB, RT, VS, PS, DB>::edge_function(float2 a, float2 b, float2 c)
 	{
-		THROW_ERROR("Not implemented yet");
+		// Doubled signed area of triangle abc, its sign depends on the winding
+		return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
 	}
 
-	template<typename VB, typename RT>
-	inline bool rasterizer<VB, RT>::depth_test(float z, size_t x, size_t y)
+	template<typename VB, typename RT, typename VS, typename PS, typename DB>
+	inline bool rasterizer<VB, RT, VS, PS, DB>::depth_test(float z, float stored_depth, depth_function comparison)
 	{
-		// Depth buffer stores inverse value of depth for better precision
-		// Hence, depth test operation is inverted
-		return z < depth_buffer->item(x, y);
+		// Less means closer to the camera: smaller depth, or larger one with reversed-Z
+		if constexpr (DB::reversed_z) {
+			std::swap(z, stored_depth);
+		}
+		switch (comparison) {
+			case depth_function::less_equal:
+				return z <= stored_depth;
+			case depth_function::equal:
+				return z == stored_depth;
+			default:
+				return z < stored_depth;
+		}
 	}
 
 }// namespace cg::renderer
\ No newline at end of file
@@ -1,22 +1,41 @@
 #include "rasterizer_renderer.h"
 
+#include "utils/parallel.h"
+#include "utils/png_stream.h"
 #include "utils/resource_utils.h"
 
 #include <DirectXMath.h>
+#include <algorithm>
+#include <iostream>
+#include <numeric>
 
 
 void cg::renderer::rasterization_renderer::init()
 {
 	//THROW_ERROR("Not implemented yet");
 
-	// Create RT an DB
-	render_target = std::make_shared<resource<unsigned_color>>(get_width(), get_height());
-	depth_buffer = std::make_shared<resource<float>>(get_width(), get_height());
+	// Create RT an DB, they hold a single band of the image
+	render_target = std::make_shared<resource<rgba8_color>>(get_width(), get_band_height());
+	depth_buffer = std::make_shared<resource<depth_format>>(get_width(), get_band_height());
 
 	// Create rasterizer instance
-	rasterizer = std::make_shared<cg::renderer::rasterizer<vertex, unsigned_color>>();
+	rasterizer = std::make_shared<rasterization_pipeline>();
 	rasterizer->set_render_target(render_target, depth_buffer);
 	rasterizer->set_viewport(get_width(), get_height());
+	rasterizer->set_band(0, get_band_height());
+
+	cull_mode culling = cull_mode::back;
+	if (settings->cull_mode == "none") {
+		culling = cull_mode::none;
+	}
+	else if (settings->cull_mode == "front") {
+		culling = cull_mode::front;
+	}
+	else if (settings->cull_mode != "back") {
+		THROW_ERROR("Unknown cull mode: " + settings->cull_mode);
+	}
+	rasterizer->set_cull_mode(culling);
+	rasterizer->set_sample_count(settings->msaa);
 
 	// Setup camera settings
 	const DirectX::XMFLOAT3 camera_position{
@@ -37,35 +56,100 @@ void cg::renderer::rasterization_renderer::init()
 
 	// Load model from file
 	model = std::make_shared<cg::world::model>();
-	model->load_obj(settings->model_path);
-
-	// Add vertex shader
-	rasterizer->vertex_shader = [this](vertex vertex_data) {
-		// Collect transformation matrices
-		const DirectX::XMMATRIX world = (model->get_world_matrix());
-		const DirectX::XMMATRIX view = (camera->get_view_matrix());
-		const DirectX::XMMATRIX projection = (camera->get_projection_matrix());
-
-		DirectX::XMVECTOR address = DirectX::XMLoadFloat3(&vertex_data.position);
-
-		address = DirectX::XMVector3Project(address, 0.0f, 0.0f,
-											static_cast<float>(settings->width),
-											static_cast<float>(settings->height),
-											settings->camera_z_near,
-											settings->camera_z_far,
-											projection, view, world);
-
-		DirectX::XMStoreFloat3(&vertex_data.position, address);
-		return vertex_data;
-	};
+	model->load_obj(settings->model_path, settings->compact_vertices);
 
-	rasterizer->pixel_shader = [this](vertex vertex_data, const float b, const float z) {
-		const float distance = 0.25f + 0.75f * 5000 * z;
-		const float intensity = (1 - b);
-		// Pixel shader renders pixels according to its depth and barycentric distance
-		// from vertices. This way, vertices have black color and face centers have white.
-		return color::from_float3(float3{intensity, intensity, intensity});
-	};
+	// Pixel shader uses only barycentric distance and depth, so attributes are not interpolated
+	rasterizer->set_pixel_shader_inputs(vertex_attribute::none);
+
+	// Copies are placed along X axis with a gap of a tenth of the model size
+	if (settings->instances > 1) {
+		const auto& bounding_boxes = model->get_per_shape_bounding_boxes();
+		DirectX::BoundingBox model_box = bounding_boxes.front();
+		for (const auto& box : bounding_boxes) {
+			DirectX::BoundingBox::CreateMerged(model_box, model_box, box);
+		}
+		const float spacing = 2.2f * model_box.Extents.x;
+		const DirectX::XMMATRIX world = model->get_world_matrix();
+
+		instances = std::make_shared<resource<instance_data>>(settings->instances);
+		for (size_t i = 0; i != settings->instances; ++i) {
+			const float offset = spacing * (static_cast<float>(i) - 0.5f * static_cast<float>(settings->instances - 1));
+			instances->item(i).world = DirectX::XMMatrixMultiply(DirectX::XMMatrixTranslation(offset, 0.0f, 0.0f), world);
+		}
+	}
+
+	if (settings->rasterization_mode == "forward") {
+		mode = rasterization_mode::forward;
+	}
+	else if (settings->rasterization_mode == "prepass") {
+		mode = rasterization_mode::prepass;
+	}
+	else if (settings->rasterization_mode == "deferred") {
+		mode = rasterization_mode::deferred;
+	}
+	else {
+		THROW_ERROR("Unknown rasterization mode: " + settings->rasterization_mode);
+	}
+
+	if (mode == rasterization_mode::deferred) {
+		if (settings->msaa != 1) {
+			THROW_ERROR("MSAA is not supported in deferred rasterization mode");
+		}
+
+		// Geometry pass shares depth buffer with the main rasterizer
+		gbuffer = std::make_shared<resource<gbuffer_texel>>(get_width(), get_band_height());
+		geometry_rasterizer = std::make_shared<geometry_pipeline>();
+		geometry_rasterizer->set_render_target(gbuffer, depth_buffer);
+		geometry_rasterizer->set_viewport(get_width(), get_height());
+		geometry_rasterizer->set_band(0, get_band_height());
+		geometry_rasterizer->set_pixel_shader_inputs(vertex_attribute::normal | vertex_attribute::uv);
+		geometry_rasterizer->set_cull_mode(culling);
+
+		// G-buffer keeps the material id of every pixel, the values are looked up in the model's table
+		geometry_rasterizer->pixel_shader.materials = &model->get_materials();
+
+		// Textures are only registered here, they are decoded when first sampled.
+		// Missing textures are reported and their faces are rendered with material color only
+		textures = std::make_shared<cg::world::texture_cache>(
+				static_cast<size_t>(settings->texture_cache_budget_mb) * 1024 * 1024,
+				cg::world::parse_texture_format(settings->texture_format));
+		for (const auto& texture_file : model->get_material_texture_files()) {
+			material_texture_ids.push_back(textures->add_texture(texture_file));
+		}
+		geometry_rasterizer->pixel_shader.textures = textures.get();
+		geometry_rasterizer->pixel_shader.texture_ids = &material_texture_ids;
+
+		// Point light is shared with ray tracer, by default it is under the ceiling of Cornell box
+		light = {
+				DirectX::XMFLOAT3(settings->light_position.data()),
+				DirectX::XMFLOAT3(0.4f, 0.4f, 0.4f),
+				DirectX::XMFLOAT3(0.75f, 0.75f, 0.75f),
+				DirectX::XMFLOAT3(0.25f, 0.25f, 0.25f)};
+
+		if (settings->sun_direction.size() != 3) {
+			THROW_ERROR("Sun direction has to have 3 components");
+		}
+		const DirectX::XMFLOAT3 sun_direction{
+				settings->sun_direction[0], settings->sun_direction[1], settings->sun_direction[2]};
+		if (DirectX::XMVectorGetX(DirectX::XMVector3LengthSq(DirectX::XMLoadFloat3(&sun_direction))) > 0.0f) {
+			sun = std::make_shared<directional_light>();
+			DirectX::XMStoreFloat3(&sun->direction, DirectX::XMVector3Normalize(DirectX::XMLoadFloat3(&sun_direction)));
+			sun->diffuse = DirectX::XMFLOAT3(0.5f, 0.5f, 0.5f);
+			sun->specular = DirectX::XMFLOAT3(0.25f, 0.25f, 0.25f);
+		}
+
+		// Cube map of the point light reaches the farthest caster
+		if (settings->shadow_map_size != 0) {
+			const DirectX::BoundingSphere caster_bounds = compute_caster_bounds(*model, instances);
+			const float light_range = caster_bounds.Radius + DirectX::XMVectorGetX(DirectX::XMVector3Length(
+					DirectX::XMVectorSubtract(DirectX::XMLoadFloat3(&light.position), DirectX::XMLoadFloat3(&caster_bounds.Center))));
+			light_shadows = std::make_shared<cube_shadow_map>(settings->shadow_map_size, 0.01f, light_range);
+			light_shadows->update(DirectX::XMLoadFloat3(&light.position));
+			if (sun) {
+				sun_shadows = std::make_shared<cascaded_shadow_map>(settings->shadow_map_size, settings->shadow_cascades);
+			}
+		}
+	}
 }
 
 void cg::renderer::rasterization_renderer::destroy() {}
@@ -75,21 +159,359 @@ void cg::renderer::rasterization_renderer::update() {}
 void cg::renderer::rasterization_renderer::render()
 {
 	//THROW_ERROR("Not implemented yet");
-	rasterizer->clear_render_target(FLT_MAX);
 
-	auto &vertex_buffers = model->get_vertex_buffers();
-	auto &index_buffers = model->get_index_buffers();
+	// Collect transformation matrices once, every shape shares them
+	shader_constants constants;
+	constants.world = model->get_world_matrix();
+	constants.view = camera->get_view_matrix();
+	constants.projection = depth_format::reversed_z ? camera->get_reversed_z_projection_matrix()
+													: camera->get_projection_matrix();
+	constants.world_view_projection = DirectX::XMMatrixMultiply(
+			DirectX::XMMatrixMultiply(constants.world, constants.view), constants.projection);
+	rasterizer->set_constants(constants);
 
-	const size_t num_shapes = vertex_buffers.size();
+	rasterizer->reset_statistics();
+	if (geometry_rasterizer) {
+		geometry_rasterizer->reset_statistics();
+	}
 
-	// Render every shape
-	for (size_t i = 0; i != num_shapes; ++i) {
-		rasterizer->set_vertex_buffer(vertex_buffers[i]);
-		rasterizer->set_index_buffer(index_buffers[i]);
+	// LOD is chosen by the nearest copy of a shape, all copies are drawn with it
+	std::vector<DirectX::XMMATRIX> world_matrices{constants.world};
+	if (instances) {
+		world_matrices.clear();
+		for (size_t i = 0; i != instances->get_number_of_elements(); ++i) {
+			world_matrices.push_back(instances->item(i).world);
+		}
+	}
+	shape_lods = select_lods(world_matrices);
+	size_t num_triangles = 0;
+	size_t num_lod_triangles = 0;
+	for (size_t i = 0; i != shape_lods.size(); ++i) {
+		num_triangles += model->get_index_buffers()[i]->get_number_of_elements() / 3;
+		num_lod_triangles += shape_lods[i].index_buffer->get_number_of_elements() / 3;
+	}
+	std::cout << "LOD: " << num_lod_triangles << " of " << num_triangles << " triangles per model copy" << std::endl;
+
+	render_shadow_maps();
+
+	// Large images are rendered band by band, every band is written to the file before the next one
+	std::unique_ptr<utils::png_stream_writer> writer;
+	if (get_band_height() < get_height()) {
+		writer = std::make_unique<utils::png_stream_writer>(settings->result_path, get_width(), get_height());
+	}
+	for (band_first_row = 0; band_first_row < get_height(); band_first_row += get_band_height()) {
+		band_rows = std::min<size_t>(get_band_height(), get_height() - band_first_row);
+		rasterizer->set_band(band_first_row, band_rows);
+		if (geometry_rasterizer) {
+			geometry_rasterizer->set_band(band_first_row, band_rows);
+		}
 
-		rasterizer->draw(index_buffers[i]->get_number_of_elements());
+		render_band(constants);
+		if (writer) {
+			writer->write_rows(*render_target, band_rows);
+		}
 	}
 
+	// Triangles of occluder, depth and shading passes together
+	rasterization_statistics statistics = rasterizer->get_statistics();
+	if (geometry_rasterizer) {
+		const rasterization_statistics geometry_statistics = geometry_rasterizer->get_statistics();
+		statistics.small_triangles += geometry_statistics.small_triangles;
+		statistics.scanned_triangles += geometry_statistics.scanned_triangles;
+		statistics.hierarchical_triangles += geometry_statistics.hierarchical_triangles;
+		statistics.covered_blocks += geometry_statistics.covered_blocks;
+		statistics.partial_blocks += geometry_statistics.partial_blocks;
+		statistics.rejected_blocks += geometry_statistics.rejected_blocks;
+		statistics.visible_meshlets += geometry_statistics.visible_meshlets;
+		statistics.frustum_culled_meshlets += geometry_statistics.frustum_culled_meshlets;
+		statistics.cone_culled_meshlets += geometry_statistics.cone_culled_meshlets;
+	}
+	std::cout << "Triangles: " << statistics.small_triangles << " small, " << statistics.scanned_triangles
+			  << " scanned, " << statistics.hierarchical_triangles << " hierarchical. 8x8 blocks: "
+			  << statistics.covered_blocks << " covered, " << statistics.partial_blocks << " partial, "
+			  << statistics.rejected_blocks << " rejected" << std::endl;
+	std::cout << "Meshlets: " << statistics.visible_meshlets << " visible, " << statistics.frustum_culled_meshlets
+			  << " outside of frustum, " << statistics.cone_culled_meshlets << " back facing" << std::endl;
+
 	// Save to file and display
-	utils::save_resource(*render_target, settings->result_path);
-}
\ No newline at end of file
+	if (writer) {
+		writer->close();
+	}
+	else {
+		utils::save_resource(*render_target, settings->result_path);
+	}
+}
+
+void cg::renderer::rasterization_renderer::render_shadow_maps()
+{
+	if (light_shadows) {
+		light_shadows->render(*model, instances);
+	}
+	if (sun_shadows) {
+		sun_shadows->update(*camera, DirectX::XMLoadFloat3(&sun->direction), compute_caster_bounds(*model, instances));
+		sun_shadows->render(*model, instances);
+	}
+}
+
+void cg::renderer::rasterization_renderer::render_band(const shader_constants& constants)
+{
+	rasterizer->clear_render_target();
+	cull_occluded_shapes();
+	rasterizer->set_depth_function(shape_depth_function);
+
+	if (mode == rasterization_mode::deferred) {
+		geometry_rasterizer->set_depth_function(shape_depth_function);
+		textures->begin_frame();
+		render_deferred(constants);
+		// Textures sampled before decoding got low resolution or white color,
+		// the frame is rendered again once they are ready
+		if (textures->has_misses()) {
+			textures->wait_idle();
+			textures->begin_frame();
+			rasterizer->clear_render_target();
+			cull_occluded_shapes();
+			render_deferred(constants);
+		}
+	}
+	else if (mode == rasterization_mode::prepass) {
+		render_depth_prepass(constants);
+	}
+	else {
+		render_forward(constants);
+	}
+
+	if (settings->occlusion_culling && !instances) {
+		std::cout << "Occlusion culling: " << num_culled_shapes << " of " << model->get_index_buffers().size()
+				  << " shapes culled, " << num_occluders << " occluders" << std::endl;
+	}
+
+	// Average samples into render target
+	rasterizer->resolve();
+}
+void cg::renderer::rasterization_renderer::cull_occluded_shapes()
+{
+	auto &lods = shape_lods;
+	auto &bounding_boxes = model->get_per_shape_bounding_boxes();
+
+	const size_t num_shapes = bounding_boxes.size();
+
+	visible_shapes.resize(num_shapes);
+	std::iota(visible_shapes.begin(), visible_shapes.end(), 0);
+	num_occluders = 0;
+	num_culled_shapes = 0;
+	shape_depth_function = depth_function::less;
+
+	// Distance to the box center, it orders both occluders and recorded draws
+	const DirectX::XMMATRIX world = model->get_world_matrix();
+	const DirectX::XMVECTOR eye = camera->get_position();
+	shape_distances.resize(num_shapes);
+	for (size_t i = 0; i != num_shapes; ++i) {
+		const DirectX::XMVECTOR center = DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&bounding_boxes[i].Center), world);
+		shape_distances[i] = DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMVectorSubtract(center, eye)));
+	}
+	if (!settings->occlusion_culling || instances) {
+		return;
+	}
+
+	// Front-to-back order
+	std::sort(visible_shapes.begin(), visible_shapes.end(),
+			  [this](size_t a, size_t b) { return shape_distances[a] < shape_distances[b]; });
+
+	// Occluder pass: shapes covering a large part of the screen, or crossing the near plane,
+	// are drawn into depth buffer only
+	constexpr float occluder_screen_fraction = 0.1f;
+	const float screen_area = static_cast<float>(get_width() * get_height());
+	std::vector<bool> is_occluder(num_shapes, false);
+	for (size_t i : visible_shapes) {
+		float4 rect;
+		float nearest_depth;
+		if (rasterizer->project_box(bounding_boxes[i], rect, nearest_depth) &&
+			(rect.z - rect.x) * (rect.w - rect.y) < occluder_screen_fraction * screen_area) {
+			continue;
+		}
+		bind_shape_vertices(*rasterizer, *model, i);
+		rasterizer->set_index_buffer(lods[i].index_buffer);
+		rasterizer->set_meshlets(lods[i].meshlets);
+		rasterizer->draw_depth_only(lods[i].index_buffer->get_number_of_elements());
+		is_occluder[i] = true;
+		++num_occluders;
+	}
+
+	// Other shapes are tested against the depth of occluders
+	rasterizer->build_depth_pyramid();
+	auto is_culled = [&](size_t i) {
+		return !is_occluder[i] && rasterizer->is_occluded(bounding_boxes[i]);
+	};
+	num_culled_shapes = std::count_if(visible_shapes.begin(), visible_shapes.end(), is_culled);
+	visible_shapes.erase(std::remove_if(visible_shapes.begin(), visible_shapes.end(), is_culled), visible_shapes.end());
+
+	// Fragments of occluders have the same depth when they are drawn again
+	shape_depth_function = depth_function::less_equal;
+}
+
+template<typename PS>
+void cg::renderer::rasterization_renderer::record_shapes(command_list<cg::vertex, PS>& commands, bool depth_only) const
+{
+	auto &lods = shape_lods;
+
+	for (size_t i : visible_shapes) {
+		bind_shape_vertices(commands, *model, i);
+		commands.set_index_buffer(lods[i].index_buffer);
+		commands.set_meshlets(lods[i].meshlets);
+		commands.set_sort_key(0, shape_distances[i]);
+
+		const size_t num_indices = lods[i].index_buffer->get_number_of_elements();
+		if (instances && depth_only) {
+			commands.draw_depth_only_instanced(num_indices, instances);
+		}
+		else if (instances) {
+			commands.draw_instanced(num_indices, instances);
+		}
+		else if (depth_only) {
+			commands.draw_depth_only(num_indices);
+		}
+		else {
+			commands.draw(num_indices);
+		}
+	}
+}
+
+void cg::renderer::rasterization_renderer::render_forward(const shader_constants& constants)
+{
+	// Render every shape not culled by occlusion
+	rasterization_commands commands;
+	commands.set_constants(constants);
+	commands.set_depth_function(shape_depth_function);
+	record_shapes(commands, false);
+
+	rasterizer->execute(commands, true);
+}
+
+void cg::renderer::rasterization_renderer::render_depth_prepass(const shader_constants& constants)
+{
+	rasterization_commands commands;
+	commands.set_constants(constants);
+
+	// First pass fills depth buffer only, vertex shader and pixel shader are skipped
+	commands.set_depth_function(shape_depth_function);
+	record_shapes(commands, true);
+
+	// Second pass shades only fragments with the final depth, so each pixel is shaded once.
+	// Vertex shader transforms positions exactly as the depth-only stream does,
+	// hence depth values match bit to bit
+	commands.set_depth_function(depth_function::equal);
+	record_shapes(commands, false);
+
+	// Depth-only draws are executed first
+	rasterizer->execute(commands, true);
+}
+
+void cg::renderer::rasterization_renderer::render_deferred(const shader_constants& constants)
+{
+	auto &lods = shape_lods;
+
+	// Geometry pass: fill G-buffer and depth, no lighting is done here.
+	// Depth buffer is already cleared together with the render target.
+	// Draws are grouped by the material of their first face, so its texture stays in cache
+	geometry_commands commands;
+	commands.set_constants(constants);
+	commands.set_depth_function(shape_depth_function);
+	commands.set_pixel_shader(geometry_rasterizer->pixel_shader);
+	for (size_t i : visible_shapes) {
+		bind_shape_vertices(commands, *model, i);
+		commands.set_index_buffer(lods[i].index_buffer);
+		commands.set_meshlets(lods[i].meshlets);
+		commands.set_face_materials(lods[i].face_materials);
+		const unsigned int first_material = lods[i].face_materials->get_number_of_elements() != 0
+													? lods[i].face_materials->item(0)
+													: 0;
+		commands.set_sort_key(first_material, shape_distances[i]);
+
+		const size_t num_indices = lods[i].index_buffer->get_number_of_elements();
+		if (instances) {
+			commands.draw_instanced(num_indices, instances);
+		}
+		else {
+			commands.draw(num_indices);
+		}
+	}
+	geometry_rasterizer->execute(commands, true);
+
+	// Lighting pass writes render target directly, so background gets its clear color first
+	rasterizer->resolve();
+	lighting_pass(constants);
+}
+
+void cg::renderer::rasterization_renderer::lighting_pass(const shader_constants& constants)
+{
+	using namespace DirectX;
+
+	const size_t width = get_width();
+	const size_t height = get_height();
+
+	// Screen space to world space transformation for position reconstruction from depth
+	const XMMATRIX inverse_view_projection = XMMatrixInverse(
+			nullptr, XMMatrixMultiply(constants.view, constants.projection));
+	const XMVECTOR eye = camera->get_position();
+
+	const XMVECTOR light_position = XMLoadFloat3(&light.position);
+	const XMVECTOR light_ambient = XMLoadFloat3(&light.ambient);
+	const XMVECTOR light_diffuse = XMLoadFloat3(&light.diffuse);
+	const XMVECTOR light_specular = XMLoadFloat3(&light.specular);
+	const XMVECTOR sun_dir = sun ? XMVectorNegate(XMLoadFloat3(&sun->direction)) : XMVectorZero();
+	const std::vector<cg::material>& materials = model->get_materials();
+
+	// Every pixel of the band is shaded exactly once, rows are independent
+	utils::parallel_for(0, band_rows, [&](size_t y) {
+		for (size_t x = 0; x != width; ++x) {
+			const float depth = depth_buffer->item(x, y).to_depth();
+			// Keep background where no geometry was rendered
+			if (depth == depth_format::far_depth) {
+				continue;
+			}
+
+			const gbuffer_texel& texel = gbuffer->item(x, y);
+			const cg::material& material = materials[texel.material_id];
+
+			const XMVECTOR ndc = XMVectorSet(
+					(static_cast<float>(x) + 0.5f) / static_cast<float>(width) * 2.0f - 1.0f,
+					1.0f - (static_cast<float>(band_first_row + y) + 0.5f) / static_cast<float>(height) * 2.0f,
+					depth, 1.0f);
+			const XMVECTOR position = XMVector3TransformCoord(ndc, inverse_view_projection);
+
+			const XMVECTOR view_dir = XMVector3Normalize(XMVectorSubtract(eye, position));
+			const XMVECTOR light_dir = XMVector3Normalize(XMVectorSubtract(light_position, position));
+			XMVECTOR normal = XMLoadFloat3(&texel.normal);
+			// Back faces are lit as front ones when culling is disabled
+			if (XMVectorGetX(XMVector3Dot(normal, view_dir)) < 0.0f) {
+				normal = XMVectorNegate(normal);
+			}
+
+			// Blinn-Phong lighting, shadows attenuate diffuse and specular parts
+			XMVECTOR output = XMLoadFloat3(&material.emissive);
+			output = XMVectorAdd(output, XMColorModulate(light_ambient, XMLoadFloat3(&material.ambient)));
+
+			auto add_light = [&](FXMVECTOR direction, FXMVECTOR diffuse, FXMVECTOR specular, const auto& shadows) {
+				const float diffuse_factor = std::max(XMVectorGetX(XMVector3Dot(normal, direction)), 0.0f);
+				if (diffuse_factor == 0.0f) {
+					return;
+				}
+				const float visibility = shadows ? shadows->lookup(position, normal) : 1.0f;
+				output = XMVectorAdd(output, XMVectorScale(
+						XMColorModulate(diffuse, XMLoadFloat3(&texel.albedo)), diffuse_factor * visibility));
+
+				const XMVECTOR half_dir = XMVector3Normalize(XMVectorAdd(direction, view_dir));
+				const float specular_factor = std::pow(
+						std::max(XMVectorGetX(XMVector3Dot(normal, half_dir)), 0.0f), material.shininess);
+				output = XMVectorAdd(output, XMVectorScale(
+						XMColorModulate(specular, XMLoadFloat3(&material.specular)), specular_factor * visibility));
+			};
+			add_light(light_dir, light_diffuse, light_specular, light_shadows);
+			if (sun) {
+				add_light(sun_dir, XMLoadFloat3(&sun->diffuse), XMLoadFloat3(&sun->specular), sun_shadows);
+			}
+
+			render_target->item(x, y) = rgba8_color::from_xmvector(output);
+		}
+	});
+}
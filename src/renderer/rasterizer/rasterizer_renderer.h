@@ -1,10 +1,104 @@
 #include "renderer/rasterizer/rasterizer.h"
+#include "renderer/rasterizer/shadow_map.h"
 #include "renderer/renderer.h"
 #include "resource.h"
+#include "world/texture_cache.h"
 
 
 namespace cg::renderer
 {
+	// Transforms vertices into clip space with matrices supplied once per frame.
+	// Normals are transformed into world space
+	struct transform_vertex_shader
+	{
+		vertex_output<cg::vertex> operator()(const cg::vertex& vertex_data, const shader_constants& constants) const
+		{
+			vertex_output<cg::vertex> output{{}, vertex_data};
+
+			const DirectX::XMVECTOR address = DirectX::XMVectorSetW(DirectX::XMLoadFloat3(&vertex_data.position), 1.0f);
+			DirectX::XMStoreFloat4(&output.position, DirectX::XMVector4Transform(address, constants.world_view_projection));
+
+			const DirectX::XMVECTOR normal = DirectX::XMVector3TransformNormal(DirectX::XMLoadFloat3(&vertex_data.normal), constants.world);
+			DirectX::XMStoreFloat3(&output.attributes.normal, normal);
+			return output;
+		}
+	};
+
+	// Renders pixels according to barycentric distance from vertices.
+	// This way, vertices have black color and face centers have white
+	struct barycentric_pixel_shader
+	{
+		cg::color operator()(const cg::vertex& vertex_data, const float b, const float z) const
+		{
+			const float intensity = (1 - b);
+			return cg::color::from_float3(float3{intensity, intensity, intensity});
+		}
+	};
+
+	// Geometry pass of deferred shading, writes surface data instead of color.
+	// Material id comes from the face, diffuse texture is looked up by the material id
+	struct gbuffer_pixel_shader
+	{
+		gbuffer_texel operator()(const cg::vertex& vertex_data, const float b, const float z,
+								 const uv_derivatives& derivatives) const
+		{
+			gbuffer_texel texel;
+			DirectX::XMStoreFloat3(&texel.normal, DirectX::XMVector3Normalize(DirectX::XMLoadFloat3(&vertex_data.normal)));
+			texel.albedo = (*materials)[material_id].diffuse;
+			const size_t texture_id = (*texture_ids)[material_id];
+			if (texture_id != cg::world::texture_cache::no_texture) {
+				const DirectX::XMVECTOR texture_color = textures->sample_grad(
+						texture_id, vertex_data.uv, derivatives.ddx, derivatives.ddy);
+				DirectX::XMStoreFloat3(&texel.albedo, DirectX::XMColorModulate(
+						DirectX::XMLoadFloat3(&texel.albedo), texture_color));
+			}
+			texel.material_id = material_id;
+			return texel;
+		}
+
+		unsigned int material_id = 0;
+		const std::vector<cg::material>* materials = nullptr;
+		const cg::world::texture_cache* textures = nullptr;
+		// Texture id in the cache for every material
+		const std::vector<size_t>* texture_ids = nullptr;
+	};
+
+	// Reversed-Z float depth keeps precision far from the camera,
+	// depth16_unorm or depth24_unorm halve the depth bandwidth
+	using depth_format = cg::depth32f_reversed;
+
+	using rasterization_pipeline = cg::renderer::rasterizer<cg::vertex, cg::rgba8_color,
+															transform_vertex_shader, barycentric_pixel_shader, depth_format>;
+
+	using geometry_pipeline = cg::renderer::rasterizer<cg::vertex, gbuffer_texel,
+													   transform_vertex_shader, gbuffer_pixel_shader, depth_format>;
+
+	using rasterization_commands = cg::renderer::command_list<cg::vertex, barycentric_pixel_shader>;
+	using geometry_commands = cg::renderer::command_list<cg::vertex, gbuffer_pixel_shader>;
+
+	enum class rasterization_mode
+	{
+		forward,
+		prepass,
+		deferred
+	};
+
+	struct point_light
+	{
+		DirectX::XMFLOAT3 position;
+		DirectX::XMFLOAT3 ambient;
+		DirectX::XMFLOAT3 diffuse;
+		DirectX::XMFLOAT3 specular;
+	};
+
+	// Light coming from infinitely far away, direction points from the light
+	struct directional_light
+	{
+		DirectX::XMFLOAT3 direction;
+		DirectX::XMFLOAT3 diffuse;
+		DirectX::XMFLOAT3 specular;
+	};
+
 	class rasterization_renderer : public renderer
 	{
 	public:
@@ -15,9 +109,53 @@ namespace cg::renderer
 		virtual void render();
 
 	protected:
-		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
-		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<cg::rgba8_color>> render_target;
+		std::shared_ptr<cg::resource<depth_format>> depth_buffer;
+
+		std::shared_ptr<rasterization_pipeline> rasterizer;
+
+		rasterization_mode mode = rasterization_mode::forward;
+
+		// Rows of the image covered by render target in the current band
+		size_t band_first_row = 0;
+		size_t band_rows = 0;
+
+		// Copies of the model drawn with one instanced draw per shape, null for a single copy
+		std::shared_ptr<cg::resource<instance_data>> instances;
+
+		// Index buffers and meshlets of shapes at LODs selected for the current frame
+		std::vector<cg::world::mesh_lod> shape_lods;
+
+		// Occlusion culling is done for a single model copy only.
+		// Shapes to draw in front-to-back order, and statistics of the last frame
+		std::vector<size_t> visible_shapes;
+		std::vector<float> shape_distances;
+		size_t num_occluders = 0;
+		size_t num_culled_shapes = 0;
+		// Occluders already have their depth when shapes are drawn
+		depth_function shape_depth_function = depth_function::less;
+
+		// Deferred shading resources
+		std::shared_ptr<cg::resource<gbuffer_texel>> gbuffer;
+		std::shared_ptr<geometry_pipeline> geometry_rasterizer;
+		std::shared_ptr<cg::world::texture_cache> textures;
+		std::vector<size_t> material_texture_ids;
+		point_light light;
+		// Shadow maps are null when shadows are disabled, sun is optional
+		std::shared_ptr<cube_shadow_map> light_shadows;
+		std::shared_ptr<directional_light> sun;
+		std::shared_ptr<cascaded_shadow_map> sun_shadows;
 
-		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+		void render_band(const shader_constants& constants);
+		// Shadow maps depend on the camera through cascades, so they are rendered every frame
+		void render_shadow_maps();
+		void cull_occluded_shapes();
+		// Records draws of visible shapes sorted front to back by the distance to the camera
+		template<typename PS>
+		void record_shapes(command_list<cg::vertex, PS>& commands, bool depth_only) const;
+		void render_forward(const shader_constants& constants);
+		void render_depth_prepass(const shader_constants& constants);
+		void render_deferred(const shader_constants& constants);
+		void lighting_pass(const shader_constants& constants);
 	};
 }// namespace cg::renderer
\ No newline at end of file
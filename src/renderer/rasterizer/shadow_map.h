@@ -0,0 +1,428 @@
+#pragma once
+
+#include "renderer/rasterizer/rasterizer.h"
+#include "resource.h"
+#include "world/camera.h"
+#include "world/model.h"
+
+#include <DirectXCollision.h>
+#include <DirectXMath.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+
+namespace cg::renderer
+{
+	// Shadow casters need clip space position only
+	struct shadow_vertex_shader
+	{
+		vertex_output<cg::vertex> operator()(const cg::vertex& vertex_data, const shader_constants& constants) const
+		{
+			vertex_output<cg::vertex> output{{}, vertex_data};
+			const DirectX::XMVECTOR address = DirectX::XMVectorSetW(DirectX::XMLoadFloat3(&vertex_data.position), 1.0f);
+			DirectX::XMStoreFloat4(&output.position, DirectX::XMVector4Transform(address, constants.world_view_projection));
+			return output;
+		}
+	};
+
+	// Shadow maps are filled by depth-only draws, so pixel shader is never called
+	struct shadow_pixel_shader
+	{
+		cg::color operator()(const cg::vertex& vertex_data, const float b, const float z) const
+		{
+			return cg::color::from_float3(float3{0.0f, 0.0f, 0.0f});
+		}
+	};
+
+	// Binds vertices of a shape to a pipeline or a command list in the format the model keeps them in
+	template<typename T>
+	inline void bind_shape_vertices(T& target, const cg::world::model& model, size_t shape)
+	{
+		if (model.has_compact_vertices()) {
+			target.set_compact_vertex_buffer(model.get_compact_vertex_buffers()[shape],
+											 model.get_per_shape_vertex_quantizations()[shape]);
+		}
+		else {
+			target.set_vertex_streams(model.get_vertex_streams(shape));
+		}
+	}
+
+	// Shadow maps have no color target
+	using shadow_pipeline = cg::renderer::rasterizer<cg::vertex, cg::rgba8_color,
+													 shadow_vertex_shader, shadow_pixel_shader, cg::depth32f>;
+
+	// Depth of the scene seen from a light. Texels keep post-projection depth,
+	// a point is lit if it is not farther from the light than the stored depth
+	struct shadow_map
+	{
+		// Kernel of percentage closer filtering is (2 * pcf_radius + 1) texels wide
+		static constexpr int pcf_radius = 1;
+		// Lookup position is moved along the normal by this many texels against self-shadowing
+		static constexpr float normal_offset = 1.5f;
+
+		DirectX::XMMATRIX view_projection;
+		std::shared_ptr<cg::resource<cg::depth32f>> depth;
+
+		void render(shadow_pipeline& pipeline, const DirectX::XMMATRIX& view, const DirectX::XMMATRIX& projection,
+					const cg::world::model& model, std::shared_ptr<cg::resource<instance_data>> instances);
+		// Fraction of filter texels around the point which are not closer to the light than the point.
+		// Weights of the border texels are bilinear, so the result changes smoothly between texels
+		float sample_pcf(DirectX::FXMVECTOR world_position, float depth_bias) const;
+	};
+
+	// World space bounds of the model and all its instances, every shadow caster is inside
+	inline DirectX::BoundingSphere compute_caster_bounds(const cg::world::model& model,
+														  std::shared_ptr<cg::resource<instance_data>> instances)
+	{
+		const auto& bounding_boxes = model.get_per_shape_bounding_boxes();
+		DirectX::BoundingBox model_box = bounding_boxes.front();
+		for (const auto& box : bounding_boxes) {
+			DirectX::BoundingBox::CreateMerged(model_box, model_box, box);
+		}
+
+		DirectX::BoundingBox scene_box;
+		model_box.Transform(scene_box, model.get_world_matrix());
+		if (instances) {
+			model_box.Transform(scene_box, instances->item(0).world);
+			for (size_t i = 1; i != instances->get_number_of_elements(); ++i) {
+				DirectX::BoundingBox instance_box;
+				model_box.Transform(instance_box, instances->item(i).world);
+				DirectX::BoundingBox::CreateMerged(scene_box, scene_box, instance_box);
+			}
+		}
+
+		const float radius = DirectX::XMVectorGetX(DirectX::XMVector3Length(DirectX::XMLoadFloat3(&scene_box.Extents)));
+		return DirectX::BoundingSphere(scene_box.Center, radius);
+	}
+
+	// Shadows of a directional light. View frustum is split into cascades by distance,
+	// every cascade has its own orthographic shadow map, so near texels are smaller on screen
+	class cascaded_shadow_map
+	{
+	public:
+		cascaded_shadow_map(size_t in_resolution, size_t num_cascades);
+
+		// Fits cascades to slices of camera frustum, light is moved back to see every caster
+		void update(const cg::world::camera& camera, DirectX::FXMVECTOR light_direction,
+					const DirectX::BoundingSphere& caster_bounds);
+		void render(const cg::world::model& model, std::shared_ptr<cg::resource<instance_data>> instances = nullptr);
+
+		// Fraction of the light reaching the point, 1 beyond the last cascade
+		float lookup(DirectX::FXMVECTOR world_position, DirectX::FXMVECTOR normal) const;
+
+	protected:
+		// Weight of logarithmic splits, the rest are uniform
+		static constexpr float split_lambda = 0.5f;
+
+		struct cascade
+		{
+			shadow_map map;
+			DirectX::XMMATRIX view;
+			DirectX::XMMATRIX projection;
+			// Camera view depth where the cascade ends
+			float split_depth;
+			// World size of a texel and a texel of depth after projection
+			float texel_size;
+			float depth_bias;
+		};
+
+		size_t resolution;
+		std::vector<cascade> cascades;
+		DirectX::XMVECTOR eye;
+		DirectX::XMVECTOR view_direction;
+		shadow_pipeline pipeline;
+	};
+
+	// Shadows of a point light, a perspective shadow map per cube face
+	class cube_shadow_map
+	{
+	public:
+		cube_shadow_map(size_t in_resolution, float in_z_near, float in_z_far);
+
+		void update(DirectX::FXMVECTOR light_position);
+		void render(const cg::world::model& model, std::shared_ptr<cg::resource<instance_data>> instances = nullptr);
+
+		// Fraction of the light reaching the point, 1 beyond the far plane
+		float lookup(DirectX::FXMVECTOR world_position, DirectX::FXMVECTOR normal) const;
+
+	protected:
+		// Depth bias as a fraction of the distance to the light
+		static constexpr float relative_depth_bias = 0.005f;
+
+		size_t resolution;
+		float z_near;
+		float z_far;
+		DirectX::XMVECTOR position;
+		// +X, -X, +Y, -Y, +Z, -Z
+		std::array<shadow_map, 6> faces;
+		std::array<DirectX::XMMATRIX, 6> views;
+		DirectX::XMMATRIX projection;
+		shadow_pipeline pipeline;
+
+		float project_depth(float distance) const;
+	};
+
+	inline void shadow_map::render(shadow_pipeline& pipeline, const DirectX::XMMATRIX& view,
+								   const DirectX::XMMATRIX& projection, const cg::world::model& model,
+								   std::shared_ptr<cg::resource<instance_data>> instances)
+	{
+		const size_t size = depth->get_stride();
+		pipeline.set_render_target(nullptr, depth);
+		pipeline.set_viewport(size, size);
+		pipeline.clear_render_target(cg::depth32f::far_depth);
+
+		view_projection = DirectX::XMMatrixMultiply(view, projection);
+		shader_constants constants;
+		constants.world = model.get_world_matrix();
+		constants.view = view;
+		constants.projection = projection;
+		constants.world_view_projection = DirectX::XMMatrixMultiply(constants.world, view_projection);
+		pipeline.set_constants(constants);
+
+		const auto& index_buffers = model.get_index_buffers();
+		for (size_t i = 0; i != index_buffers.size(); ++i) {
+			bind_shape_vertices(pipeline, model, i);
+			pipeline.set_index_buffer(index_buffers[i]);
+			const size_t num_indices = index_buffers[i]->get_number_of_elements();
+			if (instances) {
+				pipeline.draw_depth_only_instanced(num_indices, instances);
+			}
+			else {
+				pipeline.draw_depth_only(num_indices);
+			}
+		}
+	}
+
+	inline float shadow_map::sample_pcf(DirectX::FXMVECTOR world_position, float depth_bias) const
+	{
+		const DirectX::XMVECTOR clip = DirectX::XMVector4Transform(
+				DirectX::XMVectorSetW(world_position, 1.0f), view_projection);
+		const float w = DirectX::XMVectorGetW(clip);
+		const float z = DirectX::XMVectorGetZ(clip) / w;
+		// Points behind the light or beyond its far plane are lit
+		if (w <= 0.0f || z > 1.0f) {
+			return 1.0f;
+		}
+
+		// Same viewport mapping as rasterizer, texel centers are at half-integer coordinates
+		const int size = static_cast<int>(depth->get_stride());
+		const float x = (DirectX::XMVectorGetX(clip) / w + 1.0f) * 0.5f * static_cast<float>(size) - 0.5f;
+		const float y = (1.0f - DirectX::XMVectorGetY(clip) / w) * 0.5f * static_cast<float>(size) - 0.5f;
+		const float x_floor = std::floor(x);
+		const float y_floor = std::floor(y);
+		const float x_fraction = x - x_floor;
+		const float y_fraction = y - y_floor;
+
+		const float receiver_depth = z - depth_bias;
+		float lit = 0.0f;
+		for (int j = -pcf_radius; j <= pcf_radius + 1; ++j) {
+			const float y_weight = j == -pcf_radius ? 1.0f - y_fraction : (j == pcf_radius + 1 ? y_fraction : 1.0f);
+			const int texel_y = std::clamp(static_cast<int>(y_floor) + j, 0, size - 1);
+			for (int i = -pcf_radius; i <= pcf_radius + 1; ++i) {
+				const float x_weight = i == -pcf_radius ? 1.0f - x_fraction : (i == pcf_radius + 1 ? x_fraction : 1.0f);
+				const int texel_x = std::clamp(static_cast<int>(x_floor) + i, 0, size - 1);
+				if (receiver_depth <= depth->item(texel_x, texel_y).to_depth()) {
+					lit += x_weight * y_weight;
+				}
+			}
+		}
+		const float kernel_width = static_cast<float>(2 * pcf_radius + 1);
+		return lit / (kernel_width * kernel_width);
+	}
+
+	inline cascaded_shadow_map::cascaded_shadow_map(size_t in_resolution, size_t num_cascades)
+		: resolution(in_resolution), cascades(num_cascades)
+	{
+		if (resolution == 0 || num_cascades == 0) {
+			THROW_ERROR("Cascaded shadow map needs at least one cascade of non-zero resolution");
+		}
+		for (cascade& c : cascades) {
+			c.map.depth = std::make_shared<cg::resource<cg::depth32f>>(resolution, resolution);
+		}
+		pipeline.set_cull_mode(cull_mode::none);
+	}
+
+	inline void cascaded_shadow_map::update(const cg::world::camera& camera, DirectX::FXMVECTOR light_direction,
+											const DirectX::BoundingSphere& caster_bounds)
+	{
+		using namespace DirectX;
+
+		eye = camera.get_position();
+		view_direction = camera.get_direction();
+		const XMMATRIX projection = camera.get_projection_matrix();
+		const XMMATRIX inverse_view_projection = XMMatrixInverse(
+				nullptr, XMMatrixMultiply(camera.get_view_matrix(), projection));
+
+		const XMVECTOR direction = XMVector3Normalize(light_direction);
+		// Any vector not parallel to the light works as up
+		const XMVECTOR up = std::abs(XMVectorGetY(direction)) > 0.99f ? XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f)
+																	   : XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+		const XMMATRIX light_rotation = XMMatrixLookToLH(XMVectorZero(), direction, up);
+		const XMMATRIX inverse_light_rotation = XMMatrixInverse(nullptr, light_rotation);
+		const XMVECTOR caster_center = XMLoadFloat3(&caster_bounds.Center);
+
+		auto ndc_depth = [&](float view_depth) {
+			return XMVectorGetZ(XMVector3TransformCoord(XMVectorSet(0.0f, 0.0f, view_depth, 1.0f), projection));
+		};
+
+		const float z_near = camera.get_z_near();
+		const float z_far = camera.get_z_far();
+		float slice_near = z_near;
+		for (size_t i = 0; i != cascades.size(); ++i) {
+			cascade& c = cascades[i];
+
+			// Practical split scheme: a mix of logarithmic and uniform splits
+			const float fraction = static_cast<float>(i + 1) / static_cast<float>(cascades.size());
+			const float slice_far = split_lambda * z_near * std::pow(z_far / z_near, fraction) +
+									(1.0f - split_lambda) * (z_near + (z_far - z_near) * fraction);
+			c.split_depth = slice_far;
+
+			// Bounding sphere of the slice corners keeps cascade size constant while camera rotates
+			XMVECTOR corners[8];
+			XMVECTOR center = XMVectorZero();
+			for (size_t corner = 0; corner != 8; ++corner) {
+				const XMVECTOR ndc = XMVectorSet((corner & 1) ? 1.0f : -1.0f, (corner & 2) ? 1.0f : -1.0f,
+												 ndc_depth((corner & 4) ? slice_far : slice_near), 1.0f);
+				corners[corner] = XMVector3TransformCoord(ndc, inverse_view_projection);
+				center = XMVectorAdd(center, corners[corner]);
+			}
+			center = XMVectorScale(center, 1.0f / 8.0f);
+			float radius = 0.0f;
+			for (const XMVECTOR& corner : corners) {
+				radius = std::max(radius, XMVectorGetX(XMVector3Length(XMVectorSubtract(corner, center))));
+			}
+			slice_near = slice_far;
+
+			// Center moves by whole texels across the light, so edges of shadows do not shimmer
+			c.texel_size = 2.0f * radius / static_cast<float>(resolution);
+			XMVECTOR light_space_center = XMVector3TransformCoord(center, light_rotation);
+			light_space_center = XMVectorSetX(light_space_center,
+											   std::floor(XMVectorGetX(light_space_center) / c.texel_size) * c.texel_size);
+			light_space_center = XMVectorSetY(light_space_center,
+											   std::floor(XMVectorGetY(light_space_center) / c.texel_size) * c.texel_size);
+			center = XMVector3TransformCoord(light_space_center, inverse_light_rotation);
+
+			// Light is moved back from the slice until every caster of the scene is in front of it
+			const float back_distance = std::max(
+					radius, XMVectorGetX(XMVector3Dot(XMVectorSubtract(center, caster_center), direction)) + caster_bounds.Radius);
+			const float depth_range = back_distance + radius;
+			c.view = XMMatrixLookToLH(XMVectorSubtract(center, XMVectorScale(direction, back_distance)), direction, up);
+			c.projection = XMMatrixOrthographicLH(2.0f * radius, 2.0f * radius, 0.0f, depth_range);
+			c.depth_bias = c.texel_size / depth_range;
+		}
+	}
+
+	inline void cascaded_shadow_map::render(const cg::world::model& model,
+											std::shared_ptr<cg::resource<instance_data>> instances)
+	{
+		for (cascade& c : cascades) {
+			c.map.render(pipeline, c.view, c.projection, model, instances);
+		}
+	}
+
+	inline float cascaded_shadow_map::lookup(DirectX::FXMVECTOR world_position, DirectX::FXMVECTOR normal) const
+	{
+		using namespace DirectX;
+
+		const float view_depth = XMVectorGetX(XMVector3Dot(XMVectorSubtract(world_position, eye), view_direction));
+		for (const cascade& c : cascades) {
+			if (view_depth <= c.split_depth) {
+				const XMVECTOR position = XMVectorAdd(
+						world_position, XMVectorScale(normal, shadow_map::normal_offset * c.texel_size));
+				return c.map.sample_pcf(position, c.depth_bias);
+			}
+		}
+		return 1.0f;
+	}
+
+	inline cube_shadow_map::cube_shadow_map(size_t in_resolution, float in_z_near, float in_z_far)
+		: resolution(in_resolution), z_near(in_z_near), z_far(in_z_far)
+	{
+		if (resolution == 0 || z_near <= 0.0f || z_far <= z_near) {
+			THROW_ERROR("Cube shadow map needs non-zero resolution and 0 < z_near < z_far");
+		}
+		for (shadow_map& face : faces) {
+			face.depth = std::make_shared<cg::resource<cg::depth32f>>(resolution, resolution);
+		}
+		pipeline.set_cull_mode(cull_mode::none);
+
+		// Field of view is a bit wider than 90 degrees, so filter kernel near a face edge stays inside the face
+		const float margin = static_cast<float>(2 * (shadow_map::pcf_radius + 1)) / static_cast<float>(resolution);
+		projection = DirectX::XMMatrixPerspectiveFovLH(2.0f * std::atan(1.0f + margin), 1.0f, z_near, z_far);
+	}
+
+	inline void cube_shadow_map::update(DirectX::FXMVECTOR light_position)
+	{
+		using namespace DirectX;
+
+		position = light_position;
+		const XMVECTOR directions[6] = {
+				XMVectorSet(1.0f, 0.0f, 0.0f, 0.0f), XMVectorSet(-1.0f, 0.0f, 0.0f, 0.0f),
+				XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f), XMVectorSet(0.0f, -1.0f, 0.0f, 0.0f),
+				XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f), XMVectorSet(0.0f, 0.0f, -1.0f, 0.0f)};
+		const XMVECTOR ups[6] = {
+				XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f), XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f),
+				XMVectorSet(0.0f, 0.0f, -1.0f, 0.0f), XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f),
+				XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f), XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f)};
+		for (size_t i = 0; i != 6; ++i) {
+			views[i] = XMMatrixLookToLH(position, directions[i], ups[i]);
+		}
+	}
+
+	inline void cube_shadow_map::render(const cg::world::model& model,
+										std::shared_ptr<cg::resource<instance_data>> instances)
+	{
+		for (size_t i = 0; i != 6; ++i) {
+			faces[i].render(pipeline, views[i], projection, model, instances);
+		}
+	}
+
+	inline float cube_shadow_map::lookup(DirectX::FXMVECTOR world_position, DirectX::FXMVECTOR normal) const
+	{
+		using namespace DirectX;
+
+		// Texel footprint grows linearly with the distance to the light
+		XMFLOAT3 to_point;
+		XMStoreFloat3(&to_point, XMVectorSubtract(world_position, position));
+		const float distance = std::max({std::abs(to_point.x), std::abs(to_point.y), std::abs(to_point.z)});
+		const float texel_size = 2.0f * distance / static_cast<float>(resolution);
+		const XMVECTOR offset_position = XMVectorAdd(
+				world_position, XMVectorScale(normal, shadow_map::normal_offset * texel_size));
+
+		// Face is chosen by the major axis of the direction from the light
+		XMStoreFloat3(&to_point, XMVectorSubtract(offset_position, position));
+		const float abs_x = std::abs(to_point.x);
+		const float abs_y = std::abs(to_point.y);
+		const float abs_z = std::abs(to_point.z);
+		size_t face;
+		float face_distance;
+		if (abs_x >= abs_y && abs_x >= abs_z) {
+			face = to_point.x > 0.0f ? 0 : 1;
+			face_distance = abs_x;
+		}
+		else if (abs_y >= abs_z) {
+			face = to_point.y > 0.0f ? 2 : 3;
+			face_distance = abs_y;
+		}
+		else {
+			face = to_point.z > 0.0f ? 4 : 5;
+			face_distance = abs_z;
+		}
+		if (face_distance >= z_far) {
+			return 1.0f;
+		}
+
+		// Bias is linear in distance, converted to the depth stored by perspective projection
+		const float depth_bias = project_depth(face_distance) -
+								 project_depth(std::max(face_distance * (1.0f - relative_depth_bias), z_near));
+		return faces[face].sample_pcf(offset_position, depth_bias);
+	}
+
+	inline float cube_shadow_map::project_depth(float distance) const
+	{
+		return z_far / (z_far - z_near) * (1.0f - z_near / distance);
+	}
+}// namespace cg::renderer
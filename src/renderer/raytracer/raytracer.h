@@ -1,7 +1,9 @@
 #pragma once
 
+#include "renderer/rasterizer/shadow_map.h"
 #include "resource.h"
 #include "world/camera.h"
+#include "world/texture_cache.h"
 
 #include "DirectXCollision.h"
 #include "DirectXMath.h"
@@ -76,6 +78,9 @@ namespace cg::renderer
 	{
 		float depth; // length of the ray
 		vertex point; // point of intersection
+		unsigned int material_id = 0; // material of the hit face
+		size_t texture_id = world::texture_cache::no_texture; // texture of the material of the hit face
+		float uv_per_world_unit = 0.0f; // texture coordinates density of the hit triangle
 
 		// comparison operator is used to find the closest hit
 		bool operator<(const payload& other) const
@@ -100,16 +105,44 @@ namespace cg::renderer
 	public:
 		void set_render_target(std::shared_ptr<resource<RT>> in_render_target);
 
+		// Only marks tiles as cleared, ray generation writes the clear color where it needs it
 		void clear_render_target();
 
 		void set_viewport(size_t in_width, size_t in_height);
 
+		// Traces only rows [first_row, first_row + rows) of the viewport, render target holds just these rows.
+		// Has to be called before set_render_target to size TAA history by the band
+		void set_band(size_t in_first_row, size_t in_rows);
+
 		void set_camera(std::shared_ptr<world::camera> in_camera);
 
 		void set_vertex_buffers(std::vector<std::shared_ptr<resource<VB>>> in_vertex_buffers);
 
+		// Separate attribute streams replace the vertex buffers. Acceleration structures and triangle tests
+		// read the position streams only, other attributes are gathered for hits
+		void set_vertex_streams(std::vector<vertex_streams> in_streams);
+
+		// Quantized vertices replace the vertex buffers, they are decoded when triangles are tested
+		// and hits are interpolated. Setting one kind of vertex input clears the others
+		void set_compact_vertex_buffers(std::vector<std::shared_ptr<resource<compact_vertex>>> in_vertex_buffers,
+										std::vector<vertex_quantization> in_quantizations);
+
 		void set_index_buffers(std::vector<std::shared_ptr<resource<unsigned int>>> in_index_buffers);
 
+		// Material table and material id of every face of index buffers
+		void set_materials(std::vector<material> in_materials,
+						   std::vector<std::shared_ptr<resource<unsigned int>>> in_face_materials);
+
+		// Diffuse texture id in the cache per material, no_texture for materials without texture
+		void set_textures(std::shared_ptr<world::texture_cache> in_textures, std::vector<size_t> in_texture_ids);
+
+		// Shadows of the point light are looked up in the cube map instead of tracing shadow rays.
+		// The map has to be rendered for the light of hit shader
+		void set_shadow_map(std::shared_ptr<cube_shadow_map> in_shadow_map);
+
+		// Point lights of hit shader
+		void set_lights(std::vector<light> in_lights);
+
 		void build_acceleration_structure();
 
 		void launch_ray_generation(size_t frame_id);
@@ -133,12 +166,37 @@ namespace cg::renderer
 		std::shared_ptr<resource<RT>> history;
 		std::vector<std::shared_ptr<resource<unsigned int>>> index_buffers;
 		std::vector<std::shared_ptr<resource<VB>>> vertex_buffers;
+		std::vector<vertex_streams> streams;
+		std::vector<std::shared_ptr<resource<compact_vertex>>> compact_vertex_buffers;
+		std::vector<vertex_quantization> quantizations;
 		std::vector<DirectX::BoundingBox> acceleration_structures;
+		std::vector<material> materials;
+		std::vector<std::shared_ptr<resource<unsigned int>>> face_materials;
+		std::shared_ptr<world::texture_cache> textures;
+		std::vector<size_t> texture_ids;
+		std::shared_ptr<cube_shadow_map> shadow_map;
+		std::vector<light> lights;
+
+		// Fast clear flag per 8x8 tile, set tiles hold the background gradient in place of their contents
+		static constexpr size_t clear_tile_size = 8;
+		std::vector<unsigned char> cleared_tiles;
+
+		RT get_clear_value(size_t x, size_t y) const;
+		bool is_cleared(size_t x, size_t y) const;
+
+		DirectX::XMVECTOR fetch_position(size_t shape, unsigned int index) const;
+		vertex fetch_vertex(size_t shape, unsigned int index) const;
+
+		// Angle covered by a single pixel, spread of ray footprint for mip selection
+		float pixel_spread_angle = 0.0f;
 
 		std::shared_ptr<world::camera> camera;
 
+		// Height is the number of rows of the current band
 		size_t width = 1920;
 		size_t height = 1080;
+		size_t viewport_height = 1080;
+		size_t band_first_row = 0;
 	};
 
 
@@ -154,23 +212,33 @@ namespace cg::renderer
 	template<typename VB, typename RT>
 	void raytracer<VB, RT>::clear_render_target()
 	{
-		// fill render target with some interesting gradient
 		if (render_target)
 		{
-			for (size_t y = 0; y != height; ++y)
-			{
-				for (size_t x = 0; x != width; ++x)
-				{
-					render_target->item(x, y) = unsigned_color::from_float3({
-						static_cast<float>(x) / width,
-						static_cast<float>(y) / height,
-						1.0
-					});
-				}
-			}
+			const size_t tiles_x = (width + clear_tile_size - 1) / clear_tile_size;
+			const size_t tiles_y = (height + clear_tile_size - 1) / clear_tile_size;
+			cleared_tiles.assign(tiles_x * tiles_y, 1);
 		}
 	}
 
+	template<typename VB, typename RT>
+	RT raytracer<VB, RT>::get_clear_value(size_t x, size_t y) const
+	{
+		// some interesting gradient
+		return RT::from_float3({
+			static_cast<float>(x) / width,
+			static_cast<float>(y + band_first_row) / viewport_height,
+			1.0
+		});
+	}
+
+	template<typename VB, typename RT>
+	bool raytracer<VB, RT>::is_cleared(size_t x, size_t y) const
+	{
+		const size_t tiles_x = (width + clear_tile_size - 1) / clear_tile_size;
+		const size_t tile = (y / clear_tile_size) * tiles_x + x / clear_tile_size;
+		return tile < cleared_tiles.size() && cleared_tiles[tile];
+	}
+
 	template<typename VB, typename RT>
 	void raytracer<VB, RT>::set_index_buffers(std::vector<std::shared_ptr<resource<unsigned int>>> in_index_buffers)
 	{
@@ -181,6 +249,84 @@ namespace cg::renderer
 	void raytracer<VB, RT>::set_vertex_buffers(std::vector<std::shared_ptr<resource<VB>>> in_vertex_buffers)
 	{
 		vertex_buffers = in_vertex_buffers;
+		streams.clear();
+		compact_vertex_buffers.clear();
+		quantizations.clear();
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_vertex_streams(std::vector<vertex_streams> in_streams)
+	{
+		vertex_buffers.clear();
+		streams = in_streams;
+		compact_vertex_buffers.clear();
+		quantizations.clear();
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_compact_vertex_buffers(
+		std::vector<std::shared_ptr<resource<compact_vertex>>> in_vertex_buffers,
+		std::vector<vertex_quantization> in_quantizations)
+	{
+		vertex_buffers.clear();
+		streams.clear();
+		compact_vertex_buffers = in_vertex_buffers;
+		quantizations = in_quantizations;
+	}
+
+	template<typename VB, typename RT>
+	DirectX::XMVECTOR raytracer<VB, RT>::fetch_position(size_t shape, unsigned int index) const
+	{
+		if (!streams.empty())
+		{
+			return DirectX::XMLoadFloat3(&streams[shape].positions->item(index));
+		}
+		if (!compact_vertex_buffers.empty())
+		{
+			return compact_vertex_buffers[shape]->item(index).decode_position(quantizations[shape]);
+		}
+		return DirectX::XMLoadFloat3(&vertex_buffers[shape]->item(index).position);
+	}
+
+	template<typename VB, typename RT>
+	vertex raytracer<VB, RT>::fetch_vertex(size_t shape, unsigned int index) const
+	{
+		if (!streams.empty())
+		{
+			return streams[shape].gather(index);
+		}
+		if (!compact_vertex_buffers.empty())
+		{
+			return compact_vertex_buffers[shape]->item(index).decode(quantizations[shape]);
+		}
+		return vertex_buffers[shape]->item(index);
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_materials(std::vector<material> in_materials,
+										  std::vector<std::shared_ptr<resource<unsigned int>>> in_face_materials)
+	{
+		materials = in_materials;
+		face_materials = in_face_materials;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_textures(std::shared_ptr<world::texture_cache> in_textures, std::vector<size_t> in_texture_ids)
+	{
+		textures = in_textures;
+		texture_ids = in_texture_ids;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_shadow_map(std::shared_ptr<cube_shadow_map> in_shadow_map)
+	{
+		shadow_map = in_shadow_map;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_lights(std::vector<light> in_lights)
+	{
+		lights = in_lights;
 	}
 
 	template<typename VB, typename RT>
@@ -188,7 +334,27 @@ namespace cg::renderer
 	{
 		using namespace DirectX;
 		acceleration_structures.clear();
-		acceleration_structures.reserve(vertex_buffers.size());
+		acceleration_structures.reserve(index_buffers.size());
+
+		// Bounds of streams are found from the packed positions alone
+		for (const vertex_streams& shape_streams : streams)
+		{
+			acceleration_structures.emplace_back();
+			BoundingBox::CreateFromPoints(acceleration_structures.back(),
+										  shape_streams.positions->get_number_of_elements(),
+										  &shape_streams.positions->item(0),
+										  sizeof(XMFLOAT3));
+		}
+
+		// Compact vertices are quantized in the bounds of the shape already
+		for (const vertex_quantization& quantization : quantizations)
+		{
+			const XMVECTOR extents = XMVectorScale(XMLoadFloat3(&quantization.scale), 0.5f);
+			acceleration_structures.emplace_back();
+			XMStoreFloat3(&acceleration_structures.back().Extents, extents);
+			XMStoreFloat3(&acceleration_structures.back().Center,
+						  XMVectorAdd(XMLoadFloat3(&quantization.offset), extents));
+		}
 
 		for (std::shared_ptr<resource<VB>>& vb : vertex_buffers)
 		{
@@ -206,6 +372,19 @@ namespace cg::renderer
 	{
 		width = in_width;
 		height = in_height;
+		viewport_height = in_height;
+		band_first_row = 0;
+	}
+
+	template<typename VB, typename RT>
+	void raytracer<VB, RT>::set_band(size_t in_first_row, size_t in_rows)
+	{
+		if (in_rows == 0 || in_first_row + in_rows > viewport_height)
+		{
+			THROW_ERROR("Band is outside of the viewport");
+		}
+		band_first_row = in_first_row;
+		height = in_rows;
 	}
 
 	template<typename VB, typename RT>
@@ -219,7 +398,7 @@ namespace cg::renderer
 	{
 		using namespace DirectX;
 
-		const float h = static_cast<float>(height);
+		const float h = static_cast<float>(viewport_height);
 		const float w = static_cast<float>(width);
 		const float minZ = camera->get_z_near();
 		const float maxZ = camera->get_z_far();
@@ -227,6 +406,9 @@ namespace cg::renderer
 		const XMMATRIX view = camera->get_view_matrix();
 		XMMATRIX projection = camera->get_projection_matrix();
 
+		// Second row of projection matrix has 1 / tan(fov / 2) scale
+		pixel_spread_angle = 2.0f / (XMVectorGetY(projection.r[1]) * h);
+
 		// Generate jitter values and inject them into projection matrix to offset coordinates
 		XMFLOAT2 jitter = get_jitter(frame_id);
 		jitter.x = (jitter.x * 2.0f - 1.0f) / w * 2;
@@ -238,7 +420,7 @@ namespace cg::renderer
 			for (size_t x = 0; x != width; ++x)
 			{
 				const float fx = static_cast<float>(x);
-				const float fy = static_cast<float>(y);
+				const float fy = static_cast<float>(y + band_first_row);
 				const XMVECTOR pixel = XMVectorSet(fx, fy, 1.0f, 0.0f);
 				// Transform pixel point from screen space into world space far frustum plane
 				XMVECTOR pixelDir = XMVector3Normalize(XMVector3Unproject(pixel,
@@ -254,7 +436,7 @@ namespace cg::renderer
 				if (trace_ray(r, maxZ, minZ, p)) // hit object
 				{
 					const XMVECTOR output = hit_shader(p, r);
-					render_target->item(x, y) = unsigned_color::from_xmvector(output);
+					render_target->item(x, y) = RT::from_xmvector(output);
 				}
 				else // miss object
 				{
@@ -262,7 +444,11 @@ namespace cg::renderer
 					// don't overwrite my beautiful background gradient
 					if (XMVectorGetX(XMVector3Length(output)) > 0)
 					{
-						render_target->item(x, y) = unsigned_color::from_xmvector(output);
+						render_target->item(x, y) = RT::from_xmvector(output);
+					}
+					else if (is_cleared(x, y))
+					{
+						render_target->item(x, y) = get_clear_value(x, y);
 					}
 				}
 
@@ -274,10 +460,13 @@ namespace cg::renderer
 					constexpr float mix_factor = 0.75f;
 					current_color = XMVectorLerp(current_color, history_color, mix_factor);
 				}
-				render_target->item(x, y) = unsigned_color::from_xmvector(current_color);
-				history->item(x, y) = unsigned_color::from_xmvector(current_color);
+				render_target->item(x, y) = RT::from_xmvector(current_color);
+				history->item(x, y) = RT::from_xmvector(current_color);
 			}
 		}
+
+		// Every pixel has been written, no tile holds a pending clear anymore
+		std::fill(cleared_tiles.begin(), cleared_tiles.end(), 0);
 	}
 
 	template<typename VB, typename RT>
@@ -300,14 +489,13 @@ namespace cg::renderer
 
 			for (size_t faceIdx = 0; faceIdx != numFaces; ++faceIdx)
 			{
-				// Extract triangle
-				std::array<vertex, 3> face;
+				// Extract triangle, other attributes are fetched for hits only
+				std::array<unsigned, 3> indices;
 				std::array<XMVECTOR, 3> triangle;
 				for (size_t i = 0; i != 3; ++i)
 				{
-					const unsigned index = index_buffers.at(modelIdx)->item(3 * faceIdx + i);
-					face.at(i) = vertex_buffers.at(modelIdx)->item(index);
-					triangle.at(i) = XMLoadFloat3(&face.at(i).position);
+					indices.at(i) = index_buffers.at(modelIdx)->item(3 * faceIdx + i);
+					triangle.at(i) = fetch_position(modelIdx, indices.at(i));
 				}
 
 				// Calculate normal for lighting
@@ -337,6 +525,12 @@ namespace cg::renderer
 
 						assert(std::abs(XMVectorGetX(XMVectorSum(barycentric)) - 1.0f) < 0.001f);
 
+						std::array<vertex, 3> face;
+						for (size_t i = 0; i != 3; ++i)
+						{
+							face.at(i) = fetch_vertex(modelIdx, indices.at(i));
+						}
+
 						payload hit;
 						hit.depth = t;
 						// Interpolate hit point
@@ -345,6 +539,17 @@ namespace cg::renderer
 							+ face.at(2) * XMVectorGetZ(barycentric);
 
 						XMStoreFloat3(&hit.point.normal, normal);
+						hit.material_id = face_materials.at(modelIdx)->item(faceIdx);
+
+						// Ratio of texture space and world space triangle sizes for mip selection
+						if (hit.material_id < texture_ids.size() && texture_ids[hit.material_id] != world::texture_cache::no_texture) {
+							hit.texture_id = texture_ids[hit.material_id];
+							const float world_area = XMVectorGetX(XMTriangleAreaTwice(faceBasisX, faceBasisY));
+							const XMVECTOR uv0 = XMLoadFloat2(&face.at(0).uv);
+							const XMVECTOR uv_area = XMTriangleAreaTwice(XMVectorSubtract(XMLoadFloat2(&face.at(1).uv), uv0),
+																		XMVectorSubtract(XMLoadFloat2(&face.at(2).uv), uv0));
+							hit.uv_per_world_unit = world_area > 0.0f ? std::sqrt(XMVectorGetX(uv_area) / world_area) : 0.0f;
+						}
 
 						// Register hit
 						hits.insert(hit);
@@ -374,16 +579,7 @@ namespace cg::renderer
 		constexpr bool USE_DIFFUSE = true;
 		constexpr bool USE_SPECULAR = true;
 
-		const std::vector<light> lights =
-		{
-			{
-				XMVectorSet(0.0f, 1.925f, 0.0f, 1.0f),
-				XMVectorSet(0.25f, 0.25f, 0.25f, 1.0f),
-				XMVectorSet(0.75f, 0.75f, 0.75f, 1.0f),
-				XMVectorSet(0.4f, 0.4f, 0.4f, 1.0f)
-			}
-		};
-
+		const material& surface = materials.at(p.material_id);
 		XMVECTOR output = XMVectorZero();
 		for (const light& l : lights)
 		{
@@ -394,14 +590,14 @@ namespace cg::renderer
 			const XMVECTOR incidentDir = XMVectorScale(lightDir, -1.0f);
 			const XMVECTOR reflectedLightDir = XMVector3Reflect(incidentDir, surfaceNormal);
 			const XMVECTOR cameraDir = XMVector3Normalize(XMVectorSubtract(camera_ray.position, address));
-			XMVECTOR shininess = XMVectorReplicate(p.point.shininess);
+			XMVECTOR shininess = XMVectorReplicate(surface.shininess);
 			XMVECTOR shadow = XMVectorSplatOne();
 
 			if (USE_AMBIENT) // add ambient component
 			{
 				// We always add ambient component to compensate the lack of global illumination
 				// Ambient = material.a * light.a
-				const XMVECTOR materialAmbient = XMLoadFloat3(&p.point.ambient);
+				const XMVECTOR materialAmbient = XMLoadFloat3(&surface.ambient);
 				const XMVECTOR ambientComponent = XMColorModulate(l.ambient, materialAmbient);
 				output = XMVectorAdd(output, ambientComponent);
 			}
@@ -412,22 +608,42 @@ namespace cg::renderer
 				continue;
 			}
 
-			// Check if point is not lit by current light source using ray-tracing
-			ray lightRay(address, lightDir);
-			payload shadowPayload;
-			const bool bIsShadow = trace_ray(lightRay, XMVectorGetX(XMVector3Length(lightVector)), 0.0001f,
-											 shadowPayload, true);
-			if (bIsShadow)
+			// Check if point is not lit by current light source using ray-tracing,
+			// or using shadow map when there is one
+			bool bIsShadow;
+			if (shadow_map)
 			{
-				// Point in a shadow are dimmed for diffuse light
-				shadow = XMVectorReplicate(0.5f);
+				// Filtered visibility dims diffuse light smoothly at shadow edges
+				const float visibility = shadow_map->lookup(address, surfaceNormal);
+				bIsShadow = visibility < 0.5f;
+				shadow = XMVectorReplicate(0.5f + 0.5f * visibility);
+			}
+			else
+			{
+				ray lightRay(address, lightDir);
+				payload shadowPayload;
+				bIsShadow = trace_ray(lightRay, XMVectorGetX(XMVector3Length(lightVector)), 0.0001f,
+									  shadowPayload, true);
+				if (bIsShadow)
+				{
+					// Point in a shadow are dimmed for diffuse light
+					shadow = XMVectorReplicate(0.5f);
+				}
 			}
 
 			if (USE_DIFFUSE)
 			{
 				// Add diffuse component
 				// Diffuse = material.d * light.d * shadowCoef * cos(toLightRay <-> normal))
-				const XMVECTOR materialDiffuse = XMLoadFloat3(&p.point.diffuse);
+				XMVECTOR materialDiffuse = XMLoadFloat3(&surface.diffuse);
+				if (p.texture_id != world::texture_cache::no_texture)
+				{
+					// Ray footprint grows linearly with distance
+					const float footprint = p.depth * pixel_spread_angle * p.uv_per_world_unit;
+					const XMVECTOR textureColor = textures->sample_grad(
+						p.texture_id, p.point.uv, XMFLOAT2(footprint, 0.0f), XMFLOAT2(0.0f, footprint));
+					materialDiffuse = XMColorModulate(materialDiffuse, textureColor);
+				}
 				XMVECTOR diffuseComponent = XMVectorDotAbsolute(lightDir, surfaceNormal);
 				diffuseComponent = XMColorModulate(diffuseComponent, l.duffuse);
 				diffuseComponent = XMColorModulate(diffuseComponent, shadow);
@@ -445,7 +661,7 @@ namespace cg::renderer
 
 				// Unfortunately Cornell box model does not have material specular value
 				// Thus, I add one myself
-				//const XMVECTOR materialSpecular = XMLoadFloat3(&p.point.specular);
+				//const XMVECTOR materialSpecular = XMLoadFloat3(&surface.specular);
 				const XMVECTOR materialSpecular = XMVectorSplatOne();
 				XMVECTOR specularComponent;
 				if (USE_BLINN_LIGHTING)
@@ -1,7 +1,9 @@
 #include "raytracer_renderer.h"
 
+#include "utils/png_stream.h"
 #include "utils/resource_utils.h"
 
+#include <algorithm>
 #include <iostream>
 
 void cg::renderer::ray_tracing_renderer::init()
@@ -18,18 +20,56 @@ void cg::renderer::ray_tracing_renderer::init()
 	camera->set_z_near(settings->camera_z_near);
 	camera->set_z_far(settings->camera_z_far);
 
-	// Make render target
-	render_target = std::make_shared<resource<unsigned_color>>(settings->width, settings->height);
+	// Make render target, it holds a single band of the image
+	render_target = std::make_shared<resource<rgba32f_color>>(settings->width, get_band_height());
 
 	// Load model from file
 	model = std::make_shared<world::model>();
-	model->load_obj(settings->model_path);
+	model->load_obj(settings->model_path, settings->compact_vertices);
 
 	// Make raytracer
-	ray_tracer = std::make_shared<raytracer<vertex, unsigned_color>>();
+	ray_tracer = std::make_shared<raytracer<vertex, rgba32f_color>>();
 	ray_tracer->set_viewport(settings->width, settings->height);
+	ray_tracer->set_band(0, get_band_height());
 	ray_tracer->set_render_target(render_target);
 	ray_tracer->set_camera(camera);
+
+	// Register diffuse textures, they are decoded when first hit by a ray.
+	// Missing ones are reported and skipped
+	textures = std::make_shared<world::texture_cache>(
+		static_cast<size_t>(settings->texture_cache_budget_mb) * 1024 * 1024,
+		world::parse_texture_format(settings->texture_format));
+	std::vector<size_t> texture_ids;
+	for (const auto& texture_file : model->get_material_texture_files())
+	{
+		texture_ids.push_back(textures->add_texture(texture_file));
+	}
+	ray_tracer->set_textures(textures, texture_ids);
+
+	// Point light is shared with rasterizer, by default it is under the ceiling of Cornell box
+	const DirectX::XMFLOAT3 light_position_3(settings->light_position.data());
+	const DirectX::XMVECTOR light_position = DirectX::XMVectorSetW(DirectX::XMLoadFloat3(&light_position_3), 1.0f);
+	lights = {
+		{
+			light_position,
+			DirectX::XMVectorSet(0.25f, 0.25f, 0.25f, 1.0f),
+			DirectX::XMVectorSet(0.75f, 0.75f, 0.75f, 1.0f),
+			DirectX::XMVectorSet(0.4f, 0.4f, 0.4f, 1.0f)
+		}
+	};
+	ray_tracer->set_lights(lights);
+
+	// Cube map is rendered for the light of hit shader and reaches the farthest caster
+	if (settings->raytracing_shadow_maps && settings->shadow_map_size != 0)
+	{
+		const DirectX::BoundingSphere caster_bounds = compute_caster_bounds(*model, nullptr);
+		const float light_range = caster_bounds.Radius + DirectX::XMVectorGetX(DirectX::XMVector3Length(
+			DirectX::XMVectorSubtract(light_position, DirectX::XMLoadFloat3(&caster_bounds.Center))));
+		shadow_map = std::make_shared<cube_shadow_map>(settings->shadow_map_size, 0.01f, light_range);
+		shadow_map->update(light_position);
+		shadow_map->render(*model);
+		ray_tracer->set_shadow_map(shadow_map);
+	}
 }
 
 void cg::renderer::ray_tracing_renderer::destroy()
@@ -42,22 +82,78 @@ void cg::renderer::ray_tracing_renderer::update()
 
 void cg::renderer::ray_tracing_renderer::render()
 {
-	auto& vertexBuffers = model->get_vertex_buffers();
-	auto& indexBuffers = model->get_index_buffers();
+	// Acceleration structure of every shape is built for LOD matching its distance to the camera
+	std::vector<std::shared_ptr<cg::resource<unsigned int>>> indexBuffers;
+	std::vector<std::shared_ptr<cg::resource<unsigned int>>> faceMaterials;
+	for (const auto& lod : select_lods({model->get_world_matrix()})) {
+		indexBuffers.push_back(lod.index_buffer);
+		faceMaterials.push_back(lod.face_materials);
+	}
 
-	ray_tracer->set_vertex_buffers(vertexBuffers);
+	if (model->has_compact_vertices())
+	{
+		ray_tracer->set_compact_vertex_buffers(model->get_compact_vertex_buffers(),
+											   model->get_per_shape_vertex_quantizations());
+	}
+	else
+	{
+		std::vector<vertex_streams> streams;
+		for (size_t i = 0; i != model->get_position_streams().size(); ++i)
+		{
+			streams.push_back(model->get_vertex_streams(i));
+		}
+		ray_tracer->set_vertex_streams(streams);
+	}
 	ray_tracer->set_index_buffers(indexBuffers);
+	ray_tracer->set_materials(model->get_materials(), faceMaterials);
 
 	ray_tracer->build_acceleration_structure();
 
-	// render some frames since TAA effect comes after some time
-	for (size_t frame = 0; frame != 10; ++frame)
+	// Large images are traced band by band, every band is written to the file before the next one
+	std::unique_ptr<utils::png_stream_writer> writer;
+	if (get_band_height() < get_height())
+	{
+		writer = std::make_unique<utils::png_stream_writer>(settings->result_path, get_width(), get_height());
+	}
+	for (size_t first_row = 0; first_row < get_height(); first_row += get_band_height())
 	{
-		std::cerr << "Rendering frame " << frame << "...\r" << std::flush;
-		ray_tracer->clear_render_target();
-		ray_tracer->launch_ray_generation(frame);
+		const size_t rows = std::min<size_t>(get_band_height(), get_height() - first_row);
+		ray_tracer->set_band(first_row, rows);
+
+		// render some frames since TAA effect comes after some time
+		for (size_t frame = 0; frame != 10; ++frame)
+		{
+			std::cerr << "Rendering rows " << first_row << "-" << first_row + rows - 1
+					  << ", frame " << frame << "...\r" << std::flush;
+			textures->begin_frame();
+			ray_tracer->clear_render_target();
+			ray_tracer->launch_ray_generation(frame);
+
+			// First frame finds out which textures are visible. If some of them were
+			// not decoded yet, it is rendered again so low resolution texels do not
+			// leak into TAA history
+			if (frame == 0 && textures->has_misses())
+			{
+				textures->wait_idle();
+				textures->begin_frame();
+				ray_tracer->clear_render_target();
+				ray_tracer->launch_ray_generation(frame);
+			}
+		}
+
+		if (writer)
+		{
+			writer->write_rows(*render_target, rows);
+		}
 	}
 
 	// save and show last frame
-	utils::save_resource(*render_target, settings->result_path);
+	if (writer)
+	{
+		writer->close();
+	}
+	else
+	{
+		utils::save_resource(*render_target, settings->result_path);
+	}
 }
@@ -15,13 +15,14 @@ namespace cg::renderer
 		virtual void render();
 
 	protected:
-		std::shared_ptr<cg::world::camera> camera;
-		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
-		std::shared_ptr<cg::world::model> model;
+		std::shared_ptr<cg::resource<cg::rgba32f_color>> render_target;
 
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> ray_tracer;
-		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::unsigned_color>> shadow_raytracer;
+		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::rgba32f_color>> ray_tracer;
+		std::shared_ptr<cg::renderer::raytracer<cg::vertex, cg::rgba32f_color>> shadow_raytracer;
 
 		std::vector<cg::renderer::light> lights;
+
+		std::shared_ptr<cg::world::texture_cache> textures;
+		std::shared_ptr<cg::renderer::cube_shadow_map> shadow_map;
 	};
 }// namespace cg::renderer
\ No newline at end of file
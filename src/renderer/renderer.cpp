@@ -2,6 +2,11 @@
 
 #include "utils/error_handler.h"
 
+#include <DirectXCollision.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
 #ifdef RASTERIZATION
 #include "renderer/rasterizer/rasterizer_renderer.h"
 #endif
@@ -32,6 +37,42 @@ unsigned cg::renderer::renderer::get_width()
 	return settings->width;
 }
 
+unsigned cg::renderer::renderer::get_band_height()
+{
+	if (settings->band_height == 0) {
+		return settings->height;
+	}
+	return std::min(settings->band_height, settings->height);
+}
+
+std::vector<cg::world::mesh_lod> cg::renderer::renderer::select_lods(
+		const std::vector<DirectX::XMMATRIX>& world_matrices) const
+{
+	// Pixels covered by a unit length at a unit distance from the camera
+	const float pixels_per_unit = 0.5f * static_cast<float>(settings->height) *
+								  DirectX::XMVectorGetY(camera->get_projection_matrix().r[1]);
+	DirectX::XMFLOAT3 eye;
+	DirectX::XMStoreFloat3(&eye, camera->get_position());
+
+	const auto& bounding_boxes = model->get_per_shape_bounding_boxes();
+	const auto& lods = model->get_per_shape_lods();
+	std::vector<cg::world::mesh_lod> result(lods.size());
+	for (size_t i = 0; i != lods.size(); ++i) {
+		float distance = std::numeric_limits<float>::max();
+		for (const DirectX::XMMATRIX& world : world_matrices) {
+			DirectX::BoundingBox box;
+			bounding_boxes[i].Transform(box, world);
+			const float dx = std::max(std::abs(eye.x - box.Center.x) - box.Extents.x, 0.0f);
+			const float dy = std::max(std::abs(eye.y - box.Center.y) - box.Extents.y, 0.0f);
+			const float dz = std::max(std::abs(eye.z - box.Center.z) - box.Extents.z, 0.0f);
+			distance = std::min(distance, std::sqrt(dx * dx + dy * dy + dz * dz));
+		}
+		const float max_error = settings->lod_threshold * distance / pixels_per_unit;
+		result[i] = lods[i][model->select_lod(i, max_error)];
+	}
+	return result;
+}
+
 
 std::shared_ptr<renderer> cg::renderer::make_renderer(std::shared_ptr<cg::settings> settings)
 {
@@ -14,6 +14,8 @@ namespace cg::renderer
 
 		unsigned get_height();
 		unsigned get_width();
+		// Rows rendered at once, less than height if the image is streamed to the file in bands
+		unsigned get_band_height();
 
 		virtual void init() = 0;
 		virtual void destroy() = 0;
@@ -35,6 +37,11 @@ namespace cg::renderer
 
 		std::shared_ptr<cg::world::camera> camera;
 		std::shared_ptr<cg::world::model> model;
+
+		// Every shape at the coarsest LOD whose error projects to at most lod_threshold pixels.
+		// Shapes are measured at their point nearest to the camera over all world matrices
+		std::vector<cg::world::mesh_lod> select_lods(
+				const std::vector<DirectX::XMMATRIX>& world_matrices) const;
 	};
 
 
@@ -3,9 +3,14 @@
 #include "utils/error_handler.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <linalg.h>
+#include <memory>
+#include <type_traits>
 #include <vector>
 #include "DirectXMath.h"
+#include "DirectXPackedVector.h"
 
 
 using namespace linalg::aliases;
@@ -153,6 +158,183 @@ namespace cg
 		unsigned char b;
 	};
 
+	// Render target formats with 4 channels. Texels never straddle alignment boundaries,
+	// conversion goes through a vector register instead of per channel clamps
+	struct alignas(4) rgba8_color
+	{
+		static rgba8_color from_color(const color& color)
+		{
+			return from_xmvector(DirectX::XMVectorSet(color.r, color.g, color.b, 1.0f));
+		}
+		static rgba8_color from_float3(const float3& color)
+		{
+			return from_xmvector(DirectX::XMVectorSet(color.x, color.y, color.z, 1.0f));
+		}
+		// Alpha is always opaque
+		static rgba8_color from_xmvector(const DirectX::FXMVECTOR color)
+		{
+			DirectX::PackedVector::XMUBYTEN4 packed;
+			DirectX::PackedVector::XMStoreUByteN4(&packed, DirectX::XMVectorSetW(color, 1.0f));
+			return {packed.x, packed.y, packed.z, packed.w};
+		}
+		float3 to_float3() const
+		{
+			DirectX::XMFLOAT3 result;
+			DirectX::XMStoreFloat3(&result, to_xmvector());
+			return {result.x, result.y, result.z};
+		}
+		DirectX::XMVECTOR to_xmvector() const
+		{
+			const DirectX::PackedVector::XMUBYTEN4 packed(r, g, b, a);
+			return DirectX::PackedVector::XMLoadUByteN4(&packed);
+		}
+		unsigned char r;
+		unsigned char g;
+		unsigned char b;
+		unsigned char a;
+	};
+
+	// Half precision float channels, values are not clamped until output
+	struct alignas(8) rgba16f_color
+	{
+		static rgba16f_color from_color(const color& color)
+		{
+			return from_xmvector(DirectX::XMVectorSet(color.r, color.g, color.b, 1.0f));
+		}
+		static rgba16f_color from_float3(const float3& color)
+		{
+			return from_xmvector(DirectX::XMVectorSet(color.x, color.y, color.z, 1.0f));
+		}
+		static rgba16f_color from_xmvector(const DirectX::FXMVECTOR color)
+		{
+			DirectX::PackedVector::XMHALF4 packed;
+			DirectX::PackedVector::XMStoreHalf4(&packed, DirectX::XMVectorSetW(color, 1.0f));
+			return {packed.x, packed.y, packed.z, packed.w};
+		}
+		float3 to_float3() const
+		{
+			DirectX::XMFLOAT3 result;
+			DirectX::XMStoreFloat3(&result, to_xmvector());
+			return {result.x, result.y, result.z};
+		}
+		DirectX::XMVECTOR to_xmvector() const
+		{
+			DirectX::PackedVector::XMHALF4 packed;
+			packed.x = r;
+			packed.y = g;
+			packed.z = b;
+			packed.w = a;
+			return DirectX::PackedVector::XMLoadHalf4(&packed);
+		}
+		DirectX::PackedVector::HALF r;
+		DirectX::PackedVector::HALF g;
+		DirectX::PackedVector::HALF b;
+		DirectX::PackedVector::HALF a;
+	};
+
+	// Full precision float channels, loaded and stored with aligned vector operations
+	struct alignas(16) rgba32f_color
+	{
+		static rgba32f_color from_color(const color& color)
+		{
+			return from_xmvector(DirectX::XMVectorSet(color.r, color.g, color.b, 1.0f));
+		}
+		static rgba32f_color from_float3(const float3& color)
+		{
+			return from_xmvector(DirectX::XMVectorSet(color.x, color.y, color.z, 1.0f));
+		}
+		static rgba32f_color from_xmvector(const DirectX::FXMVECTOR color)
+		{
+			rgba32f_color result;
+			DirectX::XMStoreFloat4A(&result.value, DirectX::XMVectorSetW(color, 1.0f));
+			return result;
+		}
+		float3 to_float3() const
+		{
+			return {value.x, value.y, value.z};
+		}
+		DirectX::XMVECTOR to_xmvector() const
+		{
+			return DirectX::XMLoadFloat4A(&value);
+		}
+		DirectX::XMFLOAT4A value;
+	};
+
+	// Render target formats holding color, others like G-buffer texels have no color conversions
+	template<typename T>
+	constexpr bool is_color_format = std::is_same_v<T, unsigned_color> || std::is_same_v<T, rgba8_color> ||
+									 std::is_same_v<T, rgba16f_color> || std::is_same_v<T, rgba32f_color>;
+
+	// Depth buffer formats. NDC depth in [0, 1] is encoded on write and compared after decoding.
+	// Reversed-Z formats expect projection with swapped near and far planes: far plane is at 0
+	// and larger values are closer, this spreads float precision evenly over the distance
+	struct depth16_unorm
+	{
+		static constexpr bool reversed_z = false;
+		static constexpr float far_depth = 1.0f;
+
+		static depth16_unorm from_depth(float depth)
+		{
+			return {static_cast<uint16_t>(std::clamp(depth, 0.0f, 1.0f) * 65535.0f + 0.5f)};
+		}
+		float to_depth() const
+		{
+			return static_cast<float>(value) / 65535.0f;
+		}
+		uint16_t value;
+	};
+
+	// 24 bits unsigned normalized depth without padding
+	struct depth24_unorm
+	{
+		static constexpr bool reversed_z = false;
+		static constexpr float far_depth = 1.0f;
+
+		static depth24_unorm from_depth(float depth)
+		{
+			const uint32_t value = static_cast<uint32_t>(std::clamp(depth, 0.0f, 1.0f) * 16777215.0f + 0.5f);
+			return {{static_cast<unsigned char>(value), static_cast<unsigned char>(value >> 8),
+					 static_cast<unsigned char>(value >> 16)}};
+		}
+		float to_depth() const
+		{
+			return static_cast<float>(bytes[0] | bytes[1] << 8 | bytes[2] << 16) / 16777215.0f;
+		}
+		unsigned char bytes[3];
+	};
+
+	struct depth32f
+	{
+		static constexpr bool reversed_z = false;
+		static constexpr float far_depth = 1.0f;
+
+		static depth32f from_depth(float depth)
+		{
+			return {depth};
+		}
+		float to_depth() const
+		{
+			return value;
+		}
+		float value;
+	};
+
+	struct depth32f_reversed
+	{
+		static constexpr bool reversed_z = true;
+		static constexpr float far_depth = 0.0f;
+
+		static depth32f_reversed from_depth(float depth)
+		{
+			return {depth};
+		}
+		float to_depth() const
+		{
+			return value;
+		}
+		float value;
+	};
+
 	struct d3d_vertex
 	{
 		DirectX::XMFLOAT4 position;
@@ -163,19 +345,33 @@ namespace cg
 		DirectX::XMFLOAT3 bary;
 	};
 
-	struct vertex
+	// Flags of vertex attributes, used to interpolate only attributes a shader reads
+	namespace vertex_attribute
 	{
-		DirectX::XMFLOAT3 position;
-		DirectX::XMFLOAT3 normal;
+		enum : unsigned int
+		{
+			none = 0,
+			position = 1 << 0,
+			normal = 1 << 1,
+			uv = 1 << 2,
+			all = ~0u
+		};
+	}// namespace vertex_attribute
 
+	// Surface parameters stored once per material, faces refer to them by material id
+	struct material
+	{
 		DirectX::XMFLOAT3 ambient;
 		DirectX::XMFLOAT3 diffuse;
 		DirectX::XMFLOAT3 specular;
-
 		DirectX::XMFLOAT3 emissive;
-		
 		float shininess;
+	};
 
+	struct vertex
+	{
+		DirectX::XMFLOAT3 position;
+		DirectX::XMFLOAT3 normal;
 		DirectX::XMFLOAT2 uv;
 
 		vertex operator+(const vertex& other) const
@@ -189,20 +385,6 @@ namespace cg
 			converter = XMVectorAdd(XMLoadFloat3(&normal), XMLoadFloat3(&other.normal));
 			XMStoreFloat3(&result.normal, converter);
 
-			converter = XMVectorAdd(XMLoadFloat3(&ambient), XMLoadFloat3(&other.ambient));
-			XMStoreFloat3(&result.ambient, converter);
-
-			converter = XMVectorAdd(XMLoadFloat3(&diffuse), XMLoadFloat3(&other.diffuse));
-			XMStoreFloat3(&result.diffuse, converter);
-
-			converter = XMVectorAdd(XMLoadFloat3(&specular), XMLoadFloat3(&other.specular));
-			XMStoreFloat3(&result.specular, converter);
-
-			converter = XMVectorAdd(XMLoadFloat3(&emissive), XMLoadFloat3(&other.emissive));
-			XMStoreFloat3(&result.emissive, converter);
-
-			result.shininess = shininess + other.shininess;
-
 			converter = XMVectorAdd(XMLoadFloat2(&uv), XMLoadFloat2(&other.uv));
 			XMStoreFloat2(&result.uv, converter);
 
@@ -220,25 +402,129 @@ namespace cg
 			converter = XMVectorScale(XMLoadFloat3(&normal), value);
 			XMStoreFloat3(&result.normal, converter);
 
-			converter = XMVectorScale(XMLoadFloat3(&ambient), value);
-			XMStoreFloat3(&result.ambient, converter);
+			converter = XMVectorScale(XMLoadFloat2(&uv), value);
+			XMStoreFloat2(&result.uv, converter);
 
-			converter = XMVectorScale(XMLoadFloat3(&diffuse), value);
-			XMStoreFloat3(&result.diffuse, converter);
+			return result;
+		}
 
-			converter = XMVectorScale(XMLoadFloat3(&specular), value);
-			XMStoreFloat3(&result.specular, converter);
+		// Weighted sum of three vertices, skips attributes which are not in the mask
+		static vertex interpolate(const vertex& a, const vertex& b, const vertex& c,
+								  const float u, const float v, const float w,
+								  const unsigned int attributes)
+		{
+			using namespace DirectX;
 
-			converter = XMVectorScale(XMLoadFloat3(&emissive), value);
-			XMStoreFloat3(&result.emissive, converter);
+			auto interpolate3 = [u, v, w](const XMFLOAT3& a, const XMFLOAT3& b, const XMFLOAT3& c) {
+				XMFLOAT3 result;
+				XMVECTOR converter = XMVectorScale(XMLoadFloat3(&a), u);
+				converter = XMVectorMultiplyAdd(XMLoadFloat3(&b), XMVectorReplicate(v), converter);
+				converter = XMVectorMultiplyAdd(XMLoadFloat3(&c), XMVectorReplicate(w), converter);
+				XMStoreFloat3(&result, converter);
+				return result;
+			};
 
-			result.shininess = shininess * value;
+			vertex result{};
+			if (attributes & vertex_attribute::position) result.position = interpolate3(a.position, b.position, c.position);
+			if (attributes & vertex_attribute::normal) result.normal = interpolate3(a.normal, b.normal, c.normal);
+			if (attributes & vertex_attribute::uv) {
+				result.uv = XMFLOAT2(a.uv.x * u + b.uv.x * v + c.uv.x * w,
+									 a.uv.y * u + b.uv.y * v + c.uv.y * w);
+			}
+			return result;
+		}
+	};
+	// Material data moved to the per-face table, what is left is 32 bytes of full precision attributes
+	static_assert(sizeof(vertex) == 32, "Vertex has to keep position, normal and texture coordinates only");
 
-			converter = XMVectorScale(XMLoadFloat2(&uv), value);
-			XMStoreFloat2(&result.uv, converter);
+	// Attributes of vertices in separate arrays, a pass fetches only the attributes it reads.
+	// Passes using positions only, like depth-only draws and ray intersection, get a 12 byte stride
+	struct vertex_streams
+	{
+		std::shared_ptr<resource<DirectX::XMFLOAT3>> positions;
+		std::shared_ptr<resource<DirectX::XMFLOAT3>> normals;
+		std::shared_ptr<resource<DirectX::XMFLOAT2>> uvs;
+
+		vertex gather(size_t index) const
+		{
+			return {positions->item(index), normals->item(index), uvs->item(index)};
+		}
+	};
+
+	// Box compact vertex positions are quantized in, usually the bounds of a shape:
+	// position = offset + scale * stored value in [0, 1]
+	struct vertex_quantization
+	{
+		DirectX::XMFLOAT3 offset;
+		DirectX::XMFLOAT3 scale;
+	};
+
+	// Vertex with quantized attributes, half the size of vertex. Position is 16 bit unorm in the quantization box,
+	// normal is octahedral encoded into two 16 bit snorm values, texture coordinates are half floats
+	struct compact_vertex
+	{
+		DirectX::PackedVector::XMUSHORTN4 position;// w is padding
+		DirectX::PackedVector::XMSHORTN2 normal;
+		DirectX::PackedVector::XMHALF2 uv;
+
+		static compact_vertex encode(const vertex& data, const vertex_quantization& quantization)
+		{
+			using namespace DirectX;
+
+			// Flat boxes have zero scale along an axis, every position is at the offset there
+			auto unit = [](float value, float offset, float scale) {
+				return scale > 0.0f ? (value - offset) / scale : 0.0f;
+			};
+			compact_vertex result;
+			PackedVector::XMStoreUShortN4(&result.position, XMVectorSet(
+					unit(data.position.x, quantization.offset.x, quantization.scale.x),
+					unit(data.position.y, quantization.offset.y, quantization.scale.y),
+					unit(data.position.z, quantization.offset.z, quantization.scale.z), 0.0f));
+
+			// Unit sphere is projected onto the octahedron |x| + |y| + |z| = 1,
+			// its lower half is folded over the diagonals of the upper one
+			const XMFLOAT3& n = data.normal;
+			const float length = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+			float x = length > 0.0f ? n.x / length : 0.0f;
+			float y = length > 0.0f ? n.y / length : 0.0f;
+			if (n.z < 0.0f) {
+				const float folded_x = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+				y = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+				x = folded_x;
+			}
+			PackedVector::XMStoreShortN2(&result.normal, XMVectorSet(x, y, 0.0f, 0.0f));
+
+			PackedVector::XMStoreHalf2(&result.uv, XMLoadFloat2(&data.uv));
+			return result;
+		}
+
+		// W is zero
+		DirectX::XMVECTOR decode_position(const vertex_quantization& quantization) const
+		{
+			using namespace DirectX;
+			return XMVectorMultiplyAdd(PackedVector::XMLoadUShortN4(&position), XMLoadFloat3(&quantization.scale),
+									   XMLoadFloat3(&quantization.offset));
+		}
+
+		vertex decode(const vertex_quantization& quantization) const
+		{
+			using namespace DirectX;
+
+			vertex result;
+			XMStoreFloat3(&result.position, decode_position(quantization));
+
+			XMFLOAT2 folded;
+			XMStoreFloat2(&folded, PackedVector::XMLoadShortN2(&normal));
+			const float z = 1.0f - std::abs(folded.x) - std::abs(folded.y);
+			const float unfold = std::max(-z, 0.0f);
+			const float x = folded.x >= 0.0f ? folded.x - unfold : folded.x + unfold;
+			const float y = folded.y >= 0.0f ? folded.y - unfold : folded.y + unfold;
+			XMStoreFloat3(&result.normal, XMVector3Normalize(XMVectorSet(x, y, z, 0.0f)));
 
+			XMStoreFloat2(&result.uv, PackedVector::XMLoadHalf2(&uv));
 			return result;
 		}
 	};
+	static_assert(sizeof(compact_vertex) == 16, "Compact vertex has to be half the size of vertex");
 
 }// namespace cg
\ No newline at end of file
@@ -22,9 +22,24 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	add_options("camera_angle_of_view", "Camera angle of view", cxxopts::value<float>()->default_value("50.0"));
 	add_options("camera_z_near", "Minimum expected depth", cxxopts::value<float>()->default_value("0.001"));
 	add_options("camera_z_far", "Maximum expected depth", cxxopts::value<float>()->default_value("100.0"));
+	add_options("cull_mode", "Faces to cull in rasterizer: none, front or back. Front faces have counter-clockwise winding on the screen", cxxopts::value<std::string>()->default_value("none"));
+	add_options("rasterization_mode", "Rasterizer shading: forward, prepass or deferred", cxxopts::value<std::string>()->default_value("forward"));
+	add_options("msaa", "Number of MSAA samples per pixel in rasterizer: 1, 4 or 8", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("texture_cache_budget_mb", "Memory budget for decoded textures in megabytes", cxxopts::value<unsigned>()->default_value("512"));
+	add_options("texture_format", "Storage format of textures: rgba8, bc1, bc3 or bc7", cxxopts::value<std::string>()->default_value("rgba8"));
+	add_options("occlusion_culling", "Skip shapes hidden behind large occluders in rasterizer", cxxopts::value<bool>()->default_value("true"));
+	add_options("instances", "Number of model copies drawn in a row by rasterizer", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("band_height", "Rows rendered at once, bands are streamed to result_path. 0 renders the whole image at once", cxxopts::value<unsigned>()->default_value("0"));
+	add_options("lod_threshold", "Largest screen space error of simplified meshes in pixels, 0 keeps full detail", cxxopts::value<float>()->default_value("1.0"));
+	add_options("light_position", "Position of point light shared by rasterizer and ray tracer", cxxopts::value<std::vector<float>>()->default_value("0.0,1.925,0.0"));
+	add_options("shadow_map_size", "Resolution of shadow maps, 0 disables shadows. Rasterizer draws shadows in deferred mode only", cxxopts::value<unsigned>()->default_value("1024"));
+	add_options("shadow_cascades", "Number of cascades in shadow map of directional light", cxxopts::value<unsigned>()->default_value("4"));
+	add_options("sun_direction", "Direction of directional light in deferred rasterization, zero vector for no light", cxxopts::value<std::vector<float>>()->default_value("0.0,0.0,0.0"));
+	add_options("compact_vertices", "Keep vertices quantized to 16 bytes: 16 bit positions in shape bounds, octahedral normals and half float texture coordinates", cxxopts::value<bool>()->default_value("false"));
 	add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
 	add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("raytracing_shadow_maps", "Look up point light shadows in a cube shadow map instead of tracing shadow rays", cxxopts::value<bool>()->default_value("false"));
 	add_options("h,help", "Print usage");
 
 	auto result = options.parse(argc, argv);
@@ -43,9 +58,39 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	settings->camera_angle_of_view = result["camera_angle_of_view"].as<float>();
 	settings->camera_z_near = result["camera_z_near"].as<float>();
 	settings->camera_z_far = result["camera_z_far"].as<float>();
+	settings->cull_mode = result["cull_mode"].as<std::string>();
+	settings->rasterization_mode = result["rasterization_mode"].as<std::string>();
+	settings->msaa = result["msaa"].as<unsigned>();
+	settings->texture_cache_budget_mb = result["texture_cache_budget_mb"].as<unsigned>();
+	settings->texture_format = result["texture_format"].as<std::string>();
+	settings->occlusion_culling = result["occlusion_culling"].as<bool>();
+	settings->instances = result["instances"].as<unsigned>();
+	settings->band_height = result["band_height"].as<unsigned>();
+	settings->lod_threshold = result["lod_threshold"].as<float>();
+	settings->light_position = result["light_position"].as<std::vector<float>>();
+	settings->shadow_map_size = result["shadow_map_size"].as<unsigned>();
+	settings->shadow_cascades = result["shadow_cascades"].as<unsigned>();
+	settings->sun_direction = result["sun_direction"].as<std::vector<float>>();
+	settings->compact_vertices = result["compact_vertices"].as<bool>();
 	settings->result_path = result["result_path"].as<std::filesystem::path>();
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+	settings->raytracing_shadow_maps = result["raytracing_shadow_maps"].as<bool>();
+
+	if (settings->light_position.size() != 3)
+	{
+		THROW_ERROR("Light position has to have 3 components");
+	}
+
+#ifdef RASTERIZATION
+	// Only deferred shading lights the scene, forward and prepass modes would silently drop the shadows
+	if (settings->rasterization_mode != "deferred" &&
+		((result.count("shadow_map_size") && settings->shadow_map_size != 0) ||
+		 result.count("shadow_cascades") || result.count("sun_direction")))
+	{
+		THROW_ERROR("Shadow maps and sun light are supported in deferred rasterization mode only");
+	}
+#endif
 
 	return settings;
 }
@@ -23,10 +23,26 @@ namespace cg
 		float camera_z_near;
 		float camera_z_far;
 
+		std::string cull_mode;
+		std::string rasterization_mode;
+		unsigned msaa;
+		unsigned texture_cache_budget_mb;
+		std::string texture_format;
+		bool occlusion_culling;
+		unsigned instances;
+		unsigned band_height;
+		float lod_threshold;
+		std::vector<float> light_position;
+		unsigned shadow_map_size;
+		unsigned shadow_cascades;
+		std::vector<float> sun_direction;
+		bool compact_vertices;
+
 		std::filesystem::path result_path;
 
 		unsigned raytracing_depth;
 		unsigned accumulation_num;
+		bool raytracing_shadow_maps;
 	};
 
 }// namespace cg
\ No newline at end of file
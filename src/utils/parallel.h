@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace cg::utils
+{
+	// Worker threads started on first use and kept until exit. A job is split into chunks
+	// the workers claim one by one. The calling thread claims chunks of its job too,
+	// so jobs started from inside other jobs don't wait for busy workers
+	class thread_pool
+	{
+	public:
+		static thread_pool& get()
+		{
+			static thread_pool pool;
+			return pool;
+		}
+
+		~thread_pool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			queue_condition.notify_all();
+			for (std::thread& worker : workers) {
+				worker.join();
+			}
+		}
+
+		// Workers and the calling thread
+		size_t get_num_threads() const
+		{
+			return workers.size() + 1;
+		}
+
+		// Calls function once for every chunk in [0, num_chunks) and returns when all of them are done
+		void run(size_t num_chunks, const std::function<void(size_t)>& function)
+		{
+			const auto current = std::make_shared<job>(function, num_chunks);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				queue.push_back(current);
+			}
+			queue_condition.notify_all();
+
+			work(*current);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			done_condition.wait(lock, [&]() { return current->num_done.load() == num_chunks; });
+		}
+
+	private:
+		struct job
+		{
+			job(const std::function<void(size_t)>& in_function, size_t in_num_chunks)
+				: function(in_function), num_chunks(in_num_chunks)
+			{
+			}
+
+			const std::function<void(size_t)>& function;
+			const size_t num_chunks;
+			std::atomic<size_t> next_chunk{0};
+			std::atomic<size_t> num_done{0};
+		};
+
+		std::mutex mutex;
+		std::condition_variable queue_condition;
+		std::condition_variable done_condition;
+		// Jobs with chunks left to claim
+		std::deque<std::shared_ptr<job>> queue;
+		bool stopping = false;
+		std::vector<std::thread> workers;
+
+		thread_pool()
+		{
+			const size_t num_workers = std::max(1u, std::thread::hardware_concurrency()) - 1;
+			for (size_t i = 0; i != num_workers; ++i) {
+				workers.emplace_back(&thread_pool::worker_loop, this);
+			}
+		}
+
+		// Claims chunks until none are left, the job is then removed from the queue
+		void work(job& current)
+		{
+			for (size_t chunk = current.next_chunk++; chunk < current.num_chunks; chunk = current.next_chunk++) {
+				current.function(chunk);
+				if (++current.num_done == current.num_chunks) {
+					std::lock_guard<std::mutex> lock(mutex);
+					done_condition.notify_all();
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.erase(std::remove_if(queue.begin(), queue.end(),
+									   [&](const std::shared_ptr<job>& queued) { return queued.get() == &current; }),
+						queue.end());
+		}
+
+		void worker_loop()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (true) {
+				queue_condition.wait(lock, [&]() { return stopping || !queue.empty(); });
+				if (stopping) {
+					return;
+				}
+				// Keeps the job alive after its caller returned, chunks may be claimed after it is done
+				const std::shared_ptr<job> current = queue.front();
+				lock.unlock();
+				work(*current);
+				lock.lock();
+			}
+		}
+	};
+
+	// Splits [begin, end) range into contiguous chunks and processes them
+	// on the thread pool. Function is called once per item
+	template<typename F>
+	inline void parallel_for(size_t begin, size_t end, const F& function)
+	{
+		if (end <= begin) {
+			return;
+		}
+
+		// A few chunks per thread balance uneven items
+		const size_t num_items = end - begin;
+		thread_pool& pool = thread_pool::get();
+		const size_t num_chunks = std::min(4 * pool.get_num_threads(), num_items);
+		if (pool.get_num_threads() == 1 || num_chunks == 1) {
+			for (size_t i = begin; i != end; ++i) {
+				function(i);
+			}
+			return;
+		}
+
+		const size_t chunk_size = (num_items + num_chunks - 1) / num_chunks;
+		pool.run((num_items + chunk_size - 1) / chunk_size, [&](size_t chunk) {
+			const size_t chunk_begin = begin + chunk * chunk_size;
+			const size_t chunk_end = std::min(chunk_begin + chunk_size, end);
+			for (size_t i = chunk_begin; i != chunk_end; ++i) {
+				function(i);
+			}
+		});
+	}
+}// namespace cg::utils
@@ -0,0 +1,340 @@
+#include "png_stream.h"
+
+#include "utils/error_handler.h"
+#include "utils/parallel.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+
+
+using namespace cg::utils;
+
+namespace
+{
+	constexpr size_t window_size = 32768;
+	constexpr size_t min_match = 3;
+	constexpr size_t max_match = 258;
+	constexpr size_t max_chain = 32;
+	constexpr size_t hash_bits = 15;
+
+	constexpr unsigned int length_base[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+											35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	constexpr unsigned int length_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+											 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	constexpr unsigned int distance_base[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+											  193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+											  6145, 8193, 12289, 16385, 24577};
+	constexpr unsigned int distance_extra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+											   6, 7, 7, 8, 8, 9, 9, 10, 10, 11,
+											   11, 12, 12, 13, 13};
+
+	uint32_t crc32(uint32_t crc, const unsigned char* data, size_t size)
+	{
+		static const std::array<uint32_t, 256> table = [] {
+			std::array<uint32_t, 256> result{};
+			for (uint32_t i = 0; i != 256; ++i) {
+				uint32_t value = i;
+				for (int bit = 0; bit != 8; ++bit) {
+					value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+				}
+				result[i] = value;
+			}
+			return result;
+		}();
+
+		crc = ~crc;
+		for (size_t i = 0; i != size; ++i) {
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		}
+		return ~crc;
+	}
+
+	void append_big_endian(std::vector<unsigned char>& data, uint32_t value)
+	{
+		data.push_back(static_cast<unsigned char>(value >> 24));
+		data.push_back(static_cast<unsigned char>(value >> 16));
+		data.push_back(static_cast<unsigned char>(value >> 8));
+		data.push_back(static_cast<unsigned char>(value));
+	}
+
+	unsigned char paeth(int a, int b, int c)
+	{
+		const int p = a + b - c;
+		const int pa = std::abs(p - a);
+		const int pb = std::abs(p - b);
+		const int pc = std::abs(p - c);
+		if (pa <= pb && pa <= pc) {
+			return static_cast<unsigned char>(a);
+		}
+		return static_cast<unsigned char>(pb <= pc ? b : c);
+	}
+}// namespace
+
+cg::utils::png_stream_writer::png_stream_writer(const std::filesystem::path& filepath, size_t in_width, size_t in_height)
+	: file(filepath, std::ios::binary), width(in_width), height(in_height), previous_row(in_width * 4, 0)
+{
+	if (!file) {
+		THROW_ERROR("Can't open " + filepath.string() + " for writing");
+	}
+
+	const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	file.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+	// 8 bits per channel RGBA, no interlacing
+	std::vector<unsigned char> header;
+	append_big_endian(header, static_cast<uint32_t>(width));
+	append_big_endian(header, static_cast<uint32_t>(height));
+	header.insert(header.end(), {8, 6, 0, 0, 0});
+	write_chunk("IHDR", header.data(), header.size());
+
+	// Zlib header: deflate with 32 KiB window, no dictionary
+	output = {0x78, 0x01};
+}
+
+void cg::utils::png_stream_writer::write_rows(cg::resource<cg::rgba8_color>& render_target, size_t num_rows)
+{
+	if (render_target.get_stride() != width) {
+		THROW_ERROR("Render target width doesn't match the image");
+	}
+	write_rows(reinterpret_cast<const unsigned char*>(render_target.get_data()), num_rows);
+}
+
+void cg::utils::png_stream_writer::write_rows(cg::resource<cg::rgba32f_color>& render_target, size_t num_rows)
+{
+	if (render_target.get_stride() != width) {
+		THROW_ERROR("Render target width doesn't match the image");
+	}
+	std::vector<cg::rgba8_color> rows(width * num_rows);
+	cg::utils::parallel_for(0, num_rows, [&](size_t y) {
+		for (size_t x = 0; x != width; ++x) {
+			rows[y * width + x] = cg::rgba8_color::from_xmvector(render_target.item(x, y).to_xmvector());
+		}
+	});
+	write_rows(reinterpret_cast<const unsigned char*>(rows.data()), num_rows);
+}
+
+void cg::utils::png_stream_writer::write_rows(const unsigned char* rgba, size_t num_rows)
+{
+	if (rows_written + num_rows > height) {
+		THROW_ERROR("Too many rows written to the image");
+	}
+
+	std::vector<unsigned char> filtered;
+	filtered.reserve(num_rows * (width * 4 + 1));
+	for (size_t y = 0; y != num_rows; ++y) {
+		filter_row(rgba + y * width * 4, filtered);
+	}
+	compress(filtered, false);
+	write_chunk("IDAT", output.data(), output.size());
+	output.clear();
+	rows_written += num_rows;
+}
+
+void cg::utils::png_stream_writer::close()
+{
+	if (rows_written != height) {
+		THROW_ERROR("Image is closed before all rows are written");
+	}
+
+	// Empty final block, then the stream is padded to a byte and ends with Adler-32 checksum
+	compress({}, true);
+	put_bits(0, (8 - bit_count % 8) % 8);
+	append_big_endian(output, (adler_b << 16) | adler_a);
+	write_chunk("IDAT", output.data(), output.size());
+	output.clear();
+	write_chunk("IEND", nullptr, 0);
+
+	file.close();
+	if (!file) {
+		THROW_ERROR("Can't save the resource");
+	}
+}
+
+void cg::utils::png_stream_writer::filter_row(const unsigned char* row, std::vector<unsigned char>& result)
+{
+	// Filter with the smallest sum of absolute differences usually compresses best
+	constexpr size_t bpp = 4;
+	const size_t row_size = width * 4;
+	std::vector<unsigned char> candidate(row_size);
+	std::vector<unsigned char> best;
+	unsigned char best_filter = 0;
+	size_t best_sum = SIZE_MAX;
+	for (unsigned char filter = 0; filter != 5; ++filter) {
+		size_t sum = 0;
+		for (size_t i = 0; i != row_size; ++i) {
+			const int left = i >= bpp ? row[i - bpp] : 0;
+			const int up = previous_row[i];
+			const int up_left = i >= bpp ? previous_row[i - bpp] : 0;
+			int prediction = 0;
+			switch (filter) {
+				case 1:
+					prediction = left;
+					break;
+				case 2:
+					prediction = up;
+					break;
+				case 3:
+					prediction = (left + up) / 2;
+					break;
+				case 4:
+					prediction = paeth(left, up, up_left);
+					break;
+				default:
+					break;
+			}
+			candidate[i] = static_cast<unsigned char>(row[i] - prediction);
+			sum += static_cast<size_t>(std::abs(static_cast<signed char>(candidate[i])));
+		}
+		if (sum < best_sum) {
+			best_sum = sum;
+			best_filter = filter;
+			best.swap(candidate);
+			candidate.resize(row_size);
+		}
+	}
+
+	result.push_back(best_filter);
+	result.insert(result.end(), best.begin(), best.end());
+	std::copy(row, row + row_size, previous_row.begin());
+}
+
+void cg::utils::png_stream_writer::compress(const std::vector<unsigned char>& data, bool final_block)
+{
+	put_bits(final_block ? 1 : 0, 1);
+	put_bits(1, 2);
+
+	// Hash chains over the window and the new data, matches start only in the new data
+	std::vector<unsigned char> buffer(window);
+	buffer.insert(buffer.end(), data.begin(), data.end());
+	const size_t size = buffer.size();
+	std::vector<int64_t> head(size_t(1) << hash_bits, -1);
+	std::vector<int64_t> previous(size, -1);
+	auto hash = [&](size_t i) {
+		return ((size_t(buffer[i]) << 10) ^ (size_t(buffer[i + 1]) << 5) ^ buffer[i + 2]) & ((size_t(1) << hash_bits) - 1);
+	};
+	auto insert = [&](size_t i) {
+		if (i + min_match <= size) {
+			const size_t h = hash(i);
+			previous[i] = head[h];
+			head[h] = static_cast<int64_t>(i);
+		}
+	};
+	for (size_t i = 0; i != window.size(); ++i) {
+		insert(i);
+	}
+
+	size_t i = window.size();
+	while (i < size) {
+		size_t best_length = 0;
+		size_t best_distance = 0;
+		if (i + min_match <= size) {
+			const size_t limit = std::min(max_match, size - i);
+			int64_t candidate = head[hash(i)];
+			for (size_t chain = 0; candidate >= 0 && i - candidate <= window_size && chain != max_chain; ++chain) {
+				size_t length = 0;
+				while (length != limit && buffer[candidate + length] == buffer[i + length]) {
+					++length;
+				}
+				if (length > best_length) {
+					best_length = length;
+					best_distance = i - candidate;
+					if (length == limit) {
+						break;
+					}
+				}
+				candidate = previous[candidate];
+			}
+		}
+
+		if (best_length >= min_match) {
+			put_match(best_length, best_distance);
+			for (size_t k = 0; k != best_length; ++k) {
+				insert(i + k);
+			}
+			i += best_length;
+		}
+		else {
+			put_symbol(buffer[i]);
+			insert(i);
+			++i;
+		}
+	}
+	// End of block
+	put_symbol(256);
+
+	for (unsigned char value : data) {
+		adler_a = (adler_a + value) % 65521;
+		adler_b = (adler_b + adler_a) % 65521;
+	}
+	window.assign(buffer.end() - std::min(size, window_size), buffer.end());
+}
+
+void cg::utils::png_stream_writer::put_bits(uint32_t value, unsigned int count)
+{
+	// Deflate packs values starting from the least significant bit
+	bit_buffer |= uint64_t(value) << bit_count;
+	bit_count += count;
+	while (bit_count >= 8) {
+		output.push_back(static_cast<unsigned char>(bit_buffer));
+		bit_buffer >>= 8;
+		bit_count -= 8;
+	}
+}
+
+void cg::utils::png_stream_writer::put_code(uint32_t code, unsigned int length)
+{
+	// Huffman codes are packed starting from the most significant bit
+	uint32_t reversed = 0;
+	for (unsigned int bit = 0; bit != length; ++bit) {
+		reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+	}
+	put_bits(reversed, length);
+}
+
+void cg::utils::png_stream_writer::put_symbol(unsigned int symbol)
+{
+	// Fixed literal/length code of RFC 1951
+	if (symbol < 144) {
+		put_code(0x30 + symbol, 8);
+	}
+	else if (symbol < 256) {
+		put_code(0x190 + symbol - 144, 9);
+	}
+	else if (symbol < 280) {
+		put_code(symbol - 256, 7);
+	}
+	else {
+		put_code(0xC0 + symbol - 280, 8);
+	}
+}
+
+void cg::utils::png_stream_writer::put_match(size_t length, size_t distance)
+{
+	size_t length_code = std::size(length_base) - 1;
+	while (length_base[length_code] > length) {
+		--length_code;
+	}
+	put_symbol(257 + static_cast<unsigned int>(length_code));
+	put_bits(static_cast<uint32_t>(length - length_base[length_code]), length_extra[length_code]);
+
+	size_t distance_code = std::size(distance_base) - 1;
+	while (distance_base[distance_code] > distance) {
+		--distance_code;
+	}
+	put_code(static_cast<uint32_t>(distance_code), 5);
+	put_bits(static_cast<uint32_t>(distance - distance_base[distance_code]), distance_extra[distance_code]);
+}
+
+void cg::utils::png_stream_writer::write_chunk(const char* type, const unsigned char* data, size_t size)
+{
+	std::vector<unsigned char> chunk;
+	chunk.reserve(size + 12);
+	append_big_endian(chunk, static_cast<uint32_t>(size));
+	chunk.insert(chunk.end(), type, type + 4);
+	if (size != 0) {
+		chunk.insert(chunk.end(), data, data + size);
+	}
+	append_big_endian(chunk, crc32(0, chunk.data() + 4, size + 4));
+	file.write(reinterpret_cast<const char*>(chunk.data()), static_cast<std::streamsize>(chunk.size()));
+}
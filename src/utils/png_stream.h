@@ -0,0 +1,56 @@
+#pragma once
+
+#include "resource.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+
+namespace cg::utils
+{
+	// Writes RGBA8 PNG image band by band. Every band is filtered, compressed and written
+	// when it arrives, only the band itself and the 32 KiB deflate window are kept in memory
+	class png_stream_writer
+	{
+	public:
+		png_stream_writer(const std::filesystem::path& filepath, size_t in_width, size_t in_height);
+
+		// Appends first num_rows rows of the render target to the image
+		void write_rows(cg::resource<cg::rgba8_color>& render_target, size_t num_rows);
+		// Float formats are converted to 8 bits per channel
+		void write_rows(cg::resource<cg::rgba32f_color>& render_target, size_t num_rows);
+		// Rows of width RGBA8 texels
+		void write_rows(const unsigned char* rgba, size_t num_rows);
+
+		// Finishes the file, all rows have to be written by then
+		void close();
+
+	protected:
+		std::ofstream file;
+		size_t width;
+		size_t height;
+		size_t rows_written = 0;
+
+		std::vector<unsigned char> previous_row;
+		// Tail of already compressed data, matches of the next band may reference it
+		std::vector<unsigned char> window;
+		uint32_t adler_a = 1;
+		uint32_t adler_b = 0;
+
+		// Compressed bits not yet written to a chunk
+		std::vector<unsigned char> output;
+		uint64_t bit_buffer = 0;
+		unsigned int bit_count = 0;
+
+		void filter_row(const unsigned char* row, std::vector<unsigned char>& result);
+		// Deflate block with fixed Huffman codes, the stream is finished with the final one
+		void compress(const std::vector<unsigned char>& data, bool final_block);
+		void put_bits(uint32_t value, unsigned int count);
+		void put_code(uint32_t code, unsigned int length);
+		void put_symbol(unsigned int symbol);
+		void put_match(size_t length, size_t distance);
+		void write_chunk(const char* type, const unsigned char* data, size_t size);
+	};
+}// namespace cg::utils
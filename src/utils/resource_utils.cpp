@@ -1,30 +1,95 @@
 //#define STBI_MSC_SECURE_CRT
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
 
 #include "resource_utils.h"
 
 #include "utils/error_handler.h"
+#include "utils/parallel.h"
 
+#include <stb_image.h>
 #include <stb_image_write.h>
 
 
 using namespace cg::utils;
 
+namespace
+{
+	void write_png(const std::filesystem::path& filepath, int width, int height, int components, const void* data)
+	{
+		int result = stbi_write_png(
+				filepath.string().c_str(), width, height, components, data,
+				width * components);
+
+		if (result != 1)
+			THROW_ERROR("Can't save the resource");
+
+		std::string view_command("start ");
+		view_command.append(filepath.string());
+
+		std::system(view_command.c_str());
+	}
+
+	// Float render targets are clamped and packed to 8 bits in a single pass at output time
+	template<typename T>
+	std::vector<cg::rgba8_color> pack_to_rgba8(cg::resource<T>& render_target)
+	{
+		const size_t width = render_target.get_stride();
+		const size_t height = render_target.get_number_of_elements() / width;
+
+		std::vector<cg::rgba8_color> result(width * height);
+		cg::utils::parallel_for(0, height, [&](size_t y) {
+			for (size_t x = 0; x != width; ++x) {
+				result[y * width + x] = cg::rgba8_color::from_xmvector(render_target.item(x, y).to_xmvector());
+			}
+		});
+		return result;
+	}
+}// namespace
+
 void cg::utils::save_resource(
 		cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath)
 {
 	int width = static_cast<int>(render_target.get_stride());
 	int height = static_cast<int>(render_target.get_number_of_elements()) / width;
 
-	int result = stbi_write_png(
-			filepath.string().c_str(), width, height, 3, render_target.get_data(),
-			width * sizeof(cg::unsigned_color));
+	write_png(filepath, width, height, 3, render_target.get_data());
+}
+
+void cg::utils::save_resource(cg::resource<cg::rgba8_color>& render_target, std::filesystem::path filepath)
+{
+	int width = static_cast<int>(render_target.get_stride());
+	int height = static_cast<int>(render_target.get_number_of_elements()) / width;
+
+	write_png(filepath, width, height, 4, render_target.get_data());
+}
 
-	if (result != 1)
-		THROW_ERROR("Can't save the resource");
+void cg::utils::save_resource(cg::resource<cg::rgba16f_color>& render_target, std::filesystem::path filepath)
+{
+	int width = static_cast<int>(render_target.get_stride());
+	int height = static_cast<int>(render_target.get_number_of_elements()) / width;
 
-	std::string view_command("start ");
-	view_command.append(filepath.string());
+	write_png(filepath, width, height, 4, pack_to_rgba8(render_target).data());
+}
+
+void cg::utils::save_resource(cg::resource<cg::rgba32f_color>& render_target, std::filesystem::path filepath)
+{
+	int width = static_cast<int>(render_target.get_stride());
+	int height = static_cast<int>(render_target.get_number_of_elements()) / width;
+
+	write_png(filepath, width, height, 4, pack_to_rgba8(render_target).data());
+}
+
+std::shared_ptr<cg::world::texture> cg::utils::load_texture(const std::filesystem::path& filepath,
+															cg::world::texture_format format)
+{
+	int width, height, channels;
+	// Always decode into RGBA
+	stbi_uc* data = stbi_load(filepath.string().c_str(), &width, &height, &channels, 4);
+	if (!data)
+		THROW_ERROR("Can't load texture " + filepath.string() + ": " + stbi_failure_reason());
 
-	std::system(view_command.c_str());
+	auto result = std::make_shared<cg::world::texture>(static_cast<size_t>(width), static_cast<size_t>(height), data, format);
+	stbi_image_free(data);
+	return result;
 }
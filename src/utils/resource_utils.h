@@ -1,6 +1,7 @@
 #pragma once
 
 #include "resource.h"
+#include "world/texture.h"
 
 #include <filesystem>
 
@@ -8,4 +9,11 @@
 namespace cg::utils
 {
 	void save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath);
+	void save_resource(cg::resource<cg::rgba8_color>& render_target, std::filesystem::path filepath);
+	// Float formats are converted to 8 bits per channel
+	void save_resource(cg::resource<cg::rgba16f_color>& render_target, std::filesystem::path filepath);
+	void save_resource(cg::resource<cg::rgba32f_color>& render_target, std::filesystem::path filepath);
+
+	std::shared_ptr<cg::world::texture> load_texture(const std::filesystem::path& filepath,
+													 cg::world::texture_format format = cg::world::texture_format::rgba8);
 }
\ No newline at end of file
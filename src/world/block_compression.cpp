@@ -0,0 +1,431 @@
+#include "block_compression.h"
+
+#include "utils/error_handler.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+
+using namespace cg::world;
+using namespace DirectX;
+
+namespace
+{
+	constexpr size_t block_texels = 16;
+
+	// Interpolation weights of palette entries, the first two entries are the endpoints
+	constexpr float four_color_weights[4] = {0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f};
+	constexpr float three_color_weights[3] = {0.0f, 1.0f, 0.5f};
+	constexpr float eight_alpha_weights[8] = {
+			0.0f, 1.0f, 1.0f / 7.0f, 2.0f / 7.0f, 3.0f / 7.0f, 4.0f / 7.0f, 5.0f / 7.0f, 6.0f / 7.0f};
+	constexpr float six_alpha_weights[6] = {0.0f, 1.0f, 1.0f / 5.0f, 2.0f / 5.0f, 3.0f / 5.0f, 4.0f / 5.0f};
+	constexpr float bc7_weights[16] = {
+			0.0f, 4.0f / 64.0f, 9.0f / 64.0f, 13.0f / 64.0f, 17.0f / 64.0f, 21.0f / 64.0f, 26.0f / 64.0f, 30.0f / 64.0f,
+			34.0f / 64.0f, 38.0f / 64.0f, 43.0f / 64.0f, 47.0f / 64.0f, 51.0f / 64.0f, 55.0f / 64.0f, 60.0f / 64.0f, 1.0f};
+
+	// Texels with the smallest and the largest projections on the principal axis
+	// of the first N channels. They are used as endpoints of the block
+	template<size_t N>
+	std::pair<size_t, size_t> find_endpoints(const unsigned char* rgba)
+	{
+		float mean[N] = {};
+		for (size_t i = 0; i != block_texels; ++i) {
+			for (size_t c = 0; c != N; ++c) {
+				mean[c] += static_cast<float>(rgba[i * 4 + c]) / static_cast<float>(block_texels);
+			}
+		}
+
+		float covariance[N][N] = {};
+		for (size_t i = 0; i != block_texels; ++i) {
+			for (size_t a = 0; a != N; ++a) {
+				for (size_t b = 0; b != N; ++b) {
+					covariance[a][b] += (rgba[i * 4 + a] - mean[a]) * (rgba[i * 4 + b] - mean[b]);
+				}
+			}
+		}
+
+		// Power iteration starts from the channel with the largest variance
+		size_t largest = 0;
+		for (size_t c = 1; c != N; ++c) {
+			if (covariance[c][c] > covariance[largest][largest]) {
+				largest = c;
+			}
+		}
+		float axis[N];
+		std::copy(covariance[largest], covariance[largest] + N, axis);
+		for (size_t iteration = 0; iteration != 8; ++iteration) {
+			float next[N] = {};
+			float length = 0.0f;
+			for (size_t a = 0; a != N; ++a) {
+				for (size_t b = 0; b != N; ++b) {
+					next[a] += covariance[a][b] * axis[b];
+				}
+				length = std::max(length, std::abs(next[a]));
+			}
+			if (length == 0.0f) {
+				break;
+			}
+			for (size_t a = 0; a != N; ++a) {
+				axis[a] = next[a] / length;
+			}
+		}
+
+		std::pair<size_t, size_t> result{0, 0};
+		float min_projection = FLT_MAX;
+		float max_projection = -FLT_MAX;
+		for (size_t i = 0; i != block_texels; ++i) {
+			float projection = 0.0f;
+			for (size_t c = 0; c != N; ++c) {
+				projection += rgba[i * 4 + c] * axis[c];
+			}
+			if (projection < min_projection) {
+				min_projection = projection;
+				result.first = i;
+			}
+			if (projection > max_projection) {
+				max_projection = projection;
+				result.second = i;
+			}
+		}
+		return result;
+	}
+
+	XMVECTOR load_texel(const unsigned char* rgba)
+	{
+		return XMVectorScale(XMVectorSet(rgba[0], rgba[1], rgba[2], rgba[3]), 1.0f / 255.0f);
+	}
+
+	uint16_t pack_565(const unsigned char* rgb)
+	{
+		const unsigned int r = (rgb[0] * 31u + 127u) / 255u;
+		const unsigned int g = (rgb[1] * 63u + 127u) / 255u;
+		const unsigned int b = (rgb[2] * 31u + 127u) / 255u;
+		return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+	}
+
+	XMVECTOR unpack_565(uint16_t color)
+	{
+		const XMVECTOR value = XMVectorSet(
+				static_cast<float>(color >> 11), static_cast<float>((color >> 5) & 63), static_cast<float>(color & 31), 1.0f);
+		return XMVectorMultiply(value, XMVectorSet(1.0f / 31.0f, 1.0f / 63.0f, 1.0f / 31.0f, 1.0f));
+	}
+
+	// BC1 color block: two RGB565 endpoints and 2 bit indices
+	void encode_color(const unsigned char* rgba, unsigned char* output)
+	{
+		const auto [min_index, max_index] = find_endpoints<3>(rgba);
+		uint16_t color0 = pack_565(rgba + max_index * 4);
+		uint16_t color1 = pack_565(rgba + min_index * 4);
+		// Greater first endpoint selects four color mode
+		if (color0 < color1) {
+			std::swap(color0, color1);
+		}
+
+		uint32_t indices = 0;
+		if (color0 != color1) {
+			const XMVECTOR endpoint0 = unpack_565(color0);
+			const XMVECTOR endpoint1 = unpack_565(color1);
+			for (size_t i = 0; i != block_texels; ++i) {
+				const XMVECTOR texel = load_texel(rgba + i * 4);
+				uint32_t best = 0;
+				float best_error = FLT_MAX;
+				for (uint32_t selector = 0; selector != 4; ++selector) {
+					const XMVECTOR value = XMVectorLerp(endpoint0, endpoint1, four_color_weights[selector]);
+					const float error = XMVectorGetX(XMVector3LengthSq(XMVectorSubtract(value, texel)));
+					if (error < best_error) {
+						best_error = error;
+						best = selector;
+					}
+				}
+				indices |= best << (2 * i);
+			}
+		}
+
+		std::memcpy(output, &color0, 2);
+		std::memcpy(output + 2, &color1, 2);
+		std::memcpy(output + 4, &indices, 4);
+	}
+
+	// Palette is built once, texels pick its entries. Color blocks of BC3 always use four color mode
+	void decode_color(const unsigned char* block, bool force_four_colors, XMVECTOR* output)
+	{
+		uint16_t color0, color1;
+		uint32_t indices;
+		std::memcpy(&color0, block, 2);
+		std::memcpy(&color1, block + 2, 2);
+		std::memcpy(&indices, block + 4, 4);
+
+		const XMVECTOR endpoint0 = unpack_565(color0);
+		const XMVECTOR endpoint1 = unpack_565(color1);
+		XMVECTOR palette[4];
+		if (color0 > color1 || force_four_colors) {
+			for (size_t i = 0; i != 4; ++i) {
+				palette[i] = XMVectorLerp(endpoint0, endpoint1, four_color_weights[i]);
+			}
+		}
+		else {
+			// Three colors and transparent black
+			for (size_t i = 0; i != 3; ++i) {
+				palette[i] = XMVectorLerp(endpoint0, endpoint1, three_color_weights[i]);
+			}
+			palette[3] = XMVectorZero();
+		}
+		for (size_t i = 0; i != block_texels; ++i) {
+			output[i] = palette[(indices >> (2 * i)) & 3];
+		}
+	}
+
+	// BC3 alpha block: two 8 bit endpoints and 3 bit indices
+	void encode_alpha(const unsigned char* rgba, unsigned char* output)
+	{
+		unsigned char alpha0 = 0;
+		unsigned char alpha1 = 255;
+		for (size_t i = 0; i != block_texels; ++i) {
+			alpha0 = std::max(alpha0, rgba[i * 4 + 3]);
+			alpha1 = std::min(alpha1, rgba[i * 4 + 3]);
+		}
+
+		uint64_t indices = 0;
+		if (alpha0 != alpha1) {
+			for (size_t i = 0; i != block_texels; ++i) {
+				uint64_t best = 0;
+				float best_error = FLT_MAX;
+				for (uint64_t selector = 0; selector != 8; ++selector) {
+					const float value = alpha0 + (alpha1 - alpha0) * eight_alpha_weights[selector];
+					const float error = std::abs(value - rgba[i * 4 + 3]);
+					if (error < best_error) {
+						best_error = error;
+						best = selector;
+					}
+				}
+				indices |= best << (3 * i);
+			}
+		}
+
+		output[0] = alpha0;
+		output[1] = alpha1;
+		std::memcpy(output + 2, &indices, 6);
+	}
+
+	// Replaces alpha of decoded colors
+	void decode_alpha(const unsigned char* block, XMVECTOR* output)
+	{
+		const float alpha0 = block[0];
+		const float alpha1 = block[1];
+		uint64_t indices = 0;
+		std::memcpy(&indices, block + 2, 6);
+
+		float palette[8];
+		if (alpha0 > alpha1) {
+			for (size_t i = 0; i != 8; ++i) {
+				palette[i] = (alpha0 + (alpha1 - alpha0) * eight_alpha_weights[i]) / 255.0f;
+			}
+		}
+		else {
+			// Six interpolated values, explicit 0 and 255
+			for (size_t i = 0; i != 6; ++i) {
+				palette[i] = (alpha0 + (alpha1 - alpha0) * six_alpha_weights[i]) / 255.0f;
+			}
+			palette[6] = 0.0f;
+			palette[7] = 1.0f;
+		}
+		for (size_t i = 0; i != block_texels; ++i) {
+			output[i] = XMVectorSetW(output[i], palette[(indices >> (3 * i)) & 7]);
+		}
+	}
+
+	void write_bits(unsigned char* block, size_t& offset, unsigned int value, size_t count)
+	{
+		for (size_t i = 0; i != count; ++i, ++offset) {
+			if ((value >> i) & 1) {
+				block[offset / 8] |= static_cast<unsigned char>(1 << (offset % 8));
+			}
+		}
+	}
+
+	// 7 bit channels of BC7 mode 6 endpoint share the lowest bit, it is chosen to minimize the error
+	void quantize_bc7_endpoint(const unsigned char* rgba, unsigned int* channels, unsigned int& p_bit)
+	{
+		int best_error = INT_MAX;
+		for (unsigned int p = 0; p != 2; ++p) {
+			unsigned int quantized[4];
+			int error = 0;
+			for (size_t c = 0; c != 4; ++c) {
+				const int value = std::clamp((rgba[c] - static_cast<int>(p) + 1) / 2, 0, 127);
+				quantized[c] = static_cast<unsigned int>(value);
+				const int difference = value * 2 + static_cast<int>(p) - rgba[c];
+				error += difference * difference;
+			}
+			if (error < best_error) {
+				best_error = error;
+				std::copy(quantized, quantized + 4, channels);
+				p_bit = p;
+			}
+		}
+	}
+
+	XMVECTOR unpack_bc7_endpoint(const unsigned int* channels, unsigned int p_bit)
+	{
+		const XMVECTOR value = XMVectorSet(
+				static_cast<float>(channels[0] << 1 | p_bit), static_cast<float>(channels[1] << 1 | p_bit),
+				static_cast<float>(channels[2] << 1 | p_bit), static_cast<float>(channels[3] << 1 | p_bit));
+		return XMVectorScale(value, 1.0f / 255.0f);
+	}
+
+	// Only mode 6 of BC7 is used: single subset, RGBA endpoints and 4 bit indices.
+	// It is the best mode for smooth blocks and needs no partition search
+	void encode_bc7(const unsigned char* rgba, unsigned char* output)
+	{
+		const auto [min_index, max_index] = find_endpoints<4>(rgba);
+		unsigned int channels[2][4];
+		unsigned int p_bits[2];
+		quantize_bc7_endpoint(rgba + min_index * 4, channels[0], p_bits[0]);
+		quantize_bc7_endpoint(rgba + max_index * 4, channels[1], p_bits[1]);
+
+		const XMVECTOR endpoint0 = unpack_bc7_endpoint(channels[0], p_bits[0]);
+		const XMVECTOR endpoint1 = unpack_bc7_endpoint(channels[1], p_bits[1]);
+		unsigned int selectors[block_texels];
+		for (size_t i = 0; i != block_texels; ++i) {
+			const XMVECTOR texel = load_texel(rgba + i * 4);
+			float best_error = FLT_MAX;
+			for (unsigned int selector = 0; selector != 16; ++selector) {
+				const XMVECTOR value = XMVectorLerp(endpoint0, endpoint1, bc7_weights[selector]);
+				const float error = XMVectorGetX(XMVector4LengthSq(XMVectorSubtract(value, texel)));
+				if (error < best_error) {
+					best_error = error;
+					selectors[i] = selector;
+				}
+			}
+		}
+
+		// Highest bit of the first index is implicit zero, endpoints are swapped to satisfy it
+		if (selectors[0] >= 8) {
+			std::swap(channels[0], channels[1]);
+			std::swap(p_bits[0], p_bits[1]);
+			for (unsigned int& selector : selectors) {
+				selector = 15 - selector;
+			}
+		}
+
+		std::memset(output, 0, 16);
+		size_t offset = 0;
+		write_bits(output, offset, 1 << 6, 7);
+		for (size_t c = 0; c != 4; ++c) {
+			write_bits(output, offset, channels[0][c], 7);
+			write_bits(output, offset, channels[1][c], 7);
+		}
+		write_bits(output, offset, p_bits[0], 1);
+		write_bits(output, offset, p_bits[1], 1);
+		write_bits(output, offset, selectors[0], 3);
+		for (size_t i = 1; i != block_texels; ++i) {
+			write_bits(output, offset, selectors[i], 4);
+		}
+	}
+
+	// Mode 6 fits endpoints and p-bits into the low 64 bits, indices into the high ones
+	void decode_bc7(const unsigned char* block, XMVECTOR* output)
+	{
+		assert((block[0] & 0x7f) == 0x40 && "Only BC7 mode 6 is supported");
+
+		uint64_t low, high;
+		std::memcpy(&low, block, 8);
+		std::memcpy(&high, block + 8, 8);
+
+		unsigned int channels[2][4];
+		for (size_t c = 0; c != 4; ++c) {
+			channels[0][c] = static_cast<unsigned int>((low >> (7 + c * 14)) & 0x7f);
+			channels[1][c] = static_cast<unsigned int>((low >> (14 + c * 14)) & 0x7f);
+		}
+		const XMVECTOR endpoint0 = unpack_bc7_endpoint(channels[0], static_cast<unsigned int>(low >> 63));
+		const XMVECTOR endpoint1 = unpack_bc7_endpoint(channels[1], static_cast<unsigned int>(high & 1));
+		XMVECTOR palette[16];
+		for (size_t i = 0; i != 16; ++i) {
+			palette[i] = XMVectorLerp(endpoint0, endpoint1, bc7_weights[i]);
+		}
+
+		// First index has 3 bits, others have 4
+		output[0] = palette[(high >> 1) & 7];
+		for (size_t i = 1; i != block_texels; ++i) {
+			output[i] = palette[(high >> (4 * i)) & 15];
+		}
+	}
+}// namespace
+
+texture_format cg::world::parse_texture_format(const std::string& name)
+{
+	if (name == "rgba8") {
+		return texture_format::rgba8;
+	}
+	if (name == "bc1") {
+		return texture_format::bc1;
+	}
+	if (name == "bc3") {
+		return texture_format::bc3;
+	}
+	if (name == "bc7") {
+		return texture_format::bc7;
+	}
+	THROW_ERROR("Unknown texture format: " + name);
+}
+
+size_t cg::world::block_compression::get_block_size(texture_format format)
+{
+	switch (format) {
+		case texture_format::bc1:
+			return 8;
+		case texture_format::bc3:
+		case texture_format::bc7:
+			return 16;
+		default:
+			THROW_ERROR("Texture format is not block compressed");
+	}
+}
+
+void cg::world::block_compression::encode_block(texture_format format, const unsigned char* rgba, unsigned char* output)
+{
+	switch (format) {
+		case texture_format::bc1:
+			encode_color(rgba, output);
+			break;
+		case texture_format::bc3:
+			encode_alpha(rgba, output);
+			encode_color(rgba, output + 8);
+			break;
+		case texture_format::bc7:
+			encode_bc7(rgba, output);
+			break;
+		default:
+			THROW_ERROR("Texture format is not block compressed");
+	}
+}
+
+void cg::world::block_compression::decode_block(texture_format format, const unsigned char* block, XMVECTOR* output)
+{
+	switch (format) {
+		case texture_format::bc1:
+			decode_color(block, false, output);
+			break;
+		case texture_format::bc3:
+			decode_color(block + 8, true, output);
+			decode_alpha(block, output);
+			break;
+		case texture_format::bc7:
+			decode_bc7(block, output);
+			break;
+		default:
+			std::fill(output, output + block_texels, XMVectorZero());
+	}
+}
+
+XMVECTOR cg::world::block_compression::decode_texel(texture_format format, const unsigned char* block, size_t index)
+{
+	XMVECTOR texels[block_texels];
+	decode_block(format, block, texels);
+	return texels[index];
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <string>
+
+
+namespace cg::world
+{
+	// Storage format of texture texels. Block compressed formats keep every 4x4 texel block
+	// in 8 (BC1) or 16 (BC3, BC7) bytes instead of 64 bytes of RGBA8
+	enum class texture_format
+	{
+		rgba8,
+		bc1,
+		bc3,
+		bc7
+	};
+
+	texture_format parse_texture_format(const std::string& name);
+
+	namespace block_compression
+	{
+		constexpr size_t block_dimension = 4;
+
+		size_t get_block_size(texture_format format);
+
+		// Encodes 16 RGBA8 texels of a 4x4 block in row-major order
+		void encode_block(texture_format format, const unsigned char* rgba, unsigned char* output);
+
+		// Decodes all 16 texels of a block into RGBA in [0, 1], endpoints and palette are unpacked once
+		void decode_block(texture_format format, const unsigned char* block, DirectX::XMVECTOR* output);
+
+		// Decodes a single texel of a block, samplers decode whole blocks with decode_block instead
+		DirectX::XMVECTOR decode_texel(texture_format format, const unsigned char* block, size_t index);
+	}// namespace block_compression
+}// namespace cg::world
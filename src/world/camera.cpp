@@ -91,6 +91,11 @@ const DirectX::XMMATRIX cg::world::camera::get_projection_matrix() const
 	return projection;
 }
 
+const DirectX::XMMATRIX cg::world::camera::get_reversed_z_projection_matrix() const
+{
+	return DirectX::XMMatrixPerspectiveFovLH(angle_of_view, width / height, z_far, z_near);
+}
+
 const DirectX::XMVECTOR cg::world::camera::get_position() const
 {
 	return position;
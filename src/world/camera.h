@@ -26,6 +26,8 @@ namespace cg::world
 
 		const DirectX::XMMATRIX get_view_matrix() const;
 		const DirectX::XMMATRIX get_projection_matrix() const;
+		// Projection with swapped near and far planes for reversed-Z depth buffers
+		const DirectX::XMMATRIX get_reversed_z_projection_matrix() const;
 
 #ifdef DX12
 		const DirectX::XMMATRIX get_dxm_view_matrix() const;
@@ -0,0 +1,231 @@
+#include "index_optimization.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+
+using namespace cg::world;
+
+namespace
+{
+	// Scoring constants of Forsyth's algorithm
+	constexpr float cache_decay_power = 1.5f;
+	constexpr float last_triangle_score = 0.75f;
+	constexpr float valence_boost_scale = 2.0f;
+	constexpr float valence_boost_power = 0.5f;
+
+	float vertex_score(int cache_position, size_t remaining_triangles)
+	{
+		if (remaining_triangles == 0) {
+			return -1.0f;
+		}
+		float score = 0.0f;
+		if (cache_position >= 0) {
+			// Vertices of the last triangle get a fixed score, so it is not repeated right away
+			if (cache_position < 3) {
+				score = last_triangle_score;
+			}
+			else {
+				const float scale = 1.0f / static_cast<float>(index_optimization::optimization_cache_size - 3);
+				score = std::pow(1.0f - static_cast<float>(cache_position - 3) * scale, cache_decay_power);
+			}
+		}
+		// Vertices with few triangles left are finished early
+		return score + valence_boost_scale * std::pow(static_cast<float>(remaining_triangles), -valence_boost_power);
+	}
+}// namespace
+
+void cg::world::index_optimization::optimize_vertex_cache(
+		std::vector<unsigned int>& indices, std::vector<unsigned int>& face_materials,
+		size_t first_index, size_t num_indices)
+{
+	const size_t num_triangles = num_indices / 3;
+	if (num_triangles < 2) {
+		return;
+	}
+
+	// Vertices of the range get local ids
+	std::vector<unsigned int> unique(indices.begin() + first_index, indices.begin() + first_index + num_indices);
+	std::sort(unique.begin(), unique.end());
+	unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+	std::vector<unsigned int> local(num_indices);
+	for (size_t i = 0; i != num_indices; ++i) {
+		local[i] = static_cast<unsigned int>(
+				std::lower_bound(unique.begin(), unique.end(), indices[first_index + i]) - unique.begin());
+	}
+	const size_t num_vertices = unique.size();
+
+	std::vector<std::vector<size_t>> vertex_triangles(num_vertices);
+	for (size_t t = 0; t != num_triangles; ++t) {
+		for (size_t k = 0; k != 3; ++k) {
+			vertex_triangles[local[3 * t + k]].push_back(t);
+		}
+	}
+	std::vector<int> cache_positions(num_vertices, -1);
+	std::vector<float> vertex_scores(num_vertices);
+	for (size_t v = 0; v != num_vertices; ++v) {
+		vertex_scores[v] = vertex_score(-1, vertex_triangles[v].size());
+	}
+	std::vector<float> triangle_scores(num_triangles);
+	std::vector<bool> emitted(num_triangles, false);
+	auto score_triangle = [&](size_t t) {
+		triangle_scores[t] = vertex_scores[local[3 * t]] + vertex_scores[local[3 * t + 1]] +
+							 vertex_scores[local[3 * t + 2]];
+	};
+	for (size_t t = 0; t != num_triangles; ++t) {
+		score_triangle(t);
+	}
+
+	std::vector<unsigned int> result;
+	result.reserve(num_indices);
+	std::vector<unsigned int> result_materials;
+	result_materials.reserve(num_triangles);
+	std::vector<unsigned int> cache, next_cache;
+	size_t best = 0;
+	for (size_t t = 1; t != num_triangles; ++t) {
+		best = triangle_scores[t] > triangle_scores[best] ? t : best;
+	}
+
+	for (size_t step = 0; step != num_triangles; ++step) {
+		emitted[best] = true;
+		result_materials.push_back(face_materials[first_index / 3 + best]);
+		next_cache.clear();
+		for (size_t k = 0; k != 3; ++k) {
+			const unsigned int vertex = local[3 * best + k];
+			result.push_back(indices[first_index + 3 * best + k]);
+			next_cache.push_back(vertex);
+			std::vector<size_t>& triangles = vertex_triangles[vertex];
+			triangles.erase(std::find(triangles.begin(), triangles.end(), best));
+		}
+		for (unsigned int vertex : cache) {
+			if (std::find(next_cache.begin(), next_cache.end(), vertex) == next_cache.end()) {
+				next_cache.push_back(vertex);
+			}
+		}
+
+		// Vertices pushed out of the cache lose their position score
+		for (size_t i = 0; i != next_cache.size(); ++i) {
+			const unsigned int vertex = next_cache[i];
+			cache_positions[vertex] = i < optimization_cache_size ? static_cast<int>(i) : -1;
+			vertex_scores[vertex] = vertex_score(cache_positions[vertex], vertex_triangles[vertex].size());
+			for (size_t t : vertex_triangles[vertex]) {
+				score_triangle(t);
+			}
+		}
+		next_cache.resize(std::min(next_cache.size(), optimization_cache_size));
+		cache.swap(next_cache);
+
+		// Next triangle is the best one around cached vertices, or the best remaining one
+		bool found = false;
+		for (unsigned int vertex : cache) {
+			for (size_t t : vertex_triangles[vertex]) {
+				if (!found || triangle_scores[t] > triangle_scores[best]) {
+					best = t;
+					found = true;
+				}
+			}
+		}
+		const bool cache_hit = found;
+		for (size_t t = 0; t != num_triangles && !cache_hit; ++t) {
+			if (!emitted[t] && (!found || triangle_scores[t] > triangle_scores[best])) {
+				best = t;
+				found = true;
+			}
+		}
+	}
+
+	std::copy(result.begin(), result.end(), indices.begin() + first_index);
+	std::copy(result_materials.begin(), result_materials.end(), face_materials.begin() + first_index / 3);
+}
+
+float cg::world::index_optimization::compute_acmr(const std::vector<unsigned int>& indices)
+{
+	if (indices.empty()) {
+		return 0.0f;
+	}
+	const unsigned int num_vertices = *std::max_element(indices.begin(), indices.end()) + 1;
+	// A vertex is in the cache if fewer than fifo_cache_size misses happened since it was loaded
+	std::vector<size_t> load_times(num_vertices, 0);
+	size_t misses = 0;
+	for (unsigned int vertex : indices) {
+		if (load_times[vertex] == 0 || misses - load_times[vertex] >= fifo_cache_size) {
+			++misses;
+			load_times[vertex] = misses;
+		}
+	}
+	return static_cast<float>(misses) / static_cast<float>(indices.size() / 3);
+}
+
+void cg::world::index_optimization::order_meshlets_for_overdraw(
+		std::vector<unsigned int>& indices, std::vector<unsigned int>& face_materials, meshlet_list& meshlets)
+{
+	// Center of the shape weighted by the number of triangles of meshlets
+	DirectX::XMFLOAT3 center{0.0f, 0.0f, 0.0f};
+	float weight = 0.0f;
+	for (const meshlet& m : meshlets.meshlets) {
+		const float triangles = static_cast<float>(m.num_indices / 3);
+		center = {center.x + m.center.x * triangles, center.y + m.center.y * triangles,
+				  center.z + m.center.z * triangles};
+		weight += triangles;
+	}
+	if (weight == 0.0f) {
+		return;
+	}
+	center = {center.x / weight, center.y / weight, center.z / weight};
+
+	// Meshlets without a common normal direction are treated as facing nowhere.
+	// Faces are wound clockwise, so the cone axis points into the surface and is negated
+	std::vector<float> occlusion(meshlets.meshlets.size(), 0.0f);
+	for (size_t i = 0; i != meshlets.meshlets.size(); ++i) {
+		const meshlet& m = meshlets.meshlets[i];
+		if (m.cone_angle < DirectX::XM_PI) {
+			occlusion[i] = -((m.center.x - center.x) * m.cone_axis.x + (m.center.y - center.y) * m.cone_axis.y +
+							 (m.center.z - center.z) * m.cone_axis.z);
+		}
+	}
+	std::vector<size_t> order(meshlets.meshlets.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return occlusion[a] > occlusion[b]; });
+
+	meshlet_list result;
+	std::vector<unsigned int> reordered;
+	reordered.reserve(indices.size());
+	std::vector<unsigned int> reordered_materials;
+	reordered_materials.reserve(face_materials.size());
+	result.vertices.reserve(meshlets.vertices.size());
+	for (size_t i : order) {
+		meshlet m = meshlets.meshlets[i];
+		reordered.insert(reordered.end(), indices.begin() + m.first_index,
+						 indices.begin() + m.first_index + m.num_indices);
+		reordered_materials.insert(reordered_materials.end(), face_materials.begin() + m.first_index / 3,
+								   face_materials.begin() + (m.first_index + m.num_indices) / 3);
+		result.vertices.insert(result.vertices.end(), meshlets.vertices.begin() + m.first_vertex,
+							   meshlets.vertices.begin() + m.first_vertex + m.num_vertices);
+		m.first_index = static_cast<unsigned int>(reordered.size() - m.num_indices);
+		m.first_vertex = static_cast<unsigned int>(result.vertices.size() - m.num_vertices);
+		result.meshlets.push_back(m);
+	}
+	indices.swap(reordered);
+	face_materials.swap(reordered_materials);
+	meshlets = std::move(result);
+}
+
+std::vector<unsigned int> cg::world::index_optimization::build_vertex_fetch_remap(
+		const std::vector<unsigned int>& indices, size_t num_vertices)
+{
+	constexpr unsigned int unused = ~0u;
+	std::vector<unsigned int> remap(num_vertices, unused);
+	unsigned int next = 0;
+	for (unsigned int vertex : indices) {
+		if (remap[vertex] == unused) {
+			remap[vertex] = next++;
+		}
+	}
+	for (unsigned int& new_index : remap) {
+		if (new_index == unused) {
+			new_index = next++;
+		}
+	}
+	return remap;
+}
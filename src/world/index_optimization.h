@@ -0,0 +1,34 @@
+#pragma once
+
+#include "world/meshlet.h"
+
+#include <vector>
+
+
+namespace cg::world
+{
+	namespace index_optimization
+	{
+		// Vertices kept by the cache of the reordering, and by the FIFO cache ACMR is measured with
+		constexpr size_t optimization_cache_size = 32;
+		constexpr size_t fifo_cache_size = 16;
+
+		// Forsyth's linear-speed reordering of triangles in [first_index, first_index + num_indices),
+		// a triangle is picked by the recency of its vertices in a simulated LRU cache and by
+		// the number of triangles still using them. Material ids of faces move together with them
+		void optimize_vertex_cache(std::vector<unsigned int>& indices, std::vector<unsigned int>& face_materials,
+								   size_t first_index, size_t num_indices);
+
+		// Average number of vertices transformed per triangle with a FIFO post-transform cache
+		float compute_acmr(const std::vector<unsigned int>& indices);
+
+		// Tipsy's overdraw ordering: meshlets facing away from the center of the shape are drawn first,
+		// as they tend to occlude the rest. Index and vertex ranges of meshlets are moved accordingly
+		void order_meshlets_for_overdraw(std::vector<unsigned int>& indices, std::vector<unsigned int>& face_materials,
+										 meshlet_list& meshlets);
+
+		// New index of every vertex, in order of the first use by the index buffer.
+		// Vertices not used at all are moved to the end
+		std::vector<unsigned int> build_vertex_fetch_remap(const std::vector<unsigned int>& indices, size_t num_vertices);
+	}// namespace index_optimization
+}// namespace cg::world
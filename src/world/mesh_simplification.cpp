@@ -0,0 +1,311 @@
+#include "mesh_simplification.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <queue>
+#include <tuple>
+#include <utility>
+
+
+using namespace cg::world;
+
+namespace
+{
+	// Borders are preserved by planes perpendicular to border faces, weighted above the surface ones
+	constexpr double border_weight = 10.0;
+
+	struct vector3
+	{
+		double x, y, z;
+
+		vector3 operator-(const vector3& other) const
+		{
+			return {x - other.x, y - other.y, z - other.z};
+		}
+		double dot(const vector3& other) const
+		{
+			return x * other.x + y * other.y + z * other.z;
+		}
+		vector3 cross(const vector3& other) const
+		{
+			return {y * other.z - z * other.y, z * other.x - x * other.z, x * other.y - y * other.x};
+		}
+		double length() const
+		{
+			return std::sqrt(dot(*this));
+		}
+	};
+
+	// Symmetric 4x4 matrix, evaluates sum of squared distances to a set of planes
+	struct quadric
+	{
+		double a00 = 0.0, a01 = 0.0, a02 = 0.0, a03 = 0.0;
+		double a11 = 0.0, a12 = 0.0, a13 = 0.0;
+		double a22 = 0.0, a23 = 0.0;
+		double a33 = 0.0;
+
+		// Plane n.p + d = 0 with unit normal n
+		static quadric from_plane(const vector3& n, double d, double weight)
+		{
+			quadric q;
+			q.a00 = weight * n.x * n.x;
+			q.a01 = weight * n.x * n.y;
+			q.a02 = weight * n.x * n.z;
+			q.a03 = weight * n.x * d;
+			q.a11 = weight * n.y * n.y;
+			q.a12 = weight * n.y * n.z;
+			q.a13 = weight * n.y * d;
+			q.a22 = weight * n.z * n.z;
+			q.a23 = weight * n.z * d;
+			q.a33 = weight * d * d;
+			return q;
+		}
+
+		quadric& operator+=(const quadric& other)
+		{
+			a00 += other.a00;
+			a01 += other.a01;
+			a02 += other.a02;
+			a03 += other.a03;
+			a11 += other.a11;
+			a12 += other.a12;
+			a13 += other.a13;
+			a22 += other.a22;
+			a23 += other.a23;
+			a33 += other.a33;
+			return *this;
+		}
+
+		double evaluate(const vector3& p) const
+		{
+			const double result = a00 * p.x * p.x + a11 * p.y * p.y + a22 * p.z * p.z + a33 +
+								  2.0 * (a01 * p.x * p.y + a02 * p.x * p.z + a12 * p.y * p.z +
+										 a03 * p.x + a13 * p.y + a23 * p.z);
+			// Rounding can make the sum slightly negative
+			return std::max(result, 0.0);
+		}
+	};
+
+	// Vertex from is merged into vertex to, versions tell if the cost is still valid
+	struct collapse
+	{
+		double cost;
+		unsigned int from;
+		unsigned int to;
+		unsigned int from_version;
+		unsigned int to_version;
+
+		bool operator>(const collapse& other) const
+		{
+			return cost > other.cost;
+		}
+	};
+}// namespace
+
+std::vector<mesh_simplification::level> cg::world::mesh_simplification::build_lod_chain(
+		const std::vector<DirectX::XMFLOAT3>& in_positions, const std::vector<unsigned int>& indices,
+		const std::vector<unsigned int>& face_materials, size_t max_levels)
+{
+	const size_t num_vertices = in_positions.size();
+	const size_t num_triangles = indices.size() / 3;
+	std::vector<level> levels;
+	if (num_triangles < 2 || max_levels == 0) {
+		return levels;
+	}
+
+	std::vector<vector3> positions(num_vertices);
+	for (size_t i = 0; i != num_vertices; ++i) {
+		positions[i] = {in_positions[i].x, in_positions[i].y, in_positions[i].z};
+	}
+
+	// Copies of a vertex with other normal or texture coordinates are welded for topology and error.
+	// Such vertices are locked, moving a single copy would tear the seam
+	std::vector<unsigned int> welded(num_vertices);
+	std::vector<unsigned int> num_copies(num_vertices, 0);
+	std::map<std::tuple<float, float, float>, unsigned int> first_at_position;
+	for (unsigned int i = 0; i != num_vertices; ++i) {
+		const std::tuple<float, float, float> key{in_positions[i].x, in_positions[i].y, in_positions[i].z};
+		welded[i] = first_at_position.emplace(key, i).first->second;
+		++num_copies[welded[i]];
+	}
+
+	// Vertices on material borders are locked as well, so materials don't spread over each other
+	std::vector<bool> locked(num_vertices);
+	for (unsigned int i = 0; i != num_vertices; ++i) {
+		locked[i] = num_copies[welded[i]] != 1;
+	}
+	constexpr unsigned int no_material = ~0u;
+	std::vector<unsigned int> vertex_materials(num_vertices, no_material);
+	for (size_t t = 0; t != num_triangles; ++t) {
+		for (size_t k = 0; k != 3; ++k) {
+			unsigned int& material = vertex_materials[welded[indices[3 * t + k]]];
+			if (material == no_material) {
+				material = face_materials[t];
+			}
+			else if (material != face_materials[t]) {
+				locked[welded[indices[3 * t + k]]] = true;
+			}
+		}
+	}
+
+	std::vector<unsigned int> current = indices;
+	auto face_normal = [&](size_t t) {
+		const vector3& a = positions[current[3 * t]];
+		return (positions[current[3 * t + 1]] - a).cross(positions[current[3 * t + 2]] - a);
+	};
+
+	// Every vertex starts with planes of its faces, border edges add perpendicular planes
+	std::vector<quadric> quadrics(num_vertices);
+	std::vector<std::vector<size_t>> vertex_triangles(num_vertices);
+	std::map<std::pair<unsigned int, unsigned int>, unsigned int> edge_faces;
+	auto edge_key = [&](unsigned int a, unsigned int b) {
+		return std::minmax(welded[a], welded[b]);
+	};
+	for (size_t t = 0; t != num_triangles; ++t) {
+		const vector3 normal = face_normal(t);
+		const double length = normal.length();
+		for (size_t k = 0; k != 3; ++k) {
+			const unsigned int vertex = current[3 * t + k];
+			vertex_triangles[vertex].push_back(t);
+			++edge_faces[edge_key(vertex, current[3 * t + (k + 1) % 3])];
+			if (length > 0.0) {
+				const vector3 n{normal.x / length, normal.y / length, normal.z / length};
+				quadrics[welded[vertex]] += quadric::from_plane(n, -n.dot(positions[vertex]), 1.0);
+			}
+		}
+	}
+	for (size_t t = 0; t != num_triangles; ++t) {
+		const vector3 normal = face_normal(t);
+		for (size_t k = 0; k != 3; ++k) {
+			const unsigned int a = current[3 * t + k];
+			const unsigned int b = current[3 * t + (k + 1) % 3];
+			if (edge_faces[edge_key(a, b)] != 1) {
+				continue;
+			}
+			const vector3 border_normal = (positions[b] - positions[a]).cross(normal);
+			const double length = border_normal.length();
+			if (length > 0.0) {
+				const vector3 n{border_normal.x / length, border_normal.y / length, border_normal.z / length};
+				const quadric border = quadric::from_plane(n, -n.dot(positions[a]), border_weight);
+				quadrics[welded[a]] += border;
+				quadrics[welded[b]] += border;
+			}
+		}
+	}
+
+	std::vector<unsigned int> versions(num_vertices, 0);
+	std::vector<bool> removed_vertices(num_vertices, false);
+	std::vector<bool> removed_triangles(num_triangles, false);
+	std::priority_queue<collapse, std::vector<collapse>, std::greater<collapse>> queue;
+	auto push_collapses = [&](size_t t) {
+		for (size_t k = 0; k != 3; ++k) {
+			const unsigned int a = current[3 * t + k];
+			const unsigned int b = current[3 * t + (k + 1) % 3];
+			for (const auto& [from, to] : {std::pair{a, b}, std::pair{b, a}}) {
+				if (locked[welded[from]] || welded[from] == welded[to]) {
+					continue;
+				}
+				quadric q = quadrics[welded[from]];
+				q += quadrics[welded[to]];
+				queue.push({q.evaluate(positions[to]), from, to, versions[from], versions[to]});
+			}
+		}
+	};
+	for (size_t t = 0; t != num_triangles; ++t) {
+		push_collapses(t);
+	}
+
+	// Faces around the removed vertex must not turn over, or turn by more than ~75 degrees, when it moves
+	auto flips = [&](const collapse& c) {
+		for (size_t t : vertex_triangles[c.from]) {
+			if (removed_triangles[t]) {
+				continue;
+			}
+			bool has_target = false;
+			for (size_t k = 0; k != 3; ++k) {
+				has_target = has_target || welded[current[3 * t + k]] == welded[c.to];
+			}
+			if (has_target) {
+				continue;
+			}
+			const vector3 before = face_normal(t);
+			std::replace(current.begin() + 3 * t, current.begin() + 3 * t + 3, c.from, c.to);
+			const vector3 after = face_normal(t);
+			std::replace(current.begin() + 3 * t, current.begin() + 3 * t + 3, c.to, c.from);
+			if (before.dot(after) <= 0.25 * before.length() * after.length()) {
+				return true;
+			}
+		}
+		return false;
+	};
+
+	auto add_level = [&](double max_cost) {
+		level result;
+		for (size_t t = 0; t != num_triangles; ++t) {
+			if (!removed_triangles[t]) {
+				result.indices.insert(result.indices.end(), current.begin() + 3 * t, current.begin() + 3 * t + 3);
+				result.face_materials.push_back(face_materials[t]);
+			}
+		}
+		result.error = static_cast<float>(std::sqrt(max_cost));
+		levels.push_back(std::move(result));
+	};
+
+	size_t num_alive = num_triangles;
+	size_t target = num_triangles / 2;
+	double max_cost = 0.0;
+	while (!queue.empty() && levels.size() != max_levels) {
+		const collapse c = queue.top();
+		queue.pop();
+		if (removed_vertices[c.from] || removed_vertices[c.to] || versions[c.from] != c.from_version ||
+			versions[c.to] != c.to_version || flips(c)) {
+			continue;
+		}
+
+		// Faces holding both ends degenerate, the rest move to the target vertex
+		for (size_t t : vertex_triangles[c.from]) {
+			if (removed_triangles[t]) {
+				continue;
+			}
+			std::replace(current.begin() + 3 * t, current.begin() + 3 * t + 3, c.from, c.to);
+			const unsigned int a = welded[current[3 * t]];
+			const unsigned int b = welded[current[3 * t + 1]];
+			const unsigned int d = welded[current[3 * t + 2]];
+			if (a == b || b == d || d == a) {
+				removed_triangles[t] = true;
+				--num_alive;
+			}
+			else {
+				vertex_triangles[c.to].push_back(t);
+			}
+		}
+		vertex_triangles[c.from].clear();
+		removed_vertices[c.from] = true;
+		quadrics[welded[c.to]] += quadrics[c.from];
+		++versions[c.to];
+		max_cost = std::max(max_cost, c.cost);
+
+		// Only collapses touching the target vertex changed their cost
+		std::vector<size_t>& target_triangles = vertex_triangles[c.to];
+		target_triangles.erase(std::remove_if(target_triangles.begin(), target_triangles.end(),
+											  [&](size_t t) { return removed_triangles[t]; }),
+							   target_triangles.end());
+		for (size_t t : target_triangles) {
+			push_collapses(t);
+		}
+
+		if (num_alive <= target) {
+			add_level(max_cost);
+			target = num_alive / 2;
+		}
+	}
+
+	// Last level is kept if collapses ran out well before the next half
+	const size_t last_size = levels.empty() ? num_triangles : levels.back().indices.size() / 3;
+	if (levels.size() != max_levels && num_alive * 10 < last_size * 9) {
+		add_level(max_cost);
+	}
+	return levels;
+}
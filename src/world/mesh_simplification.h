@@ -0,0 +1,28 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <vector>
+
+
+namespace cg::world
+{
+	namespace mesh_simplification
+	{
+		struct level
+		{
+			std::vector<unsigned int> indices;
+			std::vector<unsigned int> face_materials;
+			// Square root of the largest quadric error of done collapses, it bounds
+			// the distance of the simplified surface from the original one
+			float error;
+		};
+
+		// Quadric error edge collapses, a level is taken every time the number of triangles halves.
+		// Vertices are only removed, never moved, so every level indexes the original vertex buffer.
+		// Vertices sharing position with others (normal or texture seams), and vertices between faces
+		// of different materials, are kept in place. Faces keep the material id they had
+		std::vector<level> build_lod_chain(const std::vector<DirectX::XMFLOAT3>& positions,
+										   const std::vector<unsigned int>& indices,
+										   const std::vector<unsigned int>& face_materials, size_t max_levels);
+	}// namespace mesh_simplification
+}// namespace cg::world
@@ -0,0 +1,178 @@
+#include "meshlet.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+using namespace cg::world;
+
+namespace
+{
+	constexpr unsigned int no_triangle = ~0u;
+
+	DirectX::XMFLOAT3 face_normal(const std::vector<DirectX::XMFLOAT3>& positions, const unsigned int* face)
+	{
+		const DirectX::XMFLOAT3& a = positions[face[0]];
+		const DirectX::XMFLOAT3& b = positions[face[1]];
+		const DirectX::XMFLOAT3& c = positions[face[2]];
+		const float abx = b.x - a.x, aby = b.y - a.y, abz = b.z - a.z;
+		const float acx = c.x - a.x, acy = c.y - a.y, acz = c.z - a.z;
+		DirectX::XMFLOAT3 normal{aby * acz - abz * acy, abz * acx - abx * acz, abx * acy - aby * acx};
+		const float length = std::sqrt(normal.x * normal.x + normal.y * normal.y + normal.z * normal.z);
+		if (length > 0.0f) {
+			normal = {normal.x / length, normal.y / length, normal.z / length};
+		}
+		return normal;
+	}
+
+	void compute_bounds(const std::vector<DirectX::XMFLOAT3>& positions, const std::vector<unsigned int>& indices,
+						const std::vector<unsigned int>& vertices, meshlet& result)
+	{
+		// Sphere around the center of the bounding box
+		DirectX::XMFLOAT3 low = positions[vertices[result.first_vertex]];
+		DirectX::XMFLOAT3 high = low;
+		for (unsigned int i = 0; i != result.num_vertices; ++i) {
+			const DirectX::XMFLOAT3& p = positions[vertices[result.first_vertex + i]];
+			low = {std::min(low.x, p.x), std::min(low.y, p.y), std::min(low.z, p.z)};
+			high = {std::max(high.x, p.x), std::max(high.y, p.y), std::max(high.z, p.z)};
+		}
+		result.center = {0.5f * (low.x + high.x), 0.5f * (low.y + high.y), 0.5f * (low.z + high.z)};
+		result.radius = 0.0f;
+		for (unsigned int i = 0; i != result.num_vertices; ++i) {
+			const DirectX::XMFLOAT3& p = positions[vertices[result.first_vertex + i]];
+			const float dx = p.x - result.center.x, dy = p.y - result.center.y, dz = p.z - result.center.z;
+			result.radius = std::max(result.radius, std::sqrt(dx * dx + dy * dy + dz * dz));
+		}
+
+		// Cone around the average normal
+		DirectX::XMFLOAT3 axis{0.0f, 0.0f, 0.0f};
+		for (unsigned int i = 0; i != result.num_indices; i += 3) {
+			const DirectX::XMFLOAT3 normal = face_normal(positions, &indices[result.first_index + i]);
+			axis = {axis.x + normal.x, axis.y + normal.y, axis.z + normal.z};
+		}
+		const float length = std::sqrt(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+		result.cone_angle = DirectX::XM_PI;
+		result.cone_axis = {0.0f, 0.0f, 1.0f};
+		if (length < 1e-6f) {
+			return;
+		}
+		result.cone_axis = {axis.x / length, axis.y / length, axis.z / length};
+		float min_cosine = 1.0f;
+		for (unsigned int i = 0; i != result.num_indices; i += 3) {
+			const DirectX::XMFLOAT3 normal = face_normal(positions, &indices[result.first_index + i]);
+			min_cosine = std::min(min_cosine, normal.x * result.cone_axis.x + normal.y * result.cone_axis.y +
+													  normal.z * result.cone_axis.z);
+		}
+		result.cone_angle = std::acos(std::clamp(min_cosine, -1.0f, 1.0f));
+	}
+}// namespace
+
+meshlet_list cg::world::build_meshlets(const std::vector<DirectX::XMFLOAT3>& positions, std::vector<unsigned int>& indices,
+									   std::vector<unsigned int>& face_materials)
+{
+	const size_t num_triangles = indices.size() / 3;
+	std::vector<std::vector<unsigned int>> vertex_triangles(positions.size());
+	for (unsigned int t = 0; t != num_triangles; ++t) {
+		for (size_t k = 0; k != 3; ++k) {
+			vertex_triangles[indices[3 * t + k]].push_back(t);
+		}
+	}
+
+	meshlet_list result;
+	std::vector<unsigned int> reordered;
+	reordered.reserve(3 * num_triangles);
+	std::vector<unsigned int> reordered_materials;
+	reordered_materials.reserve(num_triangles);
+	std::vector<bool> used(num_triangles, false);
+	// Position of a vertex in the list of the current meshlet, or none
+	std::vector<unsigned int> local_vertex(positions.size(), ~0u);
+	size_t next_seed = 0;
+
+	while (reordered.size() != 3 * num_triangles) {
+		meshlet current{};
+		current.first_index = static_cast<unsigned int>(reordered.size());
+		current.first_vertex = static_cast<unsigned int>(result.vertices.size());
+
+		auto new_vertices = [&](unsigned int t) {
+			unsigned int count = 0;
+			for (size_t k = 0; k != 3; ++k) {
+				count += local_vertex[indices[3 * t + k]] == ~0u ? 1 : 0;
+			}
+			return count;
+		};
+		// Sum of vertex positions, the meshlet grows around their average
+		DirectX::XMFLOAT3 position_sum{0.0f, 0.0f, 0.0f};
+		auto distance_to_center = [&](unsigned int t) {
+			float distance = 0.0f;
+			for (size_t k = 0; k != 3; ++k) {
+				const DirectX::XMFLOAT3& p = positions[indices[3 * t + k]];
+				const float scale = 1.0f / static_cast<float>(current.num_vertices);
+				const float dx = p.x - position_sum.x * scale;
+				const float dy = p.y - position_sum.y * scale;
+				const float dz = p.z - position_sum.z * scale;
+				distance += dx * dx + dy * dy + dz * dz;
+			}
+			return distance;
+		};
+		auto add_triangle = [&](unsigned int t) {
+			used[t] = true;
+			reordered_materials.push_back(face_materials[t]);
+			for (size_t k = 0; k != 3; ++k) {
+				const unsigned int vertex = indices[3 * t + k];
+				if (local_vertex[vertex] == ~0u) {
+					local_vertex[vertex] = current.num_vertices++;
+					result.vertices.push_back(vertex);
+					const DirectX::XMFLOAT3& p = positions[vertex];
+					position_sum = {position_sum.x + p.x, position_sum.y + p.y, position_sum.z + p.z};
+				}
+				reordered.push_back(vertex);
+			}
+			current.num_indices += 3;
+		};
+
+		while (used[next_seed]) {
+			++next_seed;
+		}
+		add_triangle(static_cast<unsigned int>(next_seed));
+
+		// Neighbours sharing more vertices and closer to the center keep meshlets compact
+		while (current.num_indices / 3 != meshlet::max_triangles) {
+			unsigned int best = no_triangle;
+			unsigned int best_new_vertices = 4;
+			float best_distance = 0.0f;
+			for (unsigned int i = 0; i != current.num_vertices; ++i) {
+				for (unsigned int t : vertex_triangles[result.vertices[current.first_vertex + i]]) {
+					if (used[t]) {
+						continue;
+					}
+					const unsigned int count = new_vertices(t);
+					if (count > best_new_vertices) {
+						continue;
+					}
+					const float distance = distance_to_center(t);
+					if (count < best_new_vertices || distance < best_distance) {
+						best = t;
+						best_new_vertices = count;
+						best_distance = distance;
+					}
+				}
+			}
+			if (best == no_triangle || current.num_vertices + best_new_vertices > meshlet::max_vertices) {
+				break;
+			}
+			add_triangle(best);
+		}
+
+		for (unsigned int i = 0; i != current.num_vertices; ++i) {
+			local_vertex[result.vertices[current.first_vertex + i]] = ~0u;
+		}
+		result.meshlets.push_back(current);
+	}
+
+	indices.swap(reordered);
+	face_materials.swap(reordered_materials);
+	for (meshlet& m : result.meshlets) {
+		compute_bounds(positions, indices, result.vertices, m);
+	}
+	return result;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <DirectXMath.h>
+#include <vector>
+
+
+namespace cg::world
+{
+	// Cluster of nearby triangles of a shape. Its triangles are a contiguous range of the index buffer,
+	// its unique vertices are a range of meshlet_list::vertices. Bounds are in object space
+	struct meshlet
+	{
+		static constexpr size_t max_vertices = 64;
+		static constexpr size_t max_triangles = 124;
+
+		unsigned int first_index;
+		unsigned int num_indices;
+		unsigned int first_vertex;
+		unsigned int num_vertices;
+
+		DirectX::XMFLOAT3 center;
+		float radius;
+		// Normals of all faces are within cone_angle of the axis, the angle is pi if they are spread too much.
+		// Normals follow the winding: a face is front facing when its normal points away from the camera
+		DirectX::XMFLOAT3 cone_axis;
+		float cone_angle;
+	};
+
+	struct meshlet_list
+	{
+		std::vector<meshlet> meshlets;
+		std::vector<unsigned int> vertices;
+	};
+
+	// Grows meshlets greedily from a seed triangle, adding the neighbour which brings the fewest new vertices.
+	// Triangles of the index buffer and their material ids are reordered in place, so every meshlet is a contiguous range
+	meshlet_list build_meshlets(const std::vector<DirectX::XMFLOAT3>& positions, std::vector<unsigned int>& indices,
+								std::vector<unsigned int>& face_materials);
+}// namespace cg::world
@@ -3,12 +3,16 @@
 #include "model.h"
 
 #include "utils/error_handler.h"
+#include "world/index_optimization.h"
+#include "world/mesh_simplification.h"
+#include "world/meshlet.h"
 
 #include <DirectXMath.h>
 #include <iostream>
 #include <set>
 #include <linalg.h>
 #include <random>
+#include <tuple>
 
 
 using namespace linalg::aliases;
@@ -18,7 +22,7 @@ cg::world::model::model() {}
 
 cg::world::model::~model() {}
 
-void cg::world::model::load_obj(const std::filesystem::path& model_path)
+void cg::world::model::load_obj(const std::filesystem::path& model_path, bool compact_vertices)
 {
 	//THROW_ERROR("Not implemented yet");
 	std::string error_message, warning_message;
@@ -37,6 +41,21 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
 		THROW_ERROR(error_message);
 	}
 
+	// Materials are stored once, faces keep their index. Faces without material get a gray one
+	material_table.clear();
+	material_textures.clear();
+	for (const tinyobj::material_t& file_material : materials) {
+		material_table.push_back({DirectX::XMFLOAT3(file_material.ambient), DirectX::XMFLOAT3(file_material.diffuse),
+								  DirectX::XMFLOAT3(file_material.specular), DirectX::XMFLOAT3(file_material.emission),
+								  file_material.shininess});
+		material_textures.push_back(file_material.diffuse_texname.empty() ? std::filesystem::path()
+																		  : dir / file_material.diffuse_texname);
+	}
+	const unsigned int default_material = static_cast<unsigned int>(material_table.size());
+	material_table.push_back({DirectX::XMFLOAT3(0.1f, 0.1f, 0.1f), DirectX::XMFLOAT3(0.7f, 0.7f, 0.7f),
+							  DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f), DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f), 1.0f});
+	material_textures.emplace_back();
+
 	// Extract all vertices that in the file into global buffer
 	const size_t num_vertices = attrib.vertices.size() / 3;
 	std::vector<vertex> vertices(num_vertices);
@@ -46,53 +65,213 @@ void cg::world::model::load_obj(const std::filesystem::path& model_path)
 		current_vertex.position = DirectX::XMFLOAT3(&attrib.vertices.at(3 * i));
 	}
 
+	// Vertices transformed with a FIFO cache in file order and after reordering, over all shapes
+	double misses_before = 0.0;
+	double misses_after = 0.0;
+	size_t num_triangles = 0;
+
 	// Process each shape
 	for (auto & [name, mesh, lines, points] : shapes) {
 		// Pick vertices from global vertex buffer and add
 		// them to the local vertex buffer
-		// Save local index for index buffer remapping
+		// Save local index for index buffer remapping.
+		// Vertices are shared by faces only if position, normal and texture coordinates match,
+		// files without normals get flat face normals
 		std::vector<vertex> vertex_accumulator;
-		std::map<unsigned int, unsigned int> index_map{};
-		for (size_t i = 0; i != mesh.indices.size(); ++i) {
-			unsigned int index = mesh.indices[i].vertex_index;
-			if (index_map.count(index) == 0) {
-				const unsigned int local_index = static_cast<unsigned int>(vertex_accumulator.size());
-				vertex_accumulator.push_back(vertices[index]);
+		std::map<std::tuple<int, int, int>, unsigned int> index_map{};
+		std::map<std::tuple<int, int, int>, int> generated_normals{};
+		std::vector<unsigned int> local_indices(mesh.indices.size());
+		for (size_t face_idx = 0; face_idx != mesh.indices.size() / 3; ++face_idx) {
+			const tinyobj::index_t* face = &mesh.indices[3 * face_idx];
+
+			DirectX::XMFLOAT3 face_normal{0.0f, 0.0f, 0.0f};
+			int generated_normal_id = 0;
+			if (face[0].normal_index < 0 || face[1].normal_index < 0 || face[2].normal_index < 0) {
+				const DirectX::XMVECTOR a = DirectX::XMLoadFloat3(&vertices[face[0].vertex_index].position);
+				const DirectX::XMVECTOR b = DirectX::XMLoadFloat3(&vertices[face[1].vertex_index].position);
+				const DirectX::XMVECTOR c = DirectX::XMLoadFloat3(&vertices[face[2].vertex_index].position);
+				DirectX::XMStoreFloat3(&face_normal, DirectX::XMVector3Normalize(DirectX::XMVector3Cross(
+						DirectX::XMVectorSubtract(b, a), DirectX::XMVectorSubtract(c, a))));
+
+				// Faces of the same plane get exactly the same normal to share vertices
+				const std::tuple<int, int, int> quantized_normal{
+						static_cast<int>(std::round(face_normal.x * 1000.0f)),
+						static_cast<int>(std::round(face_normal.y * 1000.0f)),
+						static_cast<int>(std::round(face_normal.z * 1000.0f))};
+				generated_normal_id = generated_normals.emplace(
+						quantized_normal, static_cast<int>(generated_normals.size())).first->second;
+			}
+
+			for (size_t i = 0; i != 3; ++i) {
+				const tinyobj::index_t& index = face[i];
+				const int normal_key = index.normal_index >= 0 ? index.normal_index : -1 - generated_normal_id;
+				const std::tuple<int, int, int> key{index.vertex_index, normal_key, index.texcoord_index};
+
+				if (index_map.count(key) == 0) {
+					const unsigned int local_index = static_cast<unsigned int>(vertex_accumulator.size());
+					vertex_accumulator.push_back(vertices[index.vertex_index]);
 
-				vertex_accumulator.back().diffuse = DirectX::XMFLOAT3(materials[mesh.material_ids[i / 3]].diffuse);
-				vertex_accumulator.back().ambient = DirectX::XMFLOAT3(materials[mesh.material_ids[i / 3]].ambient);
-				vertex_accumulator.back().specular = DirectX::XMFLOAT3(materials[mesh.material_ids[i / 3]].specular);
-				vertex_accumulator.back().emissive = DirectX::XMFLOAT3(materials[mesh.material_ids[i / 3]].emission);
+					vertex_accumulator.back().normal = index.normal_index >= 0
+															   ? DirectX::XMFLOAT3(&attrib.normals.at(3 * index.normal_index))
+															   : face_normal;
 
-				vertex_accumulator.back().shininess = materials[mesh.material_ids[i / 3]].shininess;
+					// OBJ V axis points up, while image rows go from the top
+					if (index.texcoord_index >= 0) {
+						vertex_accumulator.back().uv = DirectX::XMFLOAT2(
+								attrib.texcoords.at(2 * index.texcoord_index),
+								1.0f - attrib.texcoords.at(2 * index.texcoord_index + 1));
+					}
 
-				index_map[index] = local_index;
+					index_map[key] = local_index;
+				}
+				local_indices[3 * face_idx + i] = index_map[key];
 			}
 		}
 
-		// Create index buffer using mapped index bindings
-		auto index_buffer = std::make_shared<resource<unsigned int>>(mesh.indices.size());
+		// Index buffer uses mapped index bindings, faces are in reversed order
+		std::vector<unsigned int> full_indices(mesh.indices.size());
 		for (size_t i = 0; i != mesh.indices.size(); ++i) {
-			index_buffer->item(i) = index_map[mesh.indices[mesh.indices.size() - i - 1].vertex_index];
+			full_indices[i] = local_indices[mesh.indices.size() - i - 1];
+		}
+		std::vector<unsigned int> full_materials(mesh.indices.size() / 3);
+		for (size_t i = 0; i != full_materials.size(); ++i) {
+			const int material_id = mesh.material_ids[full_materials.size() - i - 1];
+			full_materials[i] = material_id >= 0 ? static_cast<unsigned int>(material_id) : default_material;
 		}
 
-		// Create vertex buffer with local only vertices
-		auto vertex_buffer = std::make_shared<resource<vertex>>(vertex_accumulator.size());
+		// Simplified LODs reuse the vertex buffer, only index buffers are added.
+		// Triangles of every LOD are reordered into meshlets, the first LOD is the full detail one
+		std::vector<DirectX::XMFLOAT3> positions(vertex_accumulator.size());
 		for (size_t i = 0; i != vertex_accumulator.size(); ++i) {
-			vertex_buffer->item(i) = vertex_accumulator[i];
+			positions[i] = vertex_accumulator[i].position;
+		}
+		std::vector<mesh_simplification::level> levels =
+				mesh_simplification::build_lod_chain(positions, full_indices, full_materials, max_lod_count - 1);
+		levels.insert(levels.begin(), {full_indices, full_materials, 0.0f});
+
+		// Triangles of a meshlet are ordered for the vertex cache, meshlets are ordered against overdraw
+		std::vector<std::shared_ptr<meshlet_list>> level_meshlets;
+		for (mesh_simplification::level& level : levels) {
+			level_meshlets.push_back(std::make_shared<meshlet_list>(
+					build_meshlets(positions, level.indices, level.face_materials)));
+			for (const meshlet& m : level_meshlets.back()->meshlets) {
+				index_optimization::optimize_vertex_cache(level.indices, level.face_materials, m.first_index, m.num_indices);
+			}
+			index_optimization::order_meshlets_for_overdraw(level.indices, level.face_materials, *level_meshlets.back());
+		}
+		num_triangles += full_indices.size() / 3;
+		misses_before += index_optimization::compute_acmr(full_indices) * static_cast<double>(full_indices.size() / 3);
+		misses_after += index_optimization::compute_acmr(levels.front().indices) *
+						static_cast<double>(full_indices.size() / 3);
+
+		// Vertices are stored in order of the first use by the full detail LOD
+		const std::vector<unsigned int> remap =
+				index_optimization::build_vertex_fetch_remap(levels.front().indices, vertex_accumulator.size());
+		for (size_t l = 0; l != levels.size(); ++l) {
+			for (unsigned int& index : levels[l].indices) {
+				index = remap[index];
+			}
+			for (unsigned int& index : level_meshlets[l]->vertices) {
+				index = remap[index];
+			}
+		}
+
+		bounding_boxes.emplace_back(DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f), DirectX::XMFLOAT3(0.0f, 0.0f, 0.0f));
+		if (!vertex_accumulator.empty()) {
+			DirectX::BoundingBox::CreateFromPoints(bounding_boxes.back(), vertex_accumulator.size(),
+												   &vertex_accumulator.front().position, sizeof(vertex));
+		}
+		const DirectX::BoundingBox& box = bounding_boxes.back();
+		vertex_quantizations.push_back(
+				{DirectX::XMFLOAT3(box.Center.x - box.Extents.x, box.Center.y - box.Extents.y, box.Center.z - box.Extents.z),
+				 DirectX::XMFLOAT3(2.0f * box.Extents.x, 2.0f * box.Extents.y, 2.0f * box.Extents.z)});
+
+		// Create vertex buffer with local only vertices
+		if (compact_vertices) {
+			auto compact_vertex_buffer = std::make_shared<resource<compact_vertex>>(vertex_accumulator.size());
+			for (size_t i = 0; i != vertex_accumulator.size(); ++i) {
+				compact_vertex_buffer->item(remap[i]) = compact_vertex::encode(vertex_accumulator[i], vertex_quantizations.back());
+			}
+			compact_vertex_buffers.emplace_back(compact_vertex_buffer);
+		}
+		else {
+			auto positions_stream = std::make_shared<resource<DirectX::XMFLOAT3>>(vertex_accumulator.size());
+			auto normals_stream = std::make_shared<resource<DirectX::XMFLOAT3>>(vertex_accumulator.size());
+			auto uvs_stream = std::make_shared<resource<DirectX::XMFLOAT2>>(vertex_accumulator.size());
+			for (size_t i = 0; i != vertex_accumulator.size(); ++i) {
+				positions_stream->item(remap[i]) = vertex_accumulator[i].position;
+				normals_stream->item(remap[i]) = vertex_accumulator[i].normal;
+				uvs_stream->item(remap[i]) = vertex_accumulator[i].uv;
+			}
+			position_streams.emplace_back(positions_stream);
+			normal_streams.emplace_back(normals_stream);
+			uv_streams.emplace_back(uvs_stream);
 		}
 
-		vertex_buffers.emplace_back(vertex_buffer);
-		index_buffers.emplace_back(index_buffer);
+		lods.emplace_back();
+		for (size_t l = 0; l != levels.size(); ++l) {
+			const mesh_simplification::level& level = levels[l];
+			const std::shared_ptr<meshlet_list>& meshlets = level_meshlets[l];
+			auto lod_index_buffer = std::make_shared<resource<unsigned int>>(level.indices.size());
+			for (size_t i = 0; i != level.indices.size(); ++i) {
+				lod_index_buffer->item(i) = level.indices[i];
+			}
+			auto lod_face_materials = std::make_shared<resource<unsigned int>>(level.face_materials.size());
+			for (size_t i = 0; i != level.face_materials.size(); ++i) {
+				lod_face_materials->item(i) = level.face_materials[i];
+			}
+			lods.back().push_back({lod_index_buffer, level.error, meshlets, lod_face_materials});
+		}
+
+		index_buffers.emplace_back(lods.back().front().index_buffer);
+		face_materials.emplace_back(lods.back().front().face_materials);
+	}
+
+	if (num_triangles != 0) {
+		std::cout << "Vertex cache: ACMR " << misses_before / static_cast<double>(num_triangles) << " in file order, "
+				  << misses_after / static_cast<double>(num_triangles) << " after reordering" << std::endl;
 	}
 }
 
 
-const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>&
-cg::world::model::get_vertex_buffers() const
+bool cg::world::model::has_compact_vertices() const
 {
-	//THROW_ERROR("Not implemented yet");
-	return vertex_buffers;
+	return !compact_vertex_buffers.empty();
+}
+
+const std::vector<std::shared_ptr<cg::resource<DirectX::XMFLOAT3>>>&
+cg::world::model::get_position_streams() const
+{
+	return position_streams;
+}
+
+const std::vector<std::shared_ptr<cg::resource<DirectX::XMFLOAT3>>>&
+cg::world::model::get_normal_streams() const
+{
+	return normal_streams;
+}
+
+const std::vector<std::shared_ptr<cg::resource<DirectX::XMFLOAT2>>>&
+cg::world::model::get_uv_streams() const
+{
+	return uv_streams;
+}
+
+cg::vertex_streams cg::world::model::get_vertex_streams(size_t shape) const
+{
+	return {position_streams.at(shape), normal_streams.at(shape), uv_streams.at(shape)};
+}
+
+const std::vector<std::shared_ptr<cg::resource<cg::compact_vertex>>>&
+cg::world::model::get_compact_vertex_buffers() const
+{
+	return compact_vertex_buffers;
+}
+
+const std::vector<cg::vertex_quantization>&
+cg::world::model::get_per_shape_vertex_quantizations() const
+{
+	return vertex_quantizations;
 }
 
 
@@ -103,10 +282,45 @@ cg::world::model::get_index_buffers() const
 	return index_buffers;
 }
 
-std::vector<std::filesystem::path>
-cg::world::model::get_per_shape_texture_files() const
+const std::vector<cg::material>&
+cg::world::model::get_materials() const
 {
-	THROW_ERROR("Not implemented yet");
+	return material_table;
+}
+
+const std::vector<std::shared_ptr<cg::resource<unsigned int>>>&
+cg::world::model::get_per_shape_face_materials() const
+{
+	return face_materials;
+}
+
+const std::vector<std::filesystem::path>&
+cg::world::model::get_material_texture_files() const
+{
+	return material_textures;
+}
+
+const std::vector<DirectX::BoundingBox>&
+cg::world::model::get_per_shape_bounding_boxes() const
+{
+	return bounding_boxes;
+}
+
+const std::vector<std::vector<mesh_lod>>&
+cg::world::model::get_per_shape_lods() const
+{
+	return lods;
+}
+
+size_t cg::world::model::select_lod(size_t shape, float max_error) const
+{
+	// Errors grow along the chain
+	const std::vector<mesh_lod>& chain = lods.at(shape);
+	size_t lod = 0;
+	while (lod + 1 != chain.size() && chain[lod + 1].error <= max_error) {
+		++lod;
+	}
+	return lod;
 }
 
 
@@ -1,29 +1,69 @@
 #pragma once
 
 #include "resource.h"
+#include "world/meshlet.h"
 
 #include <filesystem>
 #include <linalg.h>
 #include <tiny_obj_loader.h>
+#include "DirectXCollision.h"
 #include "DirectXMath.h"
 
 using namespace linalg::aliases;
 
 namespace cg::world
 {
+	// Simplified version of a shape, it indexes the vertex buffer of the shape.
+	// Error is the largest distance from the full detail surface in object space.
+	// Triangles of the index buffer are grouped into meshlets, every triangle has an id in the material table
+	struct mesh_lod
+	{
+		std::shared_ptr<cg::resource<unsigned int>> index_buffer;
+		float error;
+		std::shared_ptr<meshlet_list> meshlets;
+		std::shared_ptr<cg::resource<unsigned int>> face_materials;
+	};
+
 	class model
 	{
 	public:
 		model();
 		virtual ~model();
 
-		void load_obj(const std::filesystem::path& model_path);
+		// Compact vertices are quantized in the bounding box of their shape,
+		// full precision vertex streams are not kept then
+		void load_obj(const std::filesystem::path& model_path, bool compact_vertices = false);
 
-		const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>& get_vertex_buffers() const;
+		bool has_compact_vertices() const;
+
+		// Full precision vertex attributes of every shape, one array per attribute.
+		// Material ids are stored per face, see get_per_shape_face_materials
+		const std::vector<std::shared_ptr<cg::resource<DirectX::XMFLOAT3>>>& get_position_streams() const;
+		const std::vector<std::shared_ptr<cg::resource<DirectX::XMFLOAT3>>>& get_normal_streams() const;
+		const std::vector<std::shared_ptr<cg::resource<DirectX::XMFLOAT2>>>& get_uv_streams() const;
+		cg::vertex_streams get_vertex_streams(size_t shape) const;
+
+		const std::vector<std::shared_ptr<cg::resource<cg::compact_vertex>>>& get_compact_vertex_buffers() const;
+		// Decoding parameters of compact vertices for every shape
+		const std::vector<cg::vertex_quantization>& get_per_shape_vertex_quantizations() const;
 
 		const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& get_index_buffers() const;
 
-		std::vector<std::filesystem::path> get_per_shape_texture_files() const;
+		// Materials of the file, the last one is used by faces without material
+		const std::vector<cg::material>& get_materials() const;
+		// Material id of every triangle of index buffers
+		const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& get_per_shape_face_materials() const;
+
+		// Diffuse texture path of every material, empty if the material has no texture
+		const std::vector<std::filesystem::path>& get_material_texture_files() const;
+
+		// Object space bounds of every shape, computed at load time
+		const std::vector<DirectX::BoundingBox>& get_per_shape_bounding_boxes() const;
+
+		// LOD chain of every shape from the full detail index buffer to the coarsest one
+		const std::vector<std::vector<mesh_lod>>& get_per_shape_lods() const;
+		// Index of the coarsest LOD of the shape with error not larger than max_error
+		size_t select_lod(size_t shape, float max_error) const;
 
 		const DirectX::XMMATRIX get_world_matrix() const;
 
@@ -32,10 +72,23 @@ namespace cg::world
 		std::vector<tinyobj::shape_t> shapes;
 		std::vector<tinyobj::material_t> materials;
 
-		std::vector<std::shared_ptr<cg::resource<cg::vertex>>> vertex_buffers;
+		std::vector<std::shared_ptr<cg::resource<DirectX::XMFLOAT3>>> position_streams;
+		std::vector<std::shared_ptr<cg::resource<DirectX::XMFLOAT3>>> normal_streams;
+		std::vector<std::shared_ptr<cg::resource<DirectX::XMFLOAT2>>> uv_streams;
+
+		std::vector<std::shared_ptr<cg::resource<cg::compact_vertex>>> compact_vertex_buffers;
+		std::vector<cg::vertex_quantization> vertex_quantizations;
 
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 
-		std::vector<std::filesystem::path> textures;
+		std::vector<cg::material> material_table;
+		std::vector<std::shared_ptr<cg::resource<unsigned int>>> face_materials;
+		std::vector<std::filesystem::path> material_textures;
+
+		std::vector<DirectX::BoundingBox> bounding_boxes;
+
+		// Every next LOD has about half of the triangles
+		static constexpr size_t max_lod_count = 8;
+		std::vector<std::vector<mesh_lod>> lods;
 	};
 }// namespace cg::world
\ No newline at end of file
@@ -0,0 +1,264 @@
+#include "texture.h"
+
+#include "utils/error_handler.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+using namespace cg::world;
+
+cg::world::texture::texture(size_t in_width, size_t in_height, const unsigned char* rgba_data,
+							texture_format in_format) : format(in_format)
+{
+	if (in_width == 0 || in_height == 0) {
+		THROW_ERROR("Texture can't be empty");
+	}
+
+	std::vector<texel> current(in_width * in_height);
+	std::copy(rgba_data, rgba_data + current.size() * sizeof(texel), reinterpret_cast<unsigned char*>(current.data()));
+	mips.push_back(make_mip_level(in_width, in_height, current));
+
+	// Every next level is a 2x2 box filtered copy of the previous one, down to 1x1
+	size_t width = in_width;
+	size_t height = in_height;
+	while (width > 1 || height > 1) {
+		const size_t next_width = std::max<size_t>(width / 2, 1);
+		const size_t next_height = std::max<size_t>(height / 2, 1);
+
+		std::vector<texel> next(next_width * next_height);
+		for (size_t y = 0; y != next_height; ++y) {
+			for (size_t x = 0; x != next_width; ++x) {
+				const size_t x0 = std::min(2 * x, width - 1);
+				const size_t x1 = std::min(2 * x + 1, width - 1);
+				const size_t y0 = std::min(2 * y, height - 1);
+				const size_t y1 = std::min(2 * y + 1, height - 1);
+				const texel& a = current[y0 * width + x0];
+				const texel& b = current[y0 * width + x1];
+				const texel& c = current[y1 * width + x0];
+				const texel& d = current[y1 * width + x1];
+				next[y * next_width + x] = {
+						static_cast<unsigned char>((a.r + b.r + c.r + d.r + 2) / 4),
+						static_cast<unsigned char>((a.g + b.g + c.g + d.g + 2) / 4),
+						static_cast<unsigned char>((a.b + b.b + c.b + d.b + 2) / 4),
+						static_cast<unsigned char>((a.a + b.a + c.a + d.a + 2) / 4)};
+			}
+		}
+
+		mips.push_back(make_mip_level(next_width, next_height, next));
+		current.swap(next);
+		width = next_width;
+		height = next_height;
+	}
+}
+
+cg::world::texture::~texture() {}
+
+texture_format cg::world::texture::get_format() const
+{
+	return format;
+}
+
+size_t cg::world::texture::get_width(size_t mip) const
+{
+	return mips.at(mip).width;
+}
+
+size_t cg::world::texture::get_height(size_t mip) const
+{
+	return mips.at(mip).height;
+}
+
+size_t cg::world::texture::get_mip_count() const
+{
+	return mips.size();
+}
+
+size_t cg::world::texture::get_size_in_bytes() const
+{
+	size_t size = 0;
+	for (const mip_level& level: mips) {
+		size += level.texels ? level.texels->get_size_in_bytes() : level.blocks->get_size_in_bytes();
+	}
+	return size;
+}
+
+texel cg::world::texture::load(size_t x, size_t y, size_t mip) const
+{
+	const mip_level& level = mips.at(mip);
+	if (level.texels) {
+		return level.texels->item(get_texel_index(level, x, y));
+	}
+
+	DirectX::XMFLOAT4 value;
+	DirectX::XMStoreFloat4(&value, DirectX::XMVectorScale(fetch(level, x, y), 255.0f));
+	return {static_cast<unsigned char>(value.x + 0.5f), static_cast<unsigned char>(value.y + 0.5f),
+			static_cast<unsigned char>(value.z + 0.5f), static_cast<unsigned char>(value.w + 0.5f)};
+}
+
+float cg::world::texture::compute_lod(const DirectX::XMFLOAT2& ddx_uv, const DirectX::XMFLOAT2& ddy_uv) const
+{
+	// Footprint of a pixel in texels of the most detailed level
+	const float width = static_cast<float>(mips.front().width);
+	const float height = static_cast<float>(mips.front().height);
+	const float ddx_length = std::hypot(ddx_uv.x * width, ddx_uv.y * height);
+	const float ddy_length = std::hypot(ddy_uv.x * width, ddy_uv.y * height);
+	const float footprint = std::max(ddx_length, ddy_length);
+	if (footprint <= 1.0f) {
+		return 0.0f;
+	}
+	return std::min(std::log2(footprint), static_cast<float>(mips.size() - 1));
+}
+
+DirectX::XMVECTOR cg::world::texture::sample_level(const DirectX::XMFLOAT2& uv, float lod) const
+{
+	// NaN comes from degenerate derivatives, the most detailed level is used then
+	lod = std::isnan(lod) ? 0.0f : std::clamp(lod, 0.0f, static_cast<float>(mips.size() - 1));
+	const size_t mip = static_cast<size_t>(lod);
+	const float fraction = lod - static_cast<float>(mip);
+
+	const DirectX::XMVECTOR result = sample_bilinear(mips[mip], uv);
+	if (fraction == 0.0f || mip + 1 == mips.size()) {
+		return result;
+	}
+	return DirectX::XMVectorLerp(result, sample_bilinear(mips[mip + 1], uv), fraction);
+}
+
+DirectX::XMVECTOR cg::world::texture::sample_grad(const DirectX::XMFLOAT2& uv,
+												  const DirectX::XMFLOAT2& ddx_uv,
+												  const DirectX::XMFLOAT2& ddy_uv) const
+{
+	return sample_level(uv, compute_lod(ddx_uv, ddy_uv));
+}
+
+size_t cg::world::texture::get_texel_index(const mip_level& level, size_t x, size_t y)
+{
+	// Spread 3 bits of a tile local coordinate to even bit positions
+	auto part_by_1 = [](size_t value) {
+		value = (value | (value << 2)) & 0x33;
+		value = (value | (value << 1)) & 0x55;
+		return value;
+	};
+
+	const size_t tile_index = (y / tile_size) * level.tiles_x + x / tile_size;
+	const size_t morton_index = part_by_1(x % tile_size) | (part_by_1(y % tile_size) << 1);
+	return tile_index * tile_size * tile_size + morton_index;
+}
+
+texture::mip_level cg::world::texture::make_mip_level(size_t width, size_t height, const std::vector<texel>& row_major) const
+{
+	mip_level level;
+	level.width = width;
+	level.height = height;
+	level.tiles_x = (width + tile_size - 1) / tile_size;
+	level.blocks_x = (width + block_compression::block_dimension - 1) / block_compression::block_dimension;
+
+	if (format != texture_format::rgba8) {
+		// Partial blocks at the borders repeat the edge texels
+		const size_t block_size = block_compression::get_block_size(format);
+		const size_t blocks_y = (height + block_compression::block_dimension - 1) / block_compression::block_dimension;
+		level.blocks = std::make_shared<cg::resource<unsigned char>>(level.blocks_x * blocks_y * block_size);
+		for (size_t block_y = 0; block_y != blocks_y; ++block_y) {
+			for (size_t block_x = 0; block_x != level.blocks_x; ++block_x) {
+				texel block[16];
+				for (size_t i = 0; i != 16; ++i) {
+					const size_t x = std::min(block_x * 4 + i % 4, width - 1);
+					const size_t y = std::min(block_y * 4 + i / 4, height - 1);
+					block[i] = row_major[y * width + x];
+				}
+				block_compression::encode_block(format, reinterpret_cast<const unsigned char*>(block),
+												&level.blocks->item((block_y * level.blocks_x + block_x) * block_size));
+			}
+		}
+		return level;
+	}
+
+	// Partial tiles at the right and bottom borders are padded
+	const size_t tiles_y = (height + tile_size - 1) / tile_size;
+	level.texels = std::make_shared<cg::resource<texel>>(level.tiles_x * tiles_y * tile_size * tile_size);
+	for (size_t y = 0; y != height; ++y) {
+		for (size_t x = 0; x != width; ++x) {
+			level.texels->item(get_texel_index(level, x, y)) = row_major[y * width + x];
+		}
+	}
+	return level;
+}
+
+DirectX::XMVECTOR cg::world::texture::sample_bilinear(const mip_level& level, const DirectX::XMFLOAT2& uv) const
+{
+	// Texel centers are at half-integer coordinates
+	const float x = uv.x * static_cast<float>(level.width) - 0.5f;
+	const float y = uv.y * static_cast<float>(level.height) - 0.5f;
+	const float x_floor = std::floor(x);
+	const float y_floor = std::floor(y);
+	const float x_fraction = std::isfinite(x) ? x - x_floor : 0.0f;
+	const float y_fraction = std::isfinite(y) ? y - y_floor : 0.0f;
+
+	// Wrap addressing. Coordinates are folded into the texture before conversion to integers,
+	// NaN and infinite ones from broken texture coordinates read the first texel
+	auto wrap = [](float coordinate, size_t size) {
+		if (!std::isfinite(coordinate)) {
+			return size_t{0};
+		}
+		float value = std::fmod(coordinate, static_cast<float>(size));
+		if (value < 0.0f) {
+			value += static_cast<float>(size);
+		}
+		return std::min(static_cast<size_t>(value), size - 1);
+	};
+	const size_t texel_x[2] = {wrap(x_floor, level.width), wrap(x_floor + 1.0f, level.width)};
+	const size_t texel_y[2] = {wrap(y_floor, level.height), wrap(y_floor + 1.0f, level.height)};
+
+	DirectX::XMVECTOR texels[4];
+	fetch_footprint(level, texel_x, texel_y, texels);
+	const DirectX::XMVECTOR top = DirectX::XMVectorLerp(texels[0], texels[1], x_fraction);
+	const DirectX::XMVECTOR bottom = DirectX::XMVectorLerp(texels[2], texels[3], x_fraction);
+	return DirectX::XMVectorLerp(top, bottom, y_fraction);
+}
+
+void cg::world::texture::fetch_footprint(const mip_level& level, const size_t* x, const size_t* y,
+										 DirectX::XMVECTOR* output) const
+{
+	if (level.texels) {
+		for (size_t i = 0; i != 4; ++i) {
+			output[i] = fetch(level, x[i % 2], y[i / 2]);
+		}
+		return;
+	}
+
+	// Footprint covers one to four blocks, each of them is decoded once
+	const size_t block_size = block_compression::get_block_size(format);
+	size_t block_indices[4];
+	DirectX::XMVECTOR decoded[4][16];
+	size_t num_decoded = 0;
+	for (size_t i = 0; i != 4; ++i) {
+		const size_t texel_x = x[i % 2];
+		const size_t texel_y = y[i / 2];
+		const size_t block_index = (texel_y / block_compression::block_dimension) * level.blocks_x +
+								   texel_x / block_compression::block_dimension;
+		size_t slot = 0;
+		while (slot != num_decoded && block_indices[slot] != block_index) {
+			++slot;
+		}
+		if (slot == num_decoded) {
+			block_compression::decode_block(format, &level.blocks->item(block_index * block_size), decoded[slot]);
+			block_indices[num_decoded++] = block_index;
+		}
+		output[i] = decoded[slot][(texel_y % block_compression::block_dimension) * block_compression::block_dimension +
+								  texel_x % block_compression::block_dimension];
+	}
+}
+
+DirectX::XMVECTOR cg::world::texture::fetch(const mip_level& level, size_t x, size_t y) const
+{
+	if (level.texels) {
+		const texel& value = level.texels->item(get_texel_index(level, x, y));
+		return DirectX::XMVectorScale(DirectX::XMVectorSet(value.r, value.g, value.b, value.a), 1.0f / 255.0f);
+	}
+
+	const size_t block_size = block_compression::get_block_size(format);
+	const size_t block_index = (y / block_compression::block_dimension) * level.blocks_x + x / block_compression::block_dimension;
+	const size_t texel_index = (y % block_compression::block_dimension) * block_compression::block_dimension +
+							   x % block_compression::block_dimension;
+	return block_compression::decode_texel(format, &level.blocks->item(block_index * block_size), texel_index);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "resource.h"
+#include "world/block_compression.h"
+
+#include <DirectXMath.h>
+#include <memory>
+#include <vector>
+
+
+namespace cg::world
+{
+	struct texel
+	{
+		unsigned char r;
+		unsigned char g;
+		unsigned char b;
+		unsigned char a;
+	};
+
+	// Mip-mapped RGBA texture. Every mip level is split into 8x8 tiles stored
+	// one after another, texels inside a tile are in Morton (Z-order) layout.
+	// This way texels close in 2D are close in memory for any sampling direction.
+	// Block compressed textures keep 4x4 blocks in row-major order, a bilinear
+	// sample decodes every block under its 2x2 texel footprint once
+	class texture
+	{
+	public:
+		// Builds full mip chain from row-major RGBA8 data, every level is compressed to in_format
+		texture(size_t in_width, size_t in_height, const unsigned char* rgba_data,
+				texture_format in_format = texture_format::rgba8);
+		virtual ~texture();
+
+		texture_format get_format() const;
+
+		size_t get_width(size_t mip = 0) const;
+		size_t get_height(size_t mip = 0) const;
+		size_t get_mip_count() const;
+		// Memory used by all mip levels
+		size_t get_size_in_bytes() const;
+
+		texel load(size_t x, size_t y, size_t mip = 0) const;
+
+		// Mip level matching screen space derivatives of texture coordinates
+		float compute_lod(const DirectX::XMFLOAT2& ddx_uv, const DirectX::XMFLOAT2& ddy_uv) const;
+
+		// Trilinear filtering with wrap addressing, result is RGBA in [0, 1]
+		DirectX::XMVECTOR sample_level(const DirectX::XMFLOAT2& uv, float lod) const;
+		DirectX::XMVECTOR sample_grad(const DirectX::XMFLOAT2& uv,
+									  const DirectX::XMFLOAT2& ddx_uv,
+									  const DirectX::XMFLOAT2& ddy_uv) const;
+
+	protected:
+		static constexpr size_t tile_size = 8;
+
+		struct mip_level
+		{
+			size_t width;
+			size_t height;
+			size_t tiles_x;
+			std::shared_ptr<cg::resource<texel>> texels;
+			// Used instead of texels by block compressed formats
+			size_t blocks_x;
+			std::shared_ptr<cg::resource<unsigned char>> blocks;
+		};
+
+		texture_format format;
+		std::vector<mip_level> mips;
+
+		static size_t get_texel_index(const mip_level& level, size_t x, size_t y);
+		mip_level make_mip_level(size_t width, size_t height, const std::vector<texel>& row_major) const;
+		DirectX::XMVECTOR fetch(const mip_level& level, size_t x, size_t y) const;
+		// Texels at (x[0], y[0]), (x[1], y[0]), (x[0], y[1]) and (x[1], y[1])
+		void fetch_footprint(const mip_level& level, const size_t* x, const size_t* y, DirectX::XMVECTOR* output) const;
+		DirectX::XMVECTOR sample_bilinear(const mip_level& level, const DirectX::XMFLOAT2& uv) const;
+	};
+}// namespace cg::world
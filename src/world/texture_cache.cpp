@@ -0,0 +1,200 @@
+#include "texture_cache.h"
+
+#include "utils/resource_utils.h"
+
+#include <algorithm>
+#include <iostream>
+
+
+using namespace cg::world;
+
+cg::world::texture_cache::texture_cache(size_t in_budget_in_bytes, texture_format in_format, size_t num_threads)
+	: budget_in_bytes(in_budget_in_bytes), format(in_format)
+{
+	if (num_threads == 0) {
+		num_threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+	}
+	for (size_t i = 0; i != num_threads; ++i) {
+		workers.emplace_back(&texture_cache::worker_loop, this);
+	}
+}
+
+cg::world::texture_cache::~texture_cache()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	queue_condition.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+}
+
+size_t cg::world::texture_cache::add_texture(const std::filesystem::path& filepath)
+{
+	if (filepath.empty()) {
+		return no_texture;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (size_t i = 0; i != entries.size(); ++i) {
+		if (entries[i]->filepath == filepath) {
+			return i;
+		}
+	}
+	entries.push_back(std::make_unique<entry>());
+	entries.back()->filepath = filepath;
+	return entries.size() - 1;
+}
+
+DirectX::XMVECTOR cg::world::texture_cache::sample_grad(size_t texture_id,
+														const DirectX::XMFLOAT2& uv,
+														const DirectX::XMFLOAT2& ddx_uv,
+														const DirectX::XMFLOAT2& ddy_uv) const
+{
+	if (texture_id == no_texture) {
+		return DirectX::XMVectorSplatOne();
+	}
+
+	entry& current = *entries[texture_id];
+	const size_t current_frame = frame.load(std::memory_order_relaxed);
+	if (current.last_use.load(std::memory_order_relaxed) != current_frame) {
+		current.last_use.store(current_frame, std::memory_order_relaxed);
+	}
+
+	if (const std::shared_ptr<texture> decoded = std::atomic_load(&current.decoded)) {
+		return decoded->sample_grad(uv, ddx_uv, ddy_uv);
+	}
+
+	missed.store(true, std::memory_order_relaxed);
+	request(texture_id);
+
+	if (const std::shared_ptr<texture> fallback = std::atomic_load(&current.fallback)) {
+		return fallback->sample_level(uv, 0.0f);
+	}
+	return DirectX::XMVectorSplatOne();
+}
+
+void cg::world::texture_cache::begin_frame()
+{
+	frame.fetch_add(1);
+	missed.store(false);
+}
+
+bool cg::world::texture_cache::has_misses() const
+{
+	return missed.load();
+}
+
+void cg::world::texture_cache::wait_idle()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	idle_condition.wait(lock, [this]() { return queue.empty() && num_busy_workers == 0; });
+}
+
+size_t cg::world::texture_cache::get_size_in_bytes() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return size_in_bytes;
+}
+
+void cg::world::texture_cache::request(size_t texture_id) const
+{
+	// Only the first sampling thread enqueues the texture
+	if (entries[texture_id]->requested.exchange(true)) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(texture_id);
+	}
+	queue_condition.notify_one();
+}
+
+void cg::world::texture_cache::worker_loop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		queue_condition.wait(lock, [this]() { return stopping || !queue.empty(); });
+		if (stopping) {
+			return;
+		}
+
+		const size_t texture_id = queue.front();
+		queue.pop_front();
+		++num_busy_workers;
+		entry& current = *entries[texture_id];
+
+		// Decoding is done without the lock
+		lock.unlock();
+		std::shared_ptr<texture> decoded;
+		try {
+			decoded = utils::load_texture(current.filepath, format);
+		}
+		catch (std::exception& e) {
+			std::cerr << "Warning: " << e.what() << std::endl;
+		}
+		if (decoded && !std::atomic_load(&current.fallback)) {
+			std::atomic_store(&current.fallback, make_fallback(*decoded));
+		}
+		lock.lock();
+
+		// Failed textures stay requested, so they are not decoded again
+		if (decoded) {
+			std::atomic_store(&current.decoded, decoded);
+			size_in_bytes += decoded->get_size_in_bytes();
+			evict(texture_id);
+		}
+
+		--num_busy_workers;
+		if (queue.empty() && num_busy_workers == 0) {
+			idle_condition.notify_all();
+		}
+	}
+}
+
+void cg::world::texture_cache::evict(size_t keep_texture_id)
+{
+	// Called under the lock. Samplers holding evicted texture keep it alive until they finish.
+	// Textures of the current frame would miss again when the frame is rendered once more
+	const size_t current_frame = frame.load();
+	while (size_in_bytes > budget_in_bytes) {
+		size_t victim = no_texture;
+		for (size_t i = 0; i != entries.size(); ++i) {
+			if (i == keep_texture_id || !std::atomic_load(&entries[i]->decoded) ||
+				entries[i]->last_use.load() == current_frame) {
+				continue;
+			}
+			if (victim == no_texture || entries[i]->last_use.load() < entries[victim]->last_use.load()) {
+				victim = i;
+			}
+		}
+		if (victim == no_texture) {
+			return;
+		}
+
+		entry& evicted = *entries[victim];
+		size_in_bytes -= std::atomic_load(&evicted.decoded)->get_size_in_bytes();
+		std::atomic_store(&evicted.decoded, std::shared_ptr<texture>());
+		evicted.requested.store(false);
+	}
+}
+
+std::shared_ptr<texture> cg::world::texture_cache::make_fallback(const texture& source)
+{
+	size_t mip = 0;
+	while (source.get_width(mip) > fallback_size || source.get_height(mip) > fallback_size) {
+		++mip;
+	}
+
+	const size_t width = source.get_width(mip);
+	const size_t height = source.get_height(mip);
+	std::vector<texel> texels(width * height);
+	for (size_t y = 0; y != height; ++y) {
+		for (size_t x = 0; x != width; ++x) {
+			texels[y * width + x] = source.load(x, y, mip);
+		}
+	}
+	return std::make_shared<texture>(width, height, reinterpret_cast<const unsigned char*>(texels.data()));
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "world/texture.h"
+
+#include <DirectXMath.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace cg::world
+{
+	// Decodes textures on background threads the first time they are sampled.
+	// Decoded textures are kept within a memory budget, least recently used ones
+	// are evicted first. Textures sampled in the current frame are never evicted,
+	// the budget is exceeded if they don't fit together.
+	// The image decoder can't decode single tiles or mip levels, so a whole file is decoded at once.
+	// Until that is done, the low resolution copy from the previous decoding is sampled,
+	// or white if the texture was never decoded. Renderers wait for decoding and draw
+	// the frame again when has_misses() reports such samples
+	class texture_cache
+	{
+	public:
+		static constexpr size_t no_texture = static_cast<size_t>(-1);
+
+		texture_cache(size_t in_budget_in_bytes, texture_format in_format = texture_format::rgba8, size_t num_threads = 0);
+		virtual ~texture_cache();
+
+		// Registers a texture file without decoding it, same paths share an id.
+		// Empty path gives no_texture
+		size_t add_texture(const std::filesystem::path& filepath);
+
+		// Thread safe, never blocks on decoding
+		DirectX::XMVECTOR sample_grad(size_t texture_id,
+									  const DirectX::XMFLOAT2& uv,
+									  const DirectX::XMFLOAT2& ddx_uv,
+									  const DirectX::XMFLOAT2& ddy_uv) const;
+
+		// Frame counter drives LRU eviction and miss statistics
+		void begin_frame();
+		// True if a texture was sampled before it was decoded in the current frame
+		bool has_misses() const;
+		// Blocks until all requested textures are decoded
+		void wait_idle();
+
+		size_t get_size_in_bytes() const;
+
+	protected:
+		// Largest size of the low resolution copy kept after eviction
+		static constexpr size_t fallback_size = 16;
+
+		struct entry
+		{
+			std::filesystem::path filepath;
+			// Accessed with std::atomic_load and std::atomic_store
+			std::shared_ptr<texture> decoded;
+			std::shared_ptr<texture> fallback;
+			std::atomic<bool> requested{false};
+			std::atomic<size_t> last_use{0};
+		};
+
+		size_t budget_in_bytes;
+		// Storage format of decoded textures, fallback copies are always RGBA8
+		texture_format format;
+		size_t size_in_bytes = 0;
+		std::atomic<size_t> frame{0};
+		mutable std::atomic<bool> missed{false};
+
+		std::vector<std::unique_ptr<entry>> entries;
+
+		mutable std::mutex mutex;
+		mutable std::condition_variable queue_condition;
+		std::condition_variable idle_condition;
+		mutable std::deque<size_t> queue;
+		size_t num_busy_workers = 0;
+		bool stopping = false;
+		std::vector<std::thread> workers;
+
+		void request(size_t texture_id) const;
+		void worker_loop();
+		// Evicts textures not used in the current frame until the budget is met
+		void evict(size_t keep_texture_id);
+		static std::shared_ptr<texture> make_fallback(const texture& source);
+	};
+}// namespace cg::world
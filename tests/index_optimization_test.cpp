@@ -0,0 +1,82 @@
+#include "world/index_optimization.h"
+#include "world/meshlet.h"
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+
+namespace
+{
+	// UV sphere around the origin. Faces are wound clockwise seen from outside like faces of loaded models,
+	// or from inside if the sphere faces its center
+	void add_sphere(std::vector<DirectX::XMFLOAT3>& positions, std::vector<unsigned int>& indices, float radius,
+					bool facing_center)
+	{
+		constexpr unsigned int rings = 24;
+		constexpr unsigned int segments = 48;
+		const unsigned int first_vertex = static_cast<unsigned int>(positions.size());
+		for (unsigned int ring = 0; ring <= rings; ++ring) {
+			const float theta = DirectX::XM_PI * static_cast<float>(ring) / rings;
+			for (unsigned int segment = 0; segment <= segments; ++segment) {
+				const float phi = DirectX::XM_2PI * static_cast<float>(segment) / segments;
+				positions.push_back({radius * std::sin(theta) * std::cos(phi), radius * std::cos(theta),
+									 radius * std::sin(theta) * std::sin(phi)});
+			}
+		}
+		for (unsigned int ring = 0; ring != rings; ++ring) {
+			for (unsigned int segment = 0; segment != segments; ++segment) {
+				const unsigned int a = first_vertex + ring * (segments + 1) + segment;
+				const unsigned int b = a + segments + 1;
+				// Counter-clockwise from outside: a, a + 1, b and a + 1, b + 1, b.
+				// Rings at the poles collapse to a point, their degenerate triangles are skipped
+				const unsigned int faces[2][3] = {{a, a + 1, b}, {a + 1, b + 1, b}};
+				const bool skipped[2] = {ring == 0, ring == rings - 1};
+				for (size_t i = 0; i != 2; ++i) {
+					const unsigned int* face = faces[i];
+					if (skipped[i]) {
+						continue;
+					}
+					if (facing_center) {
+						indices.insert(indices.end(), {face[0], face[1], face[2]});
+					}
+					else {
+						indices.insert(indices.end(), {face[2], face[1], face[0]});
+					}
+				}
+			}
+		}
+	}
+
+	// Outer sphere faces out, the inner one faces its center like walls of a room.
+	// The outer one occludes the inner one from every view, so all its meshlets have to be drawn first
+	bool outward_meshlets_first()
+	{
+		std::vector<DirectX::XMFLOAT3> positions;
+		std::vector<unsigned int> indices;
+		add_sphere(positions, indices, 1.0f, false);
+		add_sphere(positions, indices, 0.5f, true);
+		std::vector<unsigned int> face_materials(indices.size() / 3, 0);
+
+		cg::world::meshlet_list meshlets = cg::world::build_meshlets(positions, indices, face_materials);
+		cg::world::index_optimization::order_meshlets_for_overdraw(indices, face_materials, meshlets);
+
+		bool passed = true;
+		bool inner_seen = false;
+		for (const cg::world::meshlet& m : meshlets.meshlets) {
+			const float distance = std::sqrt(m.center.x * m.center.x + m.center.y * m.center.y + m.center.z * m.center.z);
+			const bool inner = distance < 0.75f;
+			passed &= !(inner_seen && !inner);
+			inner_seen |= inner;
+		}
+		std::cout << (passed ? "passed: " : "FAILED: ") << "outward_meshlets_first" << std::endl;
+		return passed;
+	}
+}// namespace
+
+int main()
+{
+	bool passed = true;
+	passed &= outward_meshlets_first();
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,68 @@
+#define STB_IMAGE_IMPLEMENTATION
+
+#include "utils/png_stream.h"
+
+#include <stb_image.h>
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+
+namespace
+{
+	// Smooth images compress into long matches, noise mostly into literals
+	std::vector<unsigned char> make_image(size_t width, size_t height, bool noise)
+	{
+		std::vector<unsigned char> rgba(width * height * 4);
+		std::mt19937 random(42);
+		for (size_t i = 0; i != rgba.size(); ++i) {
+			const size_t x = i / 4 % width;
+			const size_t y = i / 4 / width;
+			rgba[i] = noise ? static_cast<unsigned char>(random()) : static_cast<unsigned char>(3 * x + 5 * y + 40 * (i % 4));
+		}
+		return rgba;
+	}
+
+	// Writes the image band by band and decodes it with stb_image
+	bool round_trip(const std::string& name, size_t width, size_t height, size_t band_height, bool noise)
+	{
+		const std::vector<unsigned char> rgba = make_image(width, height, noise);
+		const std::filesystem::path path = std::filesystem::temp_directory_path() / ("png_stream_test_" + name + ".png");
+		{
+			cg::utils::png_stream_writer writer(path, width, height);
+			for (size_t row = 0; row < height; row += band_height) {
+				writer.write_rows(rgba.data() + row * width * 4, std::min(band_height, height - row));
+			}
+			writer.close();
+		}
+
+		int decoded_width = 0, decoded_height = 0, channels = 0;
+		unsigned char* decoded = stbi_load(path.string().c_str(), &decoded_width, &decoded_height, &channels, 4);
+		std::filesystem::remove(path);
+		const bool passed = decoded && static_cast<size_t>(decoded_width) == width &&
+							static_cast<size_t>(decoded_height) == height &&
+							std::memcmp(decoded, rgba.data(), rgba.size()) == 0;
+		stbi_image_free(decoded);
+		std::cout << (passed ? "passed: " : "FAILED: ") << name << std::endl;
+		return passed;
+	}
+}// namespace
+
+int main()
+{
+	bool passed = true;
+	passed &= round_trip("single_band", 64, 64, 64, false);
+	// Last band is shorter than the others
+	passed &= round_trip("uneven_bands", 37, 29, 7, false);
+	passed &= round_trip("single_rows", 19, 11, 1, true);
+	// Filtered bands of 100 rows are 120100 bytes, more than a stored deflate block can hold
+	passed &= round_trip("large_bands", 300, 250, 100, true);
+	// Matches reach back into the window of the previous band
+	passed &= round_trip("wide_smooth", 1000, 90, 45, false);
+	return passed ? 0 : 1;
+}